@@ -0,0 +1,174 @@
+/*
+ *  dsptest.c
+ *
+ *  Copyright (c) 2019 Gabriele Mondada.
+ *  This software is distributed under the terms of the MIT license.
+ *  See https://opensource.org/licenses/MIT
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "dsp.h"
+#include "duty.h"
+
+/*
+ * Test of the packed Q15 functions, see dsp.h, against the scalar code
+ * they replace.
+ *
+ * - dsp_sincos() against sinlut_sin() and sinlut_cos(), on every angle
+ *   that is a multiple of 2^stride_shift and on every angle within 2^16 of
+ *   a quadrant boundary.
+ * - dsp_cal_lookup() against cal_lookup(), on the same angles, with a sine
+ *   table and with random tables including full-scale points.
+ * - dsp_scale() against (x * amp) >> 15, for all values in Q15 and every
+ *   17th amplitude from 0 to SINLUT_ONE.
+ * - dsp_duty() and dsp_complement() against duty_get() and top minus it,
+ *   for all values and PWM ranges from PWM_RANGE_MIN to PWM_RANGE_MAX.
+ *
+ * Phases a and b get different values, so that a swap of the lanes shows.
+ * On the host, dsp.h uses its plain C version of the SIMD instructions.
+ * The exit status is 1 on the first mismatch:
+ *
+ *   dsptest -a 12
+ */
+
+#define DSP_TABLES  4 // random calibration tables
+
+
+static const int ranges[] = { 256, 1050, 2100, 4200, 8400, 32768 };
+
+static struct cal_table table;
+static long checks;
+
+
+static uint32_t _rand(uint32_t *seed)
+{
+    *seed = *seed * 1664525u + 1013904223u;
+    return *seed;
+}
+
+static int _check(const char *name, uint32_t arg, uint32_t packed, int a, int b)
+{
+    checks++;
+    if (dsp_lo(packed) == a && dsp_hi(packed) == b)
+        return 0;
+    printf("%s(0x%08x): %d, %d instead of %d, %d\n", name, arg, dsp_lo(packed), dsp_hi(packed), a, b);
+    return -1;
+}
+
+/**
+ * Compare dsp_sincos() and dsp_cal_lookup() at the given angle.
+ */
+static int _angle(uint32_t angle)
+{
+    if (_check("dsp_sincos", angle, dsp_sincos(angle), sinlut_sin(angle), sinlut_cos(angle)))
+        return -1;
+    int a, b;
+    cal_lookup(&table, angle, &a, &b);
+    return _check("dsp_cal_lookup", angle, dsp_cal_lookup(&table, angle), a, b);
+}
+
+/**
+ * Compare the angle functions over the angles given by the stride and
+ * around the quadrant boundaries.
+ */
+static int _angles(int stride_shift)
+{
+    uint64_t stride = (uint64_t)1 << stride_shift;
+    for (uint64_t a = 0; a < ((uint64_t)1 << 32); a += stride) {
+        if (_angle((uint32_t)a))
+            return -1;
+    }
+    for (uint32_t q = 0; q < 4; q++) {
+        for (uint32_t d = 0; d < 0x10000; d++) {
+            if (_angle((q << 30) + d) || _angle((q << 30) - d - 1))
+                return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Compare dsp_scale() for all values at the given amplitude.
+ */
+static int _scale(int amp)
+{
+    for (int x = -SINLUT_ONE; x <= SINLUT_ONE; x++) {
+        uint32_t ab = dsp_pack(x, -x / 3);
+        if (_check("dsp_scale", ab, dsp_scale(ab, amp),
+                   (int16_t)((x * amp) >> 15), (int16_t)((-x / 3 * amp) >> 15)))
+            return -1;
+    }
+    return 0;
+}
+
+static void _usage(void)
+{
+    fprintf(stderr, "usage: dsptest [-a stride_shift]\n");
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    int stride_shift = 12;
+
+    int c;
+    while ((c = getopt(argc, argv, "a:h")) != -1) {
+        switch (c) {
+        case 'a': stride_shift = atoi(optarg); break;
+        default: _usage();
+        }
+    }
+    if (stride_shift < 0 || stride_shift > 31)
+        _usage();
+
+    // sines and cosines, with a sine table
+    for (int i = 0; i < CAL_SIZE; i++) {
+        uint32_t angle = (uint32_t)i << (32 - CAL_SIZE_SHIFT);
+        table.pt[i] = (struct cal_point){ (int16_t)sinlut_sin(angle), (int16_t)sinlut_cos(angle) };
+    }
+    if (_angles(stride_shift))
+        return 1;
+
+    // random tables, every 4th point at full scale
+    uint32_t seed = 1;
+    for (int t = 0; t < DSP_TABLES; t++) {
+        for (int i = 0; i < CAL_SIZE; i++) {
+            int a = (int)(_rand(&seed) % (2 * SINLUT_ONE + 1)) - SINLUT_ONE;
+            int b = (int)(_rand(&seed) % (2 * SINLUT_ONE + 1)) - SINLUT_ONE;
+            if (i % 4 == 0) {
+                a = (i & 4) ? SINLUT_ONE : -SINLUT_ONE;
+                b = (i & 8) ? SINLUT_ONE : -SINLUT_ONE;
+            }
+            table.pt[i] = (struct cal_point){ (int16_t)a, (int16_t)b };
+        }
+        if (_angles(stride_shift))
+            return 1;
+    }
+
+    // amplitude scaling, both ends included
+    for (int amp = 0; amp < SINLUT_ONE; amp += 17) {
+        if (_scale(amp))
+            return 1;
+    }
+    if (_scale(SINLUT_ONE))
+        return 1;
+
+    // duties
+    for (unsigned r = 0; r < sizeof(ranges) / sizeof(ranges[0]); r++) {
+        int top = ranges[r] - 1;
+        for (int x = -SINLUT_ONE; x <= SINLUT_ONE; x++) {
+            uint32_t ab = dsp_pack(x, -x);
+            uint32_t d = dsp_duty(ab, top);
+            if (_check("dsp_duty", ab, d, duty_get(x, top), duty_get(-x, top)) ||
+                _check("dsp_complement", d, dsp_complement(d, top),
+                       top - duty_get(x, top), top - duty_get(-x, top)))
+                return 1;
+        }
+    }
+
+    printf("%ld packed results identical to the scalar code: ok\n", checks);
+    return 0;
+}
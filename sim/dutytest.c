@@ -0,0 +1,127 @@
+/*
+ *  dutytest.c
+ *
+ *  Copyright (c) 2019 Gabriele Mondada.
+ *  This software is distributed under the terms of the MIT license.
+ *  See https://opensource.org/licenses/MIT
+ *
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "duty.h"
+
+/*
+ * Test of the duty dithering, see duty.h.
+ *
+ * For PWM ranges from PWM_RANGE_MIN to PWM_RANGE_MAX, every constant value
+ * that is a multiple of the stride is converted for n frames by
+ * duty_dither(), from a cleared residual. Each duty must be one of the two
+ * counts around the exact one, (value + SINLUT_ONE) * top / 65536, and
+ * the sum of the duties must be within one count of the exact sum, so that
+ * the average is within 1/n count. Then a slowly rotating sine, as output
+ * at low speed, is converted for as many frames and the running sum must
+ * stay within one count of the exact one at every frame.
+ *
+ * The max error of the average is reported along with that of duty_get().
+ * Both exclude the bias of approximating 2 * SINLUT_ONE by 2^16, below
+ * 2 * top / 65536 count, which dithering does not remove. The exit status
+ * is 1 on the first error:
+ *
+ *   dutytest -n 4096 -s 7
+ */
+
+#define DUTY_RANGE_MIN  256   // PWM_RANGE_MIN
+#define DUTY_RANGE_MAX  32768 // PWM_RANGE_MAX
+
+
+static const int ranges[] = { DUTY_RANGE_MIN, 1050, 2100, 4200, 8400, DUTY_RANGE_MAX };
+
+
+static double _exact(int value, int top)
+{
+    return (double)(value + SINLUT_ONE) * top / 65536.0;
+}
+
+/**
+ * Convert a constant value for the given number of frames and update the
+ * max errors of the average, with and without dither.
+ */
+static int _constant(int value, int top, int frames, double *max_dither, double *max_plain)
+{
+    double exact = _exact(value, top);
+    uint16_t err = 0;
+    long sum = 0;
+    for (int n = 0; n < frames; n++) {
+        int d = duty_dither(value, top, &err);
+        if (d < 0 || d > top || d < floor(exact) || d > floor(exact) + 1) {
+            printf("top %d, value %d, frame %d: duty %d, exact %.4f\n", top, value, n, d, exact);
+            return -1;
+        }
+        sum += d;
+    }
+    if (fabs((double)sum - exact * frames) >= 1.0) {
+        printf("top %d, value %d: sum %ld, exact %.4f\n", top, value, sum, exact * frames);
+        return -1;
+    }
+    *max_dither = fmax(*max_dither, fabs((double)sum / frames - exact));
+    *max_plain = fmax(*max_plain, fabs((double)duty_get(value, top) - exact));
+    return 0;
+}
+
+static void _usage(void)
+{
+    fprintf(stderr, "usage: dutytest [-n frames] [-s stride]\n");
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    int frames = 4096;
+    int stride = 7;
+
+    int c;
+    while ((c = getopt(argc, argv, "n:s:h")) != -1) {
+        switch (c) {
+        case 'n': frames = atoi(optarg); break;
+        case 's': stride = atoi(optarg); break;
+        default: _usage();
+        }
+    }
+    if (frames < 1 || stride < 1)
+        _usage();
+
+    for (unsigned r = 0; r < sizeof(ranges) / sizeof(ranges[0]); r++) {
+        int top = ranges[r] - 1;
+        double max_dither = 0.0;
+        double max_plain = 0.0;
+
+        // constant values, both ends included
+        for (int value = -SINLUT_ONE; value < SINLUT_ONE; value += stride) {
+            if (_constant(value, top, frames, &max_dither, &max_plain))
+                return 1;
+        }
+        if (_constant(SINLUT_ONE, top, frames, &max_dither, &max_plain))
+            return 1;
+
+        // slow rotation: a tour every 1000 frames
+        uint16_t err = 0;
+        double drift = 0.0;
+        double max_drift = 0.0;
+        for (int n = 0; n < frames; n++) {
+            int value = sinlut_sin((uint32_t)((uint64_t)n * 4294967296ull / 1000u));
+            drift += duty_dither(value, top, &err) - _exact(value, top);
+            max_drift = fmax(max_drift, fabs(drift));
+            if (max_drift >= 1.0) {
+                printf("range %d, frame %d: running sum off by %.4f count\n", ranges[r], n, drift);
+                return 1;
+            }
+        }
+
+        printf("range %5d: average error %.6f count, %.6f without dither, drift %.5f count: ok\n",
+               ranges[r], max_dither, max_plain, max_drift);
+    }
+    return 0;
+}
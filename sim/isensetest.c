@@ -0,0 +1,96 @@
+/*
+ *  isensetest.c
+ *
+ *  Copyright (c) 2019 Gabriele Mondada.
+ *  This software is distributed under the terms of the MIT license.
+ *  See https://opensource.org/licenses/MIT
+ *
+ */
+
+#include <stdio.h>
+#include "isense.h"
+
+/*
+ * Test of the scan ring readers of isense.h.
+ *
+ * The DMA is replaced by a loop writing one conversion at a time into the
+ * ring, its counter counting down from ISENSE_RING * ISENSE_COUNT to 1 and
+ * being reloaded after the last transfer, as in circular mode. After each
+ * transfer, including those that leave a scan partially written and the
+ * one that wraps the ring, isense_last() must point to the last complete
+ * scan, and isense_mean() must average the n last complete scans, for all
+ * n. Every conversion gets a distinct value, so that any scan mixup shows.
+ * The exit status is 1 on the first error.
+ */
+
+#define TRANSFERS  (ISENSE_RING * ISENSE_COUNT)
+
+
+volatile struct isense_scan isense_ring[ISENSE_RING];
+
+static int remaining = TRANSFERS;
+
+
+int isense_remaining(void)
+{
+    return remaining;
+}
+
+/**
+ * Return the value of a conversion, from its sequence number.
+ */
+static int _value(long seq)
+{
+    return (int)((seq * 37) % 4096);
+}
+
+int main(void)
+{
+    long seq = 0;       // conversions written
+    long checks = 0;
+
+    for (int i = 0; i < ISENSE_RING; i++) {
+        for (int j = 0; j < ISENSE_COUNT; j++)
+            isense_ring[i].raw[j] = ISENSE_ZERO;
+    }
+
+    // a few turns of the ring, the first one starting empty
+    while (seq < 4 * TRANSFERS) {
+        volatile uint16_t *raw = &isense_ring[0].raw[0];
+        raw[TRANSFERS - remaining] = (uint16_t)_value(seq);
+        seq++;
+        remaining = remaining == 1 ? TRANSFERS : remaining - 1;
+
+        long scans = seq / ISENSE_COUNT; // complete ones
+        if (scans < ISENSE_RING)
+            continue;
+
+        int last = isense_last(isense_remaining());
+        if (last != (int)((scans - 1) % ISENSE_RING)) {
+            printf("conversion %ld: last scan %d instead of %ld\n", seq, last, (scans - 1) % ISENSE_RING);
+            return 1;
+        }
+        for (int ch = 0; ch < ISENSE_COUNT; ch++) {
+            if (isense_raw(ch) != _value((scans - 1) * ISENSE_COUNT + ch)) {
+                printf("conversion %ld, channel %d: raw %d instead of %d\n",
+                       seq, ch, isense_raw(ch), _value((scans - 1) * ISENSE_COUNT + ch));
+                return 1;
+            }
+            for (int n = 1; n < ISENSE_RING; n++) {
+                int sum = 0;
+                for (int k = 1; k <= n; k++)
+                    sum += _value((scans - k) * ISENSE_COUNT + ch);
+                int mean = (sum + n / 2) / n;
+                if (isense_mean(ch, n) != mean) {
+                    printf("conversion %ld, channel %d: mean of %d scans %d instead of %d\n",
+                           seq, ch, n, isense_mean(ch, n), mean);
+                    return 1;
+                }
+                checks++;
+            }
+        }
+    }
+
+    printf("%ld means checked over %d ring positions: ok\n", checks, TRANSFERS);
+    return 0;
+}
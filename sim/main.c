@@ -0,0 +1,111 @@
+/*
+ *  main.c
+ *
+ *  Copyright (c) 2019 Gabriele Mondada.
+ *  This software is distributed under the terms of the MIT license.
+ *  See https://opensource.org/licenses/MIT
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "motsim.h"
+#include "move.h"
+
+/*
+ * Host simulation of a movement, see move.c.
+ *
+ * The exit status is 1 if the rotor slipped, or ended or vibrated further
+ * than the tolerance from the target, so that the tool can be used in
+ * regression scripts:
+ *
+ *   motsim -m nema17 -s 20 -a 400 -d 100
+ *
+ * The anti-resonance damper is enabled with -D, fed by an encoder or by
+ * the back-EMF observer (-S emf), whose winding parameters can be detuned
+ * with -R and -L, and started at any angle with -O. -J multiplies the
+ * inertia, -P delays the output by the given number of cycles:
+ *
+ *   motsim -m nema17 -A 0.3 -J 3 -s 150 -P 4 -D 0.6 -S emf -L 3.4e-3
+ *
+ * -C closes the loop on the encoder with the given max load angle, -E
+ * reading the encoder when frames are computed rather than output:
+ *
+ *   motsim -m nema17 -A 0.2 -s 300 -a 3000 -d 500 -P 4 -C 90
+ */
+
+static void _usage(void)
+{
+    fprintf(stderr,
+            "usage: motsim [-m motor] [-s spd] [-a acc] [-d dist] [-A amp] [-f freq]\n"
+            "              [-r range] [-p plan_shift] [-t settle] [-e tolerance] [-c trace]\n"
+            "              [-J inertia_factor] [-P ahead] [-D damp_ms] [-S enc|emf] [-R ohm] [-L H]\n"
+            "              [-O deg] [-C lead_deg] [-E]\n"
+            "motors:");
+    for (const struct motsim_motor *m = motsim_motors; m->name; m++)
+        fprintf(stderr, " %s", m->name);
+    fprintf(stderr, "\n");
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    struct move_params p = move_defaults;
+    const char *name = "nema17";
+    int trace = 0;
+    float inertia = 1.0f;
+
+    int c;
+    while ((c = getopt(argc, argv, "m:s:a:d:A:f:r:p:t:e:c:J:P:D:S:R:L:O:C:Eh")) != -1) {
+        switch (c) {
+        case 'm': name = optarg; break;
+        case 's': p.spd = strtof(optarg, NULL); break;
+        case 'a': p.acc = strtof(optarg, NULL); break;
+        case 'd': p.dist = strtof(optarg, NULL); break;
+        case 'A': p.amp = strtof(optarg, NULL); break;
+        case 'f': p.freq = atoi(optarg); break;
+        case 'r': p.range = atoi(optarg); break;
+        case 'p': p.plan_shift = atoi(optarg); break;
+        case 't': p.settle = strtof(optarg, NULL); break;
+        case 'e': p.tolerance = strtof(optarg, NULL); break;
+        case 'c': trace = atoi(optarg); break;
+        case 'J': inertia = strtof(optarg, NULL); break;
+        case 'P': p.ahead = atoi(optarg); break;
+        case 'D': p.damp = strtof(optarg, NULL); break;
+        case 'S': p.damp_src = strcmp(optarg, "emf") == 0 ? MOVE_DAMP_EMF : MOVE_DAMP_ENC; break;
+        case 'R': p.damp_r = strtof(optarg, NULL); break;
+        case 'L': p.damp_l = strtof(optarg, NULL); break;
+        case 'O': p.damp_offset = strtof(optarg, NULL); break;
+        case 'C': p.cloop_lead = strtof(optarg, NULL); break;
+        case 'E': p.enc_early = true; break;
+        default: _usage();
+        }
+    }
+
+    const struct motsim_motor *motor = motsim_find(name);
+    if (!motor || p.freq <= 0 || p.range < 2)
+        _usage();
+
+    struct motsim sim;
+    struct move_result r;
+    motsim_init(&sim, motor, p.range);
+    sim.m.j *= inertia;
+
+    clock_t t0 = clock();
+    move_run(&p, &sim, &r, trace ? stdout : NULL, trace);
+    double wall = (double)(clock() - t0) / CLOCKS_PER_SEC;
+
+    fprintf(stderr, "motor %s: %.3f s simulated in %.3f s (x%.0f)\n",
+            motor->name, sim.t, wall, wall > 0.0 ? sim.t / wall : 0.0);
+    fprintf(stderr, "move %.3f s, error %.3f, residual %.3f electric tours\n",
+            r.move_time, r.error, r.residual);
+    if (p.cloop_lead > 0.0f)
+        fprintf(stderr, "max following error %.1f deg\n", r.follow_max);
+    fprintf(stderr, "max load angle %.1f deg, max current %.2f A, slips %d: %s\n",
+            r.load_angle_max, r.i_max, r.slips, r.ok ? "ok" : "STEPS LOST");
+
+    return r.ok ? 0 : 1;
+}
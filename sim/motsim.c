@@ -0,0 +1,150 @@
+/*
+ *  motsim.c
+ *
+ *  Copyright (c) 2019 Gabriele Mondada.
+ *  This software is distributed under the terms of the MIT license.
+ *  See https://opensource.org/licenses/MIT
+ *
+ */
+
+#include <math.h>
+#include <string.h>
+#include "motsim.h"
+
+/*
+ * Stepper motor plant.
+ *
+ * Averaged model of a two-phase hybrid stepper driven by two H-bridges. The
+ * voltage of a phase is vbus times the difference of the duties of its two
+ * ports, PWM ripple being ignored. With e the electric angle of the rotor
+ * and w its mechanical speed:
+ *
+ *   va = R ia + L dia/dt + km w cos(e)
+ *   vb = R ib + L dib/dt - km w sin(e)
+ *   T  = km (ia cos(e) - ib sin(e)) - detent sin(4 e)
+ *
+ * so that currents ia = I sin(a) and ib = I cos(a), as commutated by the
+ * firmware, hold the rotor at e = a. The rotor carries the inertia j,
+ * viscous friction b and a Coulomb friction load, which also holds it at
+ * standstill.
+ *
+ * The load angle is the electric angle between the current vector and the
+ * rotor. Beyond half a tour, the rotor falls into the next pole: a slip is
+ * counted and the reference moves by a tour, so that further slips are
+ * counted as well.
+ */
+
+const struct motsim_motor motsim_motors[] = {
+    {
+        .name = "nema17",   // 17HS4401, 1.7 A, 0.4 Nm
+        .r = 1.5, .l = 2.8e-3, .km = 0.24, .detent = 0.015,
+        .j = 5.4e-6 + 5e-6, .b = 1e-4, .load = 0.02, .vbus = 12.0, .poles = 50,
+    }, {
+        .name = "nema23",   // 23HS22, 2.8 A, 1.2 Nm
+        .r = 0.9, .l = 2.5e-3, .km = 0.43, .detent = 0.04,
+        .j = 3e-5 + 3e-5, .b = 3e-4, .load = 0.05, .vbus = 24.0, .poles = 50,
+    }, {
+        .name = NULL,
+    }
+};
+
+
+const struct motsim_motor *motsim_find(const char *name)
+{
+    for (const struct motsim_motor *m = motsim_motors; m->name; m++) {
+        if (strcmp(m->name, name) == 0)
+            return m;
+    }
+    return NULL;
+}
+
+/**
+ * Start at rest with the rotor at angle 0, all ports low.
+ */
+void motsim_init(struct motsim *me, const struct motsim_motor *m, int range)
+{
+    memset(me, 0, sizeof(*me));
+    me->m = *m;
+    me->range = range;
+}
+
+void motsim_set_duty(struct motsim *me, int port, uint32_t duty)
+{
+    me->duty[port] = duty;
+}
+
+static double _wrap(double a)
+{
+    return a - 2.0 * M_PI * floor(a / (2.0 * M_PI) + 0.5);
+}
+
+static void _step(struct motsim *me, double h)
+{
+    const struct motsim_motor *m = &me->m;
+    double scale = m->vbus / (double)(me->range - 1);
+    double va = ((double)me->duty[0] - (double)me->duty[1]) * scale;
+    double vb = ((double)me->duty[2] - (double)me->duty[3]) * scale;
+    double e = m->poles * me->theta;
+    double c = cos(e);
+    double s = sin(e);
+
+    // electrical
+    me->ia += (va - m->r * me->ia - m->km * me->omega * c) / m->l * h;
+    me->ib += (vb - m->r * me->ib + m->km * me->omega * s) / m->l * h;
+
+    // mechanical, the load sticks at standstill
+    double t = m->km * (me->ia * c - me->ib * s) - m->detent * sin(4.0 * e);
+    double net = t - m->b * me->omega;
+    me->torque = t;
+    if (me->omega == 0.0 && fabs(net) <= m->load) {
+        net = 0.0;
+    } else {
+        double dir = me->omega != 0.0 ? (me->omega > 0.0 ? 1.0 : -1.0) : (net > 0.0 ? 1.0 : -1.0);
+        net -= m->load * dir;
+    }
+    double omega = me->omega + net / m->j * h;
+    if (me->omega != 0.0 && omega * me->omega < 0.0)
+        omega = 0.0; // friction does not reverse the motion
+    me->theta += 0.5 * (me->omega + omega) * h;
+    me->omega = omega;
+    me->t += h;
+
+    // slips, when there is a current vector to follow
+    double i2 = me->ia * me->ia + me->ib * me->ib;
+    double i = sqrt(i2);
+    if (i > me->i_max)
+        me->i_max = i;
+    if (i2 > 1e-6) {
+        double f = atan2(me->ia, me->ib);
+        me->field += _wrap(f - me->field);
+        double d = me->field - m->poles * me->theta - me->slip_offset;
+        if (d > M_PI) {
+            me->slips++;
+            me->slip_offset += 2.0 * M_PI;
+        } else if (d < -M_PI) {
+            me->slips++;
+            me->slip_offset -= 2.0 * M_PI;
+        }
+        me->load_angle = _wrap(d);
+        if (fabs(me->load_angle) > me->load_angle_max)
+            me->load_angle_max = fabs(me->load_angle);
+    }
+}
+
+/**
+ * Advance by dt seconds with the current duties.
+ */
+void motsim_run(struct motsim *me, double dt)
+{
+    int n = (int)ceil(dt / MOTSIM_STEP);
+    for (int i = 0; i < n; i++)
+        _step(me, dt / n);
+}
+
+/**
+ * Return the rotor position in electric tours, as the ramp position.
+ */
+double motsim_position(const struct motsim *me)
+{
+    return me->theta * me->m.poles / (2.0 * M_PI);
+}
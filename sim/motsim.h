@@ -0,0 +1,79 @@
+/*
+ *  motsim.h
+ *
+ *  Copyright (c) 2019 Gabriele Mondada.
+ *  This software is distributed under the terms of the MIT license.
+ *  See https://opensource.org/licenses/MIT
+ *
+ */
+
+#ifndef _MOTSIM_H_
+#define _MOTSIM_H_
+
+#include <stdint.h>
+
+
+/*** literals ***/
+
+#define MOTSIM_STEP  5e-6 // max integration step in seconds
+
+
+/*** types ***/
+
+/*
+ * Two-phase hybrid stepper with its load. Angles are mechanical, the
+ * electric angle being poles times larger.
+ */
+struct motsim_motor {
+    const char *name;
+    double r;       // phase resistance in ohm
+    double l;       // phase inductance in H
+    double km;      // torque constant in Nm/A, also the back-EMF in Vs/rad
+    double detent;  // detent torque amplitude in Nm
+    double j;       // rotor and load inertia in kg m^2
+    double b;       // viscous friction in Nm s/rad
+    double load;    // Coulomb friction of the load in Nm
+    double vbus;    // supply voltage of the H-bridges in V
+    int poles;      // electric tours per turn, 50 for 200 full steps
+};
+
+struct motsim {
+    struct motsim_motor m;
+    int range;          // duties go from 0 to range - 1, as pwm_range
+    uint32_t duty[4];   // ports a, -a, b, -b, as written by the firmware
+
+    // state
+    double t;           // time in s
+    double ia;          // phase currents in A
+    double ib;
+    double theta;       // rotor angle in rad
+    double omega;       // rotor speed in rad/s
+
+    // outputs
+    double torque;      // motor torque in Nm
+    double load_angle;  // current vector ahead of the rotor, electric rad
+    double load_angle_max;
+    double i_max;       // max phase current in A
+    int slips;          // pole slips, each one losing 4 full steps
+
+    // slip tracking
+    double field;       // unwrapped electric angle of the current vector
+    double slip_offset;
+};
+
+
+/*** globals ***/
+
+extern const struct motsim_motor motsim_motors[]; // ends with a null name
+
+
+/*** prototypes ***/
+
+const struct motsim_motor *motsim_find(const char *name);
+void motsim_init(struct motsim *me, const struct motsim_motor *m, int range);
+void motsim_set_duty(struct motsim *me, int port, uint32_t duty);
+void motsim_run(struct motsim *me, double dt);
+double motsim_position(const struct motsim *me);
+
+
+#endif
@@ -0,0 +1,211 @@
+/*
+ *  move.c
+ *
+ *  Copyright (c) 2019 Gabriele Mondada.
+ *  This software is distributed under the terms of the MIT license.
+ *  See https://opensource.org/licenses/MIT
+ *
+ */
+
+#include <math.h>
+#include "move.h"
+#include "cloop.h"
+#include "damp.h"
+#include "ramp.h"
+#include "sinlut.h"
+
+/*
+ * Simulated movement.
+ *
+ * Runs the firmware ramp and commutation at the control rate on a simulated
+ * motor, from standstill at 0 to the given distance. Duties are computed as
+ * stepper_pwm() does. Only depends on its inputs, so that runs can be
+ * repeated and parallelized.
+ *
+ * Voltages can be computed some cycles ahead of the output, like the
+ * commutation pipeline of the firmware does, which delays the feedback of
+ * the anti-resonance damper. The damper gets the following error from an
+ * encoder of MOVE_ENC_CPT counts per electric tour, or from the back-EMF
+ * observer fed with currents quantized as by the firmware current sensors.
+ *
+ * With an encoder, the commutation can be closed-loop, see cloop.c. As in
+ * the firmware ISR, frames then only hold the commanded position and the
+ * voltages are computed from the count read when the frame is output, the
+ * damper included. enc_early reads it when the frame is computed instead,
+ * to measure what the pipeline delay costs.
+ */
+
+#define MOVE_ENC_CPT      80                       // as the firmware default
+#define MOVE_ISENSE_GAIN  (3.3 / 4096.0 / 0.4)     // A per count, as the firmware default
+#define MOVE_ENC_THR      90.0                     // step-loss threshold in degrees, as the firmware default
+
+struct move_frame {
+    traj_pos_t x;     // commanded position
+    int v;            // in increments per cycle
+    int16_t va;       // voltages in Q15
+    int16_t vb;
+};
+
+const struct move_params move_defaults = {
+    .spd = RAMP_SPD,
+    .acc = RAMP_ACC,
+    .dist = 100.0f,
+    .amp = 0.25f,
+    .freq = 20000,
+    .range = 2100,
+    .plan_shift = 1,
+    .settle = 0.2f,
+    .tolerance = 0.05f,
+    .damp_src = MOVE_DAMP_ENC,
+    .damp_max = 90.0f,
+    .damp_vmin = 50.0f,
+};
+
+
+static int _duty(int value, int range)
+{
+    return ((value + SINLUT_ONE) * (range - 1) + SINLUT_ONE) >> 16;
+}
+
+/**
+ * Set up the damper as the firmware does from its registers.
+ */
+static void _damp_init(struct damp *d, const struct move_params *p, const struct motsim *sim)
+{
+    double cycle_time = 1.0 / (double)p->freq;
+    double r = p->damp_r > 0.0f ? p->damp_r : sim->m.r;
+    double l = p->damp_l > 0.0f ? p->damp_l : sim->m.l;
+    double q = MOVE_ISENSE_GAIN / sim->m.vbus * SINLUT_ONE; // Q15 voltage per ohm per count
+
+    damp_init(d);
+    d->gain = (int32_t)lround(fmax(p->damp, 0.0f) * 1e-3 / cycle_time * 65536.0);
+    d->max = (traj_pos_t)lround(p->damp_max / 360.0 * RAMP_POS_SCALE);
+    d->v_min = (int32_t)lround(p->damp_vmin * RAMP_POS_SCALE * cycle_time);
+    d->lp_shift = p->damp_src == MOVE_DAMP_EMF ? DAMP_EMF_LP_SHIFT : 0;
+    d->r = (float)(r * q);
+    d->l = (float)(l / cycle_time * q);
+    d->theta = (uint32_t)(int64_t)llround(p->damp_offset / 360.0 * 4294967296.0);
+}
+
+/**
+ * Set up the closed loop as the firmware does from its registers.
+ */
+static void _cloop_init(struct cloop *c, const struct move_params *p)
+{
+    double deg = RAMP_POS_SCALE / 360.0;
+    cloop_init(c);
+    c->scale = llround((double)RAMP_POS_SCALE / MOVE_ENC_CPT * 65536.0);
+    c->lead_max = (traj_pos_t)lround(fmin(fmax(p->cloop_lead, 0.0f), 180.0f) * deg);
+    c->loss_thr = (traj_pos_t)lround(MOVE_ENC_THR * deg);
+    cloop_start(c, 0, 0);
+}
+
+/**
+ * Compute the voltages of frame f, from the encoder and the back-EMF
+ * observer as needed.
+ */
+static void _commutate(const struct move_params *p, const struct motsim *sim, struct cloop *c,
+                       struct damp *d, int amp, struct move_frame *f)
+{
+    double counts = floor(motsim_position(sim) * MOVE_ENC_CPT);
+    traj_pos_t x = f->x;
+    if (p->cloop_lead > 0.0f)
+        x = cloop_cycle(c, (uint32_t)(int64_t)counts, x, &amp);
+    uint32_t alpha = (uint32_t)x << (32 - RAMP_POS_SHIFT);
+    if (d->gain) {
+        traj_pos_t err;
+        if (p->damp_src == MOVE_DAMP_EMF)
+            err = damp_emf_err(d, f->x);
+        else if (p->cloop_lead > 0.0f)
+            err = c->err;
+        else
+            err = f->x - (traj_pos_t)llround(counts / MOVE_ENC_CPT * RAMP_POS_SCALE);
+        alpha += (uint32_t)damp_cycle(d, err, f->v, 1) << (32 - RAMP_POS_SHIFT);
+    }
+    f->va = (int16_t)((sinlut_sin(alpha) * amp) >> 15);
+    f->vb = (int16_t)((sinlut_cos(alpha) * amp) >> 15);
+}
+
+/**
+ * Run the movement on sim, which must have been initialized. If trace is
+ * not NULL, a CSV line is printed every trace_div cycles.
+ */
+void move_run(const struct move_params *p, struct motsim *sim, struct move_result *r, FILE *trace, int trace_div)
+{
+    float cycle_time = 1.0f / (float)p->freq;
+    struct ramp ramp = { 0 };
+    ramp_init(&ramp, cycle_time);
+    ramp_set_plan(&ramp, p->plan_shift, RAMP_INTERP_LINEAR);
+    ramp_set_spd(&ramp, p->spd);
+    ramp_set_acc(&ramp, p->acc);
+    ramp.traj.sx = (traj_pos_t)llround((double)p->dist * RAMP_POS_SCALE);
+    ramp.traj.sdir = 0;
+    traj_update(&ramp.traj);
+
+    int amp = (int)lroundf(fminf(fmaxf(p->amp, 0.0f), 1.0f) * SINLUT_ONE);
+    long settle = lroundf(p->settle * (float)p->freq);
+    long cycles = 0;
+
+    struct damp damp;
+    _damp_init(&damp, p, sim);
+    struct cloop cloop;
+    _cloop_init(&cloop, p);
+    // encoder read when the frame is output, as by the firmware ISR
+    bool late = (p->cloop_lead > 0.0f || (damp.gain && p->damp_src == MOVE_DAMP_ENC)) && !p->enc_early;
+
+    // frames computed ahead, starting at standstill
+    struct move_frame frames[MOVE_AHEAD_MAX + 1];
+    int frame_count = (p->ahead < 0 ? 0 : p->ahead > MOVE_AHEAD_MAX ? MOVE_AHEAD_MAX : p->ahead) + 1;
+    for (int i = 0; i < frame_count; i++)
+        frames[i] = (struct move_frame){ .vb = (int16_t)amp };
+
+    *r = (struct move_result){ 0 };
+    if (trace)
+        fprintf(trace, "t,cmd,pos,ia,ib,torque,load_angle\n");
+
+    while (settle > 0) {
+        ramp_cycle(&ramp, 1);
+        struct move_frame *f = &frames[cycles % frame_count];
+        f->x = ramp.x;
+        f->v = ramp.v;
+        if (!late)
+            _commutate(p, sim, &cloop, &damp, amp, f);
+
+        f = &frames[(cycles + 1) % frame_count];
+        if (late)
+            _commutate(p, sim, &cloop, &damp, amp, f);
+        if (damp.gain && p->damp_src == MOVE_DAMP_EMF) {
+            damp_observe(&damp, (int)lround(sim->ia / MOVE_ISENSE_GAIN),
+                         (int)lround(sim->ib / MOVE_ISENSE_GAIN), f->va, f->vb, 1);
+        }
+        int a = _duty(f->va, p->range);
+        int b = _duty(f->vb, p->range);
+        motsim_set_duty(sim, 0, (uint32_t)a);
+        motsim_set_duty(sim, 1, (uint32_t)(p->range - 1 - a));
+        motsim_set_duty(sim, 2, (uint32_t)b);
+        motsim_set_duty(sim, 3, (uint32_t)(p->range - 1 - b));
+        motsim_run(sim, cycle_time);
+
+        if (trace && cycles % trace_div == 0) {
+            fprintf(trace, "%.6f,%.4f,%.4f,%.4f,%.4f,%.4f,%.2f\n",
+                    sim->t, (double)ramp.x / RAMP_POS_SCALE, motsim_position(sim),
+                    sim->ia, sim->ib, sim->torque, sim->load_angle * 180.0 / M_PI);
+        }
+        cycles++;
+        if (!ramp.traj.jl_moving) {
+            if (r->move_time == 0.0)
+                r->move_time = sim->t;
+            double d = fabs(motsim_position(sim) - p->dist);
+            if (d > r->residual)
+                r->residual = d;
+            settle--;
+        }
+    }
+
+    r->error = motsim_position(sim) - (double)ramp.x / RAMP_POS_SCALE;
+    r->load_angle_max = sim->load_angle_max * 180.0 / M_PI;
+    r->i_max = sim->i_max;
+    r->follow_max = (double)cloop.err_max * 360.0 / RAMP_POS_SCALE;
+    r->slips = sim->slips;
+    r->ok = !r->slips && fabs(r->error) <= p->tolerance && r->residual <= p->tolerance;
+}
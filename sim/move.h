@@ -0,0 +1,71 @@
+/*
+ *  move.h
+ *
+ *  Copyright (c) 2019 Gabriele Mondada.
+ *  This software is distributed under the terms of the MIT license.
+ *  See https://opensource.org/licenses/MIT
+ *
+ */
+
+#ifndef _MOVE_H_
+#define _MOVE_H_
+
+#include <stdbool.h>
+#include <stdio.h>
+#include "motsim.h"
+
+
+/*** literals ***/
+
+#define MOVE_DAMP_ENC     0 // damping from an encoder
+#define MOVE_DAMP_EMF     1 // damping from the back-EMF observer
+#define MOVE_AHEAD_MAX    16
+
+
+/*** types ***/
+
+struct move_params {
+    float spd;        // electric tours per second
+    float acc;        // electric tours per second^2
+    float dist;       // electric tours
+    float amp;        // voltage amplitude, from 0 to 1
+    int freq;         // control cycles per second
+    int range;        // PWM range
+    int plan_shift;   // the jerk window lasts TRAJ_JL_SIZE << plan_shift cycles
+    float settle;     // time simulated after the end of the movement, in s
+    float tolerance;  // max final error and residual vibration, in electric tours
+    int ahead;        // cycles computed ahead of the output, as by the firmware pipeline
+    float damp;       // anti-resonance gain in ms, 0 to disable, see damp.c
+    int damp_src;     // MOVE_DAMP_xxx
+    float damp_max;   // max correction in degrees
+    float damp_vmin;  // damper idle below this speed, in electric tours per second
+    float damp_r;     // winding resistance assumed by the observer in ohms, 0 for the exact one
+    float damp_l;     // winding inductance assumed by the observer in H, 0 for the exact one
+    float damp_offset; // initial back-EMF angle of the observer in degrees, arbitrary in the firmware
+    float cloop_lead; // closed-loop max load angle in degrees, 0 for open loop, see cloop.c
+    bool enc_early;   // read the encoder when the frame is computed instead of output
+};
+
+struct move_result {
+    double move_time;  // until the ramp stops, in s
+    double error;      // final rotor position - target, in electric tours
+    double residual;   // max distance to the target while settling
+    double load_angle_max; // in degrees
+    double i_max;      // in A
+    double follow_max; // max closed-loop following error, in degrees
+    int slips;
+    bool ok;           // no slip, error and residual within tolerance
+};
+
+
+/*** globals ***/
+
+extern const struct move_params move_defaults;
+
+
+/*** prototypes ***/
+
+void move_run(const struct move_params *p, struct motsim *sim, struct move_result *r, FILE *trace, int trace_div);
+
+
+#endif
@@ -0,0 +1,202 @@
+/*
+ *  pitest.c
+ *
+ *  Copyright (c) 2019 Gabriele Mondada.
+ *  This software is distributed under the terms of the MIT license.
+ *  See https://opensource.org/licenses/MIT
+ *
+ */
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "duty.h"
+#include "motsim.h"
+#include "pi.h"
+#include "sinlut.h"
+
+/*
+ * Step response of the current regulator, see pi.h, on a locked winding.
+ *
+ * One phase of the motor is an R-L circuit driven by the H-bridge, the
+ * voltage being held for a whole control cycle. The regulator runs at the
+ * firmware control rate: with the default 20 kHz PWM, rc_cycle_div is 2
+ * update events in center-aligned mode and 1 in edge-aligned mode, so the
+ * regulator runs once per PWM period. Gains are scaled, currents sampled
+ * and duties quantized as by the firmware. The current is sampled at the
+ * start of the cycle and the duty takes effect delay cycles later: 1 for
+ * the motor on TIM1, 2 for the others in DMA mode, see frame alignment in
+ * pwm.c.
+ *
+ * Two steps are run: from 0 to cur_set, then, with a reference beyond what
+ * the bus voltage can drive, back to 10% of it once the output saturated,
+ * which shows whether the integrator wound up. The exit status is 1 if the
+ * first step overshoots by more than max_overshoot or is not settled
+ * within 2% after max_settle, or if the second one is not settled after
+ * max_settle either:
+ *
+ *   pitest -m nema17 -d 2
+ */
+
+#define PITEST_FREQ       20000                  // control cycles per second
+#define PITEST_RANGE      2100                   // PWM range at 20 kHz, center-aligned
+#define PITEST_GAIN       (3.3 / 4096.0 / 0.4)   // A per count, as the firmware default
+#define PITEST_ZERO       2048                   // ADC count at 0 A
+#define PITEST_DELAY_MAX  8
+#define PITEST_SATURATE   0.02                   // s at saturation before the second step
+
+
+struct pitest {
+    // parameters
+    double r;         // ohm
+    double l;         // H
+    double vbus;      // V
+    int delay;        // cycles from the sample to the voltage
+    double cur_set;   // A at full reference
+    double kp;        // full scale voltage per A of error, as stNkp
+    double ki;        // full scale voltage per A of error per ms, as stNki
+
+    // state
+    struct pi pi;
+    int cur_scale;
+    double i;         // winding current in A
+    int out[PITEST_DELAY_MAX + 1]; // regulator outputs not applied yet, in Q15
+    long cycle;
+};
+
+
+/**
+ * Scale the gains as _cur_update() does in the firmware.
+ */
+static void _init(struct pitest *me)
+{
+    double cycle_time = 1.0 / PITEST_FREQ;
+    double q = PITEST_GAIN * SINLUT_ONE * (1 << PI_SHIFT);
+    pi_init(&me->pi, -SINLUT_ONE, SINLUT_ONE);
+    me->pi.kp = (int32_t)lround(me->kp * q);
+    me->pi.ki = (int32_t)lround(me->ki * 1000.0 * cycle_time * q);
+    me->cur_scale = (int)lround(fmin(me->cur_set / PITEST_GAIN, 32767.0));
+    me->i = 0.0;
+    for (int k = 0; k <= PITEST_DELAY_MAX; k++)
+        me->out[k] = 0;
+    me->cycle = 0;
+}
+
+/**
+ * Run one control cycle for the reference ref, in Q15 of cur_set.
+ */
+static void _cycle(struct pitest *me, int ref)
+{
+    int count = (int)lround(me->i / PITEST_GAIN) + PITEST_ZERO;
+    count = count < 0 ? 0 : count > 4095 ? 4095 : count;
+    int u = pi_cycle(&me->pi, ((ref * me->cur_scale) >> 15) - (count - PITEST_ZERO));
+    me->out[(me->cycle + me->delay) % (PITEST_DELAY_MAX + 1)] = u;
+
+    // H-bridge with ports a and -a, then exact step of the R-L circuit
+    int d = duty_get(me->out[me->cycle % (PITEST_DELAY_MAX + 1)], PITEST_RANGE - 1);
+    double v = me->vbus * (double)(2 * d - (PITEST_RANGE - 1)) / (double)(PITEST_RANGE - 1);
+    double k = exp(-me->r / me->l / PITEST_FREQ);
+    me->i = me->i * k + v / me->r * (1.0 - k);
+    me->cycle++;
+}
+
+/**
+ * Run a step to the reference ref for the given number of cycles and
+ * report the overshoot from the start current, in fraction of the step,
+ * and the time after which the current stays within 2% of the step.
+ */
+static void _step(struct pitest *me, int ref, long cycles, FILE *trace, double *overshoot, double *settle)
+{
+    double start = me->i;
+    double target = (double)ref / SINLUT_ONE * me->cur_set;
+    double span = fabs(target - start);
+    long settled = 0;
+
+    *overshoot = 0.0;
+    for (long n = 1; n <= cycles; n++) {
+        _cycle(me, ref);
+        double over = (target > start ? me->i - target : target - me->i) / span;
+        if (over > *overshoot)
+            *overshoot = over;
+        if (fabs(me->i - target) > 0.02 * span)
+            settled = n;
+        if (trace)
+            fprintf(trace, "%.6f,%.4f,%.4f\n", (double)me->cycle / PITEST_FREQ, target, me->i);
+    }
+    *settle = (double)settled / PITEST_FREQ;
+}
+
+static void _usage(void)
+{
+    fprintf(stderr,
+            "usage: pitest [-m motor] [-d delay] [-I cur_set] [-k kp] [-i ki]\n"
+            "              [-o max_overshoot] [-s max_settle_ms] [-c]\n"
+            "motors:");
+    for (const struct motsim_motor *m = motsim_motors; m->name; m++)
+        fprintf(stderr, " %s", m->name);
+    fprintf(stderr, "\n");
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *name = "nema17";
+    struct pitest t = {
+        .delay = 1,
+        .cur_set = 1.0,
+        .kp = 0.1, // firmware defaults
+        .ki = 0.1,
+    };
+    double max_overshoot = 0.1;
+    double max_settle = 10.0;
+    bool trace = false;
+
+    int c;
+    while ((c = getopt(argc, argv, "m:d:I:k:i:o:s:ch")) != -1) {
+        switch (c) {
+        case 'm': name = optarg; break;
+        case 'd': t.delay = atoi(optarg); break;
+        case 'I': t.cur_set = strtod(optarg, NULL); break;
+        case 'k': t.kp = strtod(optarg, NULL); break;
+        case 'i': t.ki = strtod(optarg, NULL); break;
+        case 'o': max_overshoot = strtod(optarg, NULL); break;
+        case 's': max_settle = strtod(optarg, NULL); break;
+        case 'c': trace = true; break;
+        default: _usage();
+        }
+    }
+
+    const struct motsim_motor *motor = motsim_find(name);
+    if (!motor || t.delay < 0 || t.delay > PITEST_DELAY_MAX || t.cur_set <= 0.0)
+        _usage();
+    t.r = motor->r;
+    t.l = motor->l;
+    t.vbus = motor->vbus;
+    long cycles = lround(4.0 * max_settle * 1e-3 * PITEST_FREQ);
+    double settle_max = max_settle * 1e-3;
+
+    FILE *f = trace ? stdout : NULL;
+    if (f)
+        fprintf(f, "t,ref,i\n");
+    double over1, settle1, over2, settle2;
+
+    _init(&t);
+    _step(&t, SINLUT_ONE, cycles, f, &over1, &settle1);
+
+    // saturate, then come back
+    _init(&t);
+    t.cur_set = 1.25 * t.vbus / t.r;
+    t.cur_scale = (int)lround(fmin(t.cur_set / PITEST_GAIN, 32767.0));
+    _step(&t, SINLUT_ONE, lround(PITEST_SATURATE * PITEST_FREQ), f, &over2, &settle2);
+    _step(&t, SINLUT_ONE / 10, cycles, f, &over2, &settle2);
+
+    bool ok = over1 <= max_overshoot && settle1 <= settle_max && settle2 <= settle_max;
+    fprintf(stderr, "motor %s, %d Hz, delay %d: step overshoot %.1f%%, settled in %.2f ms, "
+            "after saturation in %.2f ms: %s\n",
+            motor->name, PITEST_FREQ, t.delay, over1 * 100.0, settle1 * 1e3, settle2 * 1e3,
+            ok ? "ok" : "FAILED");
+
+    return ok ? 0 : 1;
+}
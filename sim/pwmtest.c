@@ -0,0 +1,285 @@
+/*
+ *  pwmtest.c
+ *
+ *  Copyright (c) 2019 Gabriele Mondada.
+ *  This software is distributed under the terms of the MIT license.
+ *  See https://opensource.org/licenses/MIT
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "pwmcore.h"
+
+/*
+ * Test of the duty staging and routing of pwmcore.c, see frame alignment and
+ * DMA in pwm.c, against a model of the timers behind struct pwm_hal.
+ *
+ * Each timer has preloaded CCRs, latched to its outputs at each update
+ * event, except for TIM1 which only latches at its update interrupts. A
+ * timer in DMA mode then bursts its frame to its CCRs. At each interrupt,
+ * every divider events, a random divider from 1 to DIV_MAX, the interrupt
+ * calls pwm_flush() and writes the next frame number to all ports with
+ * pwm_set(). Between events, DMA is switched on and off with pwm_set_dma()
+ * and TIM8 and TIM5 are taken and given back as by the step/dir output and
+ * the encoder input.
+ *
+ * - The outputs of a timer always show a single frame, which never goes
+ *   back and never skips one, also across DMA switches, except when DMA is
+ *   switched off with three frames in flight, output, latched and burst,
+ *   as happens when frames last one event, see DMA in pwm.c.
+ * - Once settled, the outputs of each timer are those of TIM1 one event
+ *   before, or two in DMA mode.
+ * - The CCRs of a taken timer are not written and no DMA is started on it,
+ *   nor ever on TIM1.
+ *
+ * The exit status is 1 on the first error:
+ *
+ *   pwmtest -n 1000000 -s 1
+ */
+
+#define DIV_MAX   4
+#define SENTINEL  0xdeadbeefu // CCR value of taken timers
+#define STEP_INDEX  (PWM_TIM_COUNT - 1) // TIM8
+#define ENC_INDEX   (PWM_ENC_PORT / 4)  // TIM5
+
+
+struct mock_tim {
+    volatile uint32_t ccr[4];     // preload
+    uint32_t out[4];              // active
+    const struct pwm_frame *dma;  // bursting frame, or NULL
+    bool taken;
+    bool skip;                    // a frame may be dropped, see pwm_set_dma()
+    long check_from;              // event from which outputs are checked
+    long settle;                  // event from which the lag is checked
+    int frame;                    // last output frame, -1 if unknown
+};
+
+static struct mock_tim tims[PWM_TIM_COUNT];
+static int *tim1_frames; // TIM1 output frame at each event
+static long event;
+static int errors;
+
+
+static uint32_t _rand(uint32_t *seed)
+{
+    *seed = *seed * 1664525u + 1013904223u;
+    return *seed >> 8;
+}
+
+static void _error(const char *msg, int index)
+{
+    if (!errors)
+        printf("event %ld, timer %d: %s\n", event, index, msg);
+    errors++;
+}
+
+static volatile uint32_t *_hal_ccr(int index)
+{
+    return tims[index].ccr;
+}
+
+static void _hal_dma_start(int index, const struct pwm_frame *frame)
+{
+    if (index == 0 || tims[index].taken)
+        _error("DMA started", index);
+    tims[index].dma = frame;
+}
+
+static void _hal_dma_stop(int index)
+{
+    tims[index].dma = NULL;
+}
+
+static const struct pwm_hal _hal = {
+    .ccr = _hal_ccr,
+    .dma_start = _hal_dma_start,
+    .dma_stop = _hal_dma_stop,
+};
+
+/**
+ * Return the frame shown by the outputs of a timer, or -1 if they do not
+ * show a single frame.
+ */
+static int _frame(int index)
+{
+    const uint32_t *out = tims[index].out;
+    int port = index * 4;
+    if (out[0] < (uint32_t)port || (out[0] - (uint32_t)port) % 32)
+        return -1;
+    int frame = (int)((out[0] - (uint32_t)port) / 32);
+    for (int j = 1; j < 4; j++) {
+        if (out[j] != (uint32_t)(frame * 32 + port + j))
+            return -1;
+    }
+    return frame;
+}
+
+/**
+ * Run an update event: latch the CCRs, then burst the DMA frames.
+ */
+static void _update(bool irq)
+{
+    for (int i = 0; i < PWM_TIM_COUNT; i++) {
+        struct mock_tim *t = &tims[i];
+        if (t->taken) {
+            if (t->dma)
+                _error("DMA left running", i);
+            for (int j = 0; j < 4; j++) {
+                if (t->ccr[j] != SENTINEL)
+                    _error("taken timer written", i);
+            }
+            continue;
+        }
+        if (i || irq) {
+            for (int j = 0; j < 4; j++)
+                t->out[j] = t->ccr[j];
+        }
+        if (t->dma) {
+            for (int j = 0; j < 4; j++)
+                t->ccr[j] = t->dma->ccr[j];
+        }
+    }
+}
+
+/**
+ * Check the outputs of all timers at the current event.
+ */
+static void _check(void)
+{
+    tim1_frames[event] = _frame(0);
+    for (int i = 0; i < PWM_TIM_COUNT; i++) {
+        struct mock_tim *t = &tims[i];
+        if (t->taken || event < t->check_from)
+            continue;
+        int frame = _frame(i);
+        if (frame < 0) {
+            _error("outputs torn between frames", i);
+            continue;
+        }
+        if (t->frame >= 0 && (frame < t->frame || frame > t->frame + 1 + t->skip))
+            _error("frame skipped or gone back", i);
+        if (frame != t->frame)
+            t->skip = false;
+        t->frame = frame;
+        int lag = (i && pwm_get_dma()) ? 2 : i ? 1 : 0;
+        if (event >= t->settle && event >= lag && frame != tim1_frames[event - lag])
+            _error("frame not aligned with TIM1", i);
+    }
+}
+
+/**
+ * Write the given frame to all ports, as the control interrupt does.
+ */
+static void _write(int frame)
+{
+    for (int p = 0; p < PWM_PORT_COUNT; p++)
+        pwm_set(p, frame * 32 + p);
+}
+
+static void _take(int index)
+{
+    pwm_core_take(index);
+    tims[index].taken = true;
+    for (int j = 0; j < 4; j++)
+        tims[index].ccr[j] = SENTINEL;
+}
+
+/**
+ * Give a timer back, its CCRs being cleared by its reinitialization.
+ */
+static void _give(int index, long next_irq)
+{
+    struct mock_tim *t = &tims[index];
+    t->taken = false;
+    for (int j = 0; j < 4; j++)
+        t->ccr[j] = 0;
+    pwm_core_give(index);
+    t->frame = -1;
+    t->check_from = event + 2; // cleared CCRs latched before the first burst
+    t->settle = next_irq + 2;
+}
+
+static void _usage(void)
+{
+    fprintf(stderr, "usage: pwmtest [-n events] [-s seed]\n");
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    long events = 1000000;
+    uint32_t seed = 1;
+
+    int c;
+    while ((c = getopt(argc, argv, "n:s:h")) != -1) {
+        switch (c) {
+        case 'n': events = atol(optarg); break;
+        case 's': seed = (uint32_t)atol(optarg); break;
+        default: _usage();
+        }
+    }
+    if (events < 1)
+        _usage();
+
+    tim1_frames = calloc((size_t)events, sizeof(int));
+    if (!tim1_frames)
+        return 1;
+
+    // frame 0 loaded as by pwm_configure()
+    pwm_core_init(&_hal);
+    _write(0);
+    for (int i = 1; i < PWM_TIM_COUNT; i++)
+        pwm_core_flush(i);
+    for (int i = 0; i < PWM_TIM_COUNT; i++) {
+        memcpy(tims[i].out, (const uint32_t *)tims[i].ccr, sizeof(tims[i].out));
+        tims[i].frame = -1;
+    }
+
+    long switches = 0;
+    long takeovers = 0;
+    int frame = 0;
+    int div = 1;
+    long next_irq = 1;
+    for (event = 1; event < events && !errors; event++) {
+        bool irq = event == next_irq;
+        _update(irq);
+        if (irq) {
+            pwm_flush();
+            _write(++frame);
+            div = 1 + (int)(_rand(&seed) % DIV_MAX);
+            next_irq = event + div;
+        }
+        _check();
+
+        // reconfiguration between events, the interrupt being masked
+        uint32_t r = _rand(&seed) % 64;
+        if (r == 0) {
+            for (int i = 1; i < PWM_TIM_COUNT; i++) {
+                struct mock_tim *t = &tims[i];
+                t->skip = t->dma && t->out[0] != t->ccr[0] && t->ccr[0] != t->dma->ccr[0];
+            }
+            pwm_set_dma(!pwm_get_dma());
+            for (int i = 1; i < PWM_TIM_COUNT; i++)
+                tims[i].settle = next_irq + 2;
+            switches++;
+        } else if (r == 1 || r == 2) {
+            int index = r == 1 ? STEP_INDEX : ENC_INDEX;
+            if (tims[index].taken) {
+                _give(index, next_irq);
+            } else {
+                _take(index);
+                takeovers++;
+            }
+        }
+    }
+
+    free(tim1_frames);
+    if (errors)
+        return 1;
+    printf("%ld events, %d frames, %ld DMA switches, %ld takeovers, outputs aligned: ok\n",
+           events, frame, switches, takeovers);
+    return 0;
+}
@@ -0,0 +1,226 @@
+/*
+ *  ratetest.c
+ *
+ *  Copyright (c) 2019 Gabriele Mondada.
+ *  This software is distributed under the terms of the MIT license.
+ *  See https://opensource.org/licenses/MIT
+ *
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "pwm.h"
+#include "stepgen.h"
+
+/*
+ * Test of the timing arithmetic of a PWM configuration, see pwmcore.c, as
+ * used by the control cycle and the step/dir output, see stepper.c.
+ *
+ * For every frequency from 1 Hz up to twice the max accepted one, in both
+ * modes:
+ *
+ * - The accepted frequencies form one interval, and their range stays
+ *   within [PWM_RANGE_MIN, PWM_RANGE_MAX].
+ * - The counter period given by ARR yields the closest frequency at or
+ *   above the requested one, and an update event every range counts.
+ * - The cycle divider is within [1, RC_CYCLE_DIV_MAX], even in
+ *   center-aligned mode, the closest to RC_CYCLE_FREQ unless clamped, and
+ *   its largest repeat count still fits RCR.
+ * - The cycle time is that of the divided update events, and the tick count
+ *   of the step/dir output matches both.
+ * - When stepgen_fits() accepts the tick count, the longest slot the
+ *   generator may output, idle_ticks + min_ticks, fits the 16-bit timer.
+ *   Random steps are then generated for a few calls: no slot is longer,
+ *   the prefill lasts STEP_LEAD_CYCLES cycles and the slots keep up with
+ *   the cycles.
+ *
+ * The exit status is 1 on the first error:
+ *
+ *   ratetest -c 16 -s 1
+ */
+
+#define RC_CYCLE_FREQ       20000 // Hz, as stepper.c
+#define RC_RATE_SHIFT_MAX   6
+#define RC_CYCLE_DIV_MAX    (256 >> RC_RATE_SHIFT_MAX)
+#define TIM_CLOCK           168000000 // Hz, pwm_tim_clock()
+#define STEP_PULSE_TICKS    168       // STEP_PULSE_WIDTH_NS at TIM_CLOCK
+#define STEP_LEAD_CYCLES    3
+#define STEP_SIZE           (1 << 16)
+#define STEP_RING           1024      // slots, played back after every call
+
+
+static struct stepgen_slot slots[STEP_RING];
+
+
+static uint32_t _rand(uint32_t *seed)
+{
+    *seed = *seed * 1664525u + 1013904223u;
+    return *seed >> 8;
+}
+
+/**
+ * Play the slots written since rd back, checking that they fit the timer
+ * and are not longer than idle_ticks + min_ticks. Return the ticks played,
+ * or -1 on error.
+ */
+static int64_t _play(const struct stepgen *g, int *rd)
+{
+    int64_t ticks = 0;
+    for (; *rd != g->wr; *rd = (*rd + 1) % STEP_RING) {
+        const struct stepgen_slot *s = &slots[*rd];
+        if (s->arr >= STEPGEN_CCR_OFF || (int)s->arr >= g->idle_ticks + g->min_ticks)
+            return -1;
+        ticks += s->arr + 1;
+    }
+    return ticks;
+}
+
+/**
+ * Generate random steps at the given tick count, at most one per cycle.
+ */
+static int _step(int freq, bool edge, int ticks, int calls, uint32_t *seed)
+{
+    struct stepgen g;
+    int rd = 0;
+    stepgen_init(&g, slots, STEP_RING, ticks, STEP_PULSE_TICKS, STEP_SIZE, 0);
+    if (g.idle_ticks + g.min_ticks > STEPGEN_TICKS_MAX) {
+        printf("%d Hz%s: longest slot of %d ticks\n", freq, edge ? " edge" : "", g.idle_ticks + g.min_ticks);
+        return -1;
+    }
+    stepgen_prefill(&g, STEP_LEAD_CYCLES * ticks);
+    if (_play(&g, &rd) != STEP_LEAD_CYCLES * ticks) {
+        printf("%d Hz%s: prefill does not last %d cycles\n", freq, edge ? " edge" : "", STEP_LEAD_CYCLES);
+        return -1;
+    }
+
+    traj_pos_t x = 0;
+    int64_t played = 0;
+    for (int k = 0; k < calls; k++) {
+        int n = 1 + (int)(_rand(seed) % 4);
+        x += (traj_pos_t)(_rand(seed) % ((uint32_t)n * STEP_SIZE));
+        stepgen_cycle(&g, x, n);
+        int64_t p = _play(&g, &rd);
+        if (p < 0) {
+            printf("%d Hz%s: slot too long\n", freq, edge ? " edge" : "");
+            return -1;
+        }
+        played += p;
+        // a pulse may end after the cycle, an idle slot is due within a cycle
+        if (played != g.t_slot || g.t - g.t_slot < -g.pulse_ticks
+            || g.t - g.t_slot >= g.idle_ticks + g.min_ticks) {
+            printf("%d Hz%s: %lld ticks played after %lld\n", freq, edge ? " edge" : "",
+                   (long long)played, (long long)g.t);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Check the configuration at the given frequency and mode. Return 1 if it
+ * is accepted, 0 if not, or -1 on error.
+ */
+static int _check(int freq, bool edge, int calls, bool *fits, uint32_t *seed)
+{
+    const char *mode = edge ? " edge" : "";
+    int range = pwm_get_range(freq, edge);
+    if (!range)
+        return 0;
+    if (range < PWM_RANGE_MIN || range > PWM_RANGE_MAX) {
+        printf("%d Hz%s: range %d\n", freq, mode, range);
+        return -1;
+    }
+
+    // the counter runs at 2 * PWM_COUNTER_FREQ, see pwm.c
+    int arr = pwm_get_arr(range, edge);
+    int period = edge ? arr + 1 : 2 * arr;  // counts
+    int event = edge ? arr + 1 : arr;       // counts between update events
+    double counter = 2.0 * PWM_COUNTER_FREQ;
+    if (event != range || counter / period < freq || counter / (period + 2) >= freq) {
+        printf("%d Hz%s: range %d, ARR %d, %.3f Hz\n", freq, mode, range, arr, counter / period);
+        return -1;
+    }
+
+    int div = pwm_get_cycle_div(range, edge, RC_CYCLE_FREQ, RC_CYCLE_DIV_MAX);
+    int step = edge ? 1 : 2;
+    double events = counter / range / RC_CYCLE_FREQ; // per cycle
+    if (div < step || div > RC_CYCLE_DIV_MAX || div % step || (div << RC_RATE_SHIFT_MAX) > 256
+        || (div > step && div < RC_CYCLE_DIV_MAX && fabs(div - events) > step / 2.0 + 1e-3)) {
+        printf("%d Hz%s: cycle divider %d for %.3f events\n", freq, mode, div, events);
+        return -1;
+    }
+
+    float time = pwm_get_cycle_time(range, div);
+    int ticks = pwm_get_ticks(range, div, TIM_CLOCK);
+    double exact = div * event / counter;
+    if (fabs(time - exact) > 1e-6 * exact || ticks != div * event * (TIM_CLOCK / (int)counter)
+        || fabs((double)time * TIM_CLOCK - ticks) > 1e-6 * ticks) {
+        printf("%d Hz%s: cycle of %d events, %.9f s, %d ticks\n", freq, mode, div, time, ticks);
+        return -1;
+    }
+
+    *fits = stepgen_fits(ticks, STEP_PULSE_TICKS);
+    if (*fits && _step(freq, edge, ticks, calls, seed))
+        return -1;
+    return 1;
+}
+
+static void _usage(void)
+{
+    fprintf(stderr, "usage: ratetest [-c calls] [-s seed]\n");
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    int calls = 16;
+    uint32_t seed = 1;
+
+    int c;
+    while ((c = getopt(argc, argv, "c:s:h")) != -1) {
+        switch (c) {
+        case 'c': calls = atoi(optarg); break;
+        case 's': seed = (uint32_t)strtoul(optarg, NULL, 0); break;
+        default: _usage();
+        }
+    }
+    if (calls < 1)
+        _usage();
+
+    // highest frequency, reached in edge-aligned mode
+    int freq_max = 2 * PWM_COUNTER_FREQ / PWM_RANGE_MIN;
+
+    for (int edge = 0; edge <= 1; edge++) {
+        int lo = 0, hi = 0;
+        int step_lo = 0;
+        for (int freq = 1; freq <= 2 * freq_max; freq++) {
+            bool fits = false;
+            int r = _check(freq, edge, calls, &fits, &seed);
+            if (r < 0)
+                return 1;
+            if (r && hi && hi != freq - 1) {
+                printf("%d Hz%s: accepted after a gap from %d Hz\n", freq, edge ? " edge" : "", hi);
+                return 1;
+            }
+            if (r) {
+                lo = lo ? lo : freq;
+                hi = freq;
+            }
+            if (fits && !step_lo)
+                step_lo = freq;
+            if (!fits && step_lo && r) {
+                printf("%d Hz%s: step mode refused above %d Hz\n", freq, edge ? " edge" : "", step_lo);
+                return 1;
+            }
+        }
+        if (!lo || !step_lo) {
+            printf("no frequency accepted%s\n", edge ? " in edge mode" : "");
+            return 1;
+        }
+        printf("%s: %d to %d Hz, step mode from %d Hz: ok\n",
+               edge ? "edge-aligned" : "center-aligned", lo, hi, step_lo);
+    }
+    return 0;
+}
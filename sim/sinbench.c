@@ -0,0 +1,149 @@
+/*
+ *  sinbench.c
+ *
+ *  Copyright (c) 2019 Gabriele Mondada.
+ *  This software is distributed under the terms of the MIT license.
+ *  See https://opensource.org/licenses/MIT
+ *
+ */
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "sinlut.h"
+
+/*
+ * Accuracy and cost of the sine table, see sinlut.h, against sinf().
+ *
+ * Every angle of the full tour that is a multiple of 2^stride_shift is
+ * evaluated with sinlut_sin() and sinlut_cos(), and with sinf() and cosf()
+ * scaled to Q15 and rounded as the commutation did before. Both are
+ * compared with the exact value; the max and RMS errors are reported in Q15
+ * LSB. Then both are timed on the same random angles and reported in ns per
+ * call on this host. On the Cortex-M4, sinf() is a software routine while
+ * the table costs a few loads and a multiply, so the ratio only gets
+ * larger there.
+ *
+ * The exit status is 1 if the max error of the table exceeds max_err:
+ *
+ *   sinbench -a 8 -e 1.5
+ */
+
+#define SINBENCH_CALLS_MAX  (1 << 20) // random angles timed, reused
+
+
+struct error {
+    double max;
+    double sum2;
+    long count;
+};
+
+
+static uint32_t _rand(uint32_t *seed)
+{
+    *seed = *seed * 1664525u + 1013904223u;
+    return *seed;
+}
+
+static double _now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static float _radians(uint32_t angle)
+{
+    return (float)angle * (float)(2.0 * M_PI / 4294967296.0);
+}
+
+static void _add(struct error *e, double value, double exact)
+{
+    double d = fabs(value - exact);
+    if (d > e->max)
+        e->max = d;
+    e->sum2 += d * d;
+    e->count++;
+}
+
+static void _print(const char *name, const struct error *e)
+{
+    printf("%-12s max %.3f LSB, rms %.3f LSB\n", name, e->max, sqrt(e->sum2 / (double)e->count));
+}
+
+static void _usage(void)
+{
+    fprintf(stderr, "usage: sinbench [-a stride_shift] [-e max_err] [-n calls]\n");
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    int stride_shift = 8;
+    double max_err = 1.5;
+    long calls = 50000000;
+
+    int c;
+    while ((c = getopt(argc, argv, "a:e:n:h")) != -1) {
+        switch (c) {
+        case 'a': stride_shift = atoi(optarg); break;
+        case 'e': max_err = strtod(optarg, NULL); break;
+        case 'n': calls = atol(optarg); break;
+        default: _usage();
+        }
+    }
+    if (stride_shift < 0 || stride_shift > 31 || calls < 0)
+        _usage();
+
+    // accuracy
+    struct error lut = { 0 };
+    struct error flt = { 0 };
+    uint64_t stride = (uint64_t)1 << stride_shift;
+    for (uint64_t a = 0; a < ((uint64_t)1 << 32); a += stride) {
+        uint32_t angle = (uint32_t)a;
+        double x = (double)angle * (2.0 * M_PI / 4294967296.0);
+        double s = sin(x) * SINLUT_ONE;
+        double k = cos(x) * SINLUT_ONE;
+        _add(&lut, sinlut_sin(angle), s);
+        _add(&lut, sinlut_cos(angle), k);
+        _add(&flt, lrintf(sinf(_radians(angle)) * SINLUT_ONE), s);
+        _add(&flt, lrintf(cosf(_radians(angle)) * SINLUT_ONE), k);
+    }
+    printf("SINLUT_SHIFT %d, %ld angles\n", SINLUT_SHIFT, lut.count / 2);
+    _print("sinlut:", &lut);
+    _print("sinf:", &flt);
+
+    // cost
+    if (calls) {
+        static uint32_t angles[SINBENCH_CALLS_MAX];
+        uint32_t seed = 1;
+        for (int i = 0; i < SINBENCH_CALLS_MAX; i++)
+            angles[i] = _rand(&seed);
+
+        volatile int sink;
+        int acc = 0;
+        double t0 = _now();
+        for (long n = 0; n < calls; n++)
+            acc += sinlut_sin(angles[n & (SINBENCH_CALLS_MAX - 1)]);
+        double t_lut = _now() - t0;
+        sink = acc;
+
+        float facc = 0.0f;
+        t0 = _now();
+        for (long n = 0; n < calls; n++)
+            facc += sinf(_radians(angles[n & (SINBENCH_CALLS_MAX - 1)]));
+        double t_flt = _now() - t0;
+        sink = (int)facc;
+        (void)sink;
+
+        printf("sinlut_sin:  %.2f ns/call\n", t_lut / (double)calls * 1e9);
+        printf("sinf:        %.2f ns/call (x%.2f)\n", t_flt / (double)calls * 1e9, t_flt / t_lut);
+    }
+
+    bool ok = lut.max <= max_err;
+    printf("max error %.3f LSB, limit %.3f: %s\n", lut.max, max_err, ok ? "ok" : "FAILED");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,218 @@
+/*
+ *  stepgentest.c
+ *
+ *  Copyright (c) 2019 Gabriele Mondada.
+ *  This software is distributed under the terms of the MIT license.
+ *  See https://opensource.org/licenses/MIT
+ *
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "ramp.h"
+#include "stepgen.h"
+
+/*
+ * Test of the step timing of the step/dir generator, see stepgen.c.
+ *
+ * A random position profile, made of cruises at up to STEP_V_MAX steps per
+ * cycle in both directions and of moves back and forth across a step
+ * boundary, is given to the generator with the firmware parameters. The
+ * slots are played back and the rising edge of every step pulse compared
+ * with the exact time at which the linearly interpolated profile crosses
+ * the step boundary. An edge must be within one tick of it, unless its
+ * slot would be shorter than min_ticks, in which case it must come at that
+ * limit and be counted as late. Directions, step counts and slot lengths
+ * are checked as well.
+ *
+ * The exit status is 1 on the first error, or if the profile did not cover
+ * direction reversals and late steps:
+ *
+ *   stepgentest -c 200000 -s 1
+ */
+
+#define STEP_CYCLE_TICKS  8400  // 20 kHz at 168 MHz, as pwm_cycle_ticks()
+#define STEP_PULSE_TICKS  168   // 1 us, STEP_PULSE_WIDTH_NS
+#define STEP_LEAD_CYCLES  3
+#define STEP_SIZE         (RAMP_POS_SCALE / 256)
+#define STEP_V_MAX        24    // steps per cycle, just below the min_ticks spacing
+#define STEP_RING         1024  // slots, played back after every call
+#define STEP_PENDING_MAX  4096  // expected steps not played back yet
+
+
+struct expect {
+    double t;   // exact crossing time, in ticks
+    int dir;
+};
+
+static struct stepgen_slot slots[STEP_RING];
+static struct expect pending[STEP_PENDING_MAX];
+static int pending_rd;
+static int pending_wr;
+
+
+static uint32_t _rand(uint32_t *seed)
+{
+    *seed = *seed * 1664525u + 1013904223u;
+    return *seed >> 8;
+}
+
+static traj_pos_t _floor_div(traj_pos_t n, traj_pos_t d)
+{
+    return (n < 0) ? -((-n - 1) / d + 1) : n / d;
+}
+
+/**
+ * Queue the crossings of the profile from x0 at t0 to x1 at t0 + ticks.
+ */
+static int _expect(traj_pos_t x0, traj_pos_t x1, int64_t t0, int ticks)
+{
+    traj_pos_t n0 = _floor_div(x0, STEP_SIZE);
+    traj_pos_t n1 = _floor_div(x1, STEP_SIZE);
+    for (traj_pos_t m = n0 + 1; m <= n1; m++) {
+        pending[pending_wr++ % STEP_PENDING_MAX] = (struct expect){
+            (double)t0 + (double)(m * STEP_SIZE - x0) / (double)(x1 - x0) * ticks, 1 };
+    }
+    for (traj_pos_t m = n0; m > n1; m--) {
+        pending[pending_wr++ % STEP_PENDING_MAX] = (struct expect){
+            (double)t0 + (double)(x0 - m * STEP_SIZE) / (double)(x0 - x1) * ticks, -1 };
+    }
+    return pending_wr - pending_rd <= STEP_PENDING_MAX ? 0 : -1;
+}
+
+static void _usage(void)
+{
+    fprintf(stderr, "usage: stepgentest [-c calls] [-s seed]\n");
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    long calls = 100000;
+    uint32_t seed = 1;
+
+    int c;
+    while ((c = getopt(argc, argv, "c:s:h")) != -1) {
+        switch (c) {
+        case 'c': calls = atol(optarg); break;
+        case 's': seed = (uint32_t)strtoul(optarg, NULL, 0); break;
+        default: _usage();
+        }
+    }
+    if (calls < 1)
+        _usage();
+
+    struct stepgen g;
+    stepgen_init(&g, slots, STEP_RING, STEP_CYCLE_TICKS, STEP_PULSE_TICKS, STEP_SIZE, 0);
+    stepgen_prefill(&g, STEP_LEAD_CYCLES * STEP_CYCLE_TICKS);
+
+    int rd = 0;
+    int64_t t_play = -STEP_LEAD_CYCLES * STEP_CYCLE_TICKS; // start of the next slot played
+    int late_min = 0;   // edges that must be late
+    int late_max = 0;   // edges that may be, within a tick
+    int reversals = 0;
+    int last_dir = 0;
+    long edges = 0;
+
+    traj_pos_t x = 0;
+    int64_t t = 0;
+    int mode = 0;
+    int left = 0;
+    int v = 0;
+    traj_pos_t base = 0;
+
+    for (long k = 0; k < calls; k++) {
+        // next segment: cruise, or back and forth around a step boundary
+        if (left-- <= 0) {
+            mode = (int)(_rand(&seed) % 3);
+            left = 20 + (int)(_rand(&seed) % 200);
+            v = (int)(_rand(&seed) % (2 * STEP_V_MAX * STEP_SIZE + 1)) - STEP_V_MAX * STEP_SIZE;
+            base = (_floor_div(x, STEP_SIZE) + 1) * STEP_SIZE;
+        }
+        int n = 1 + (int)(_rand(&seed) % 4);
+        traj_pos_t x1;
+        if (mode == 0) {
+            x1 = x + (traj_pos_t)v * n;
+        } else {
+            // just past the boundary, or far behind it, so that crossings
+            // come right at the end of a call or right at the start
+            traj_pos_t d = (_rand(&seed) & 1) ? 1 + _rand(&seed) % 64 : STEP_SIZE / 2;
+            x1 = x < base ? base + d : base - d;
+        }
+
+        if (_expect(x, x1, t, n * STEP_CYCLE_TICKS)) {
+            printf("call %ld: too many steps pending\n", k);
+            return 1;
+        }
+        stepgen_cycle(&g, x1, n);
+        x = x1;
+        t += n * STEP_CYCLE_TICKS;
+
+        // play the new slots back
+        for (; rd != g.wr; rd = (rd + 1) % STEP_RING) {
+            const struct stepgen_slot *s = &slots[rd];
+            int len = (int)s->arr + 1;
+            if (len < g.min_ticks && t_play >= 0) { // the prefill may end with a shorter one
+                printf("slot at %lld: %d ticks\n", (long long)t_play, len);
+                return 1;
+            }
+            if (s->ccr1 != STEPGEN_CCR_OFF) {
+                if (pending_rd == pending_wr) {
+                    printf("slot at %lld: unexpected step\n", (long long)t_play);
+                    return 1;
+                }
+                struct expect e = pending[pending_rd++ % STEP_PENDING_MAX];
+                int64_t edge = t_play + (int64_t)s->ccr1;
+                int dir = s->ccr2 == STEPGEN_CCR_OFF ? 1 : -1;
+                // earliest edge after the previous slot
+                double limit = (double)(t_play + g.min_ticks - g.pulse_ticks);
+
+                if (dir != e.dir) {
+                    printf("step at %.1f: dir %d instead of %d\n", e.t, dir, e.dir);
+                    return 1;
+                }
+                if (e.t < limit - 1.0) {
+                    late_min++;
+                    late_max++;
+                    if (edge != (int64_t)limit || len != g.min_ticks) {
+                        printf("late step at %.1f: edge %lld instead of %.0f\n", e.t, (long long)edge, limit);
+                        return 1;
+                    }
+                } else if (e.t <= limit + 1.0) {
+                    late_max++;
+                    if (fabs((double)edge - fmax(e.t, limit)) > 1.0) {
+                        printf("step at %.1f: edge %lld, limit %.0f\n", e.t, (long long)edge, limit);
+                        return 1;
+                    }
+                } else if (fabs((double)edge - e.t) > 1.0) {
+                    printf("step at %.1f: edge %lld\n", e.t, (long long)edge);
+                    return 1;
+                }
+                if (last_dir && dir != last_dir)
+                    reversals++;
+                last_dir = dir;
+                edges++;
+            }
+            t_play += len;
+        }
+    }
+
+    // every slot written has been played
+    if (edges != pending_wr || g.steps != pending_wr) {
+        printf("%ld edges played, %d generated, %d expected\n", edges, g.steps, pending_wr);
+        return 1;
+    }
+    if (g.late < late_min || g.late > late_max) {
+        printf("%d late steps counted, %d to %d expected\n", g.late, late_min, late_max);
+        return 1;
+    }
+    if (!reversals || !late_min) {
+        printf("profile did not cover reversals and late steps\n");
+        return 1;
+    }
+    printf("%ld steps within a tick of the crossings, %d reversals, %d late: ok\n",
+           edges, reversals, g.late);
+    return 0;
+}
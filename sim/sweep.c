@@ -0,0 +1,285 @@
+/*
+ *  sweep.c
+ *
+ *  Copyright (c) 2019 Gabriele Mondada.
+ *  This software is distributed under the terms of the MIT license.
+ *  See https://opensource.org/licenses/MIT
+ *
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "motsim.h"
+#include "move.h"
+
+/*
+ * Parameter sweep.
+ *
+ * Simulates the same movement for every combination of speed, acceleration,
+ * jerk window and load inertia, and prints one CSV line per combination on
+ * stdout. The fastest combination that neither slips nor vibrates further
+ * than the tolerance is reported on stderr, for each inertia.
+ *
+ * TRAJ_JL_SIZE is a compile-time constant of the firmware, so the jerk
+ * window is swept through the plan shift instead: it lasts
+ * TRAJ_JL_SIZE << plan_shift cycles.
+ *
+ * Lists are given as "a,b,c" or as "min:max:n" for n evenly spaced values,
+ * for instance:
+ *
+ *   sweep -s 10:60:11 -a 100:1000:10 -p 0,1,2 -J 1,2,5 > sweep.csv
+ *
+ * Damper options are the same as for motsim, so that runs with and without
+ * damping can be compared.
+ *
+ * Work distribution:
+ * Combinations are split in contiguous ranges, one per thread. A thread
+ * takes combinations from the front of its range, and when it is empty,
+ * steals the back half of the largest remaining range. Each combination
+ * only depends on its parameters and results are printed in combination
+ * order, so the output does not depend on the number of threads nor on
+ * scheduling.
+ */
+
+#define LIST_MAX  256
+
+
+struct list {
+    int count;
+    float v[LIST_MAX];
+};
+
+struct worker {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    int begin;  // next combination
+    int end;
+};
+
+struct job {
+    struct move_params p;
+    float inertia;
+    struct move_result r;
+};
+
+
+static const struct motsim_motor *_motor;
+static struct job *_jobs;
+static struct worker *_workers;
+static int _worker_count;
+
+
+static int _parse_list(struct list *l, const char *s)
+{
+    float min, max;
+    int n;
+    char end;
+
+    l->count = 0;
+    if (sscanf(s, "%f:%f:%d%c", &min, &max, &n, &end) == 3) {
+        if (n < 1 || n > LIST_MAX)
+            return -1;
+        for (int i = 0; i < n; i++)
+            l->v[l->count++] = n > 1 ? min + (max - min) * (float)i / (float)(n - 1) : min;
+        return 0;
+    }
+
+    while (*s) {
+        char *next;
+        if (l->count == LIST_MAX)
+            return -1;
+        l->v[l->count++] = strtof(s, &next);
+        if (next == s || (*next && *next != ','))
+            return -1;
+        s = *next ? next + 1 : next;
+    }
+    return l->count ? 0 : -1;
+}
+
+static void _run(struct job *job)
+{
+    struct motsim sim;
+    motsim_init(&sim, _motor, job->p.range);
+    sim.m.j *= job->inertia;
+    move_run(&job->p, &sim, &job->r, NULL, 0);
+}
+
+/**
+ * Take the next combination of the given worker, stealing from the others
+ * if needed. Return -1 when all are done.
+ */
+static int _take(int self)
+{
+    struct worker *w = &_workers[self];
+    int index = -1;
+
+    pthread_mutex_lock(&w->lock);
+    if (w->begin < w->end)
+        index = w->begin++;
+    pthread_mutex_unlock(&w->lock);
+
+    while (index < 0) {
+        // pick the victim with the most work left
+        int victim = -1;
+        int left = 0;
+        for (int i = 0; i < _worker_count; i++) {
+            struct worker *v = &_workers[i];
+            pthread_mutex_lock(&v->lock);
+            if (v->end - v->begin > left) {
+                left = v->end - v->begin;
+                victim = i;
+            }
+            pthread_mutex_unlock(&v->lock);
+        }
+        if (victim < 0)
+            return -1;
+
+        // ranges only shrink, so no lock order issue holding one at a time
+        struct worker *v = &_workers[victim];
+        int begin = 0, end = 0;
+        pthread_mutex_lock(&v->lock);
+        left = v->end - v->begin;
+        if (left > 0) {
+            end = v->end;
+            begin = end - (left + 1) / 2;
+            v->end = begin;
+        }
+        pthread_mutex_unlock(&v->lock);
+
+        if (begin < end) {
+            pthread_mutex_lock(&w->lock);
+            w->begin = begin + 1;
+            w->end = end;
+            pthread_mutex_unlock(&w->lock);
+            index = begin;
+        }
+    }
+    return index;
+}
+
+static void *_worker_main(void *arg)
+{
+    int self = (int)(intptr_t)arg;
+    int index;
+    while ((index = _take(self)) >= 0)
+        _run(&_jobs[index]);
+    return NULL;
+}
+
+static void _usage(void)
+{
+    fprintf(stderr,
+            "usage: sweep [-m motor] [-s spd_list] [-a acc_list] [-p plan_shift_list]\n"
+            "             [-J inertia_factor_list] [-d dist] [-A amp] [-e tolerance] [-j threads]\n"
+            "             [-P ahead] [-D damp_ms] [-S enc|emf] [-R ohm] [-L H]\n"
+            "lists: \"a,b,c\" or \"min:max:n\"\n");
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    struct move_params p = move_defaults;
+    struct list spd = { 1, { move_defaults.spd } };
+    struct list acc = { 1, { move_defaults.acc } };
+    struct list shift = { 1, { (float)move_defaults.plan_shift } };
+    struct list inertia = { 1, { 1.0f } };
+    const char *name = "nema17";
+    int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+    int c;
+    while ((c = getopt(argc, argv, "m:s:a:p:J:d:A:e:j:P:D:S:R:L:h")) != -1) {
+        switch (c) {
+        case 'm': name = optarg; break;
+        case 's': if (_parse_list(&spd, optarg)) _usage(); break;
+        case 'a': if (_parse_list(&acc, optarg)) _usage(); break;
+        case 'p': if (_parse_list(&shift, optarg)) _usage(); break;
+        case 'J': if (_parse_list(&inertia, optarg)) _usage(); break;
+        case 'd': p.dist = strtof(optarg, NULL); break;
+        case 'A': p.amp = strtof(optarg, NULL); break;
+        case 'e': p.tolerance = strtof(optarg, NULL); break;
+        case 'j': threads = atoi(optarg); break;
+        case 'P': p.ahead = atoi(optarg); break;
+        case 'D': p.damp = strtof(optarg, NULL); break;
+        case 'S': p.damp_src = strcmp(optarg, "emf") == 0 ? MOVE_DAMP_EMF : MOVE_DAMP_ENC; break;
+        case 'R': p.damp_r = strtof(optarg, NULL); break;
+        case 'L': p.damp_l = strtof(optarg, NULL); break;
+        default: _usage();
+        }
+    }
+
+    _motor = motsim_find(name);
+    if (!_motor)
+        _usage();
+
+    int count = inertia.count * shift.count * acc.count * spd.count;
+    _jobs = calloc((size_t)count, sizeof(*_jobs));
+    if (!_jobs)
+        return 2;
+    for (int i = 0; i < count; i++) {
+        struct job *job = &_jobs[i];
+        int n = i;
+        job->p = p;
+        job->p.spd = spd.v[n % spd.count];
+        n /= spd.count;
+        job->p.acc = acc.v[n % acc.count];
+        n /= acc.count;
+        job->p.plan_shift = (int)shift.v[n % shift.count];
+        n /= shift.count;
+        job->inertia = inertia.v[n];
+    }
+
+    if (threads > count)
+        threads = count;
+    if (threads < 1)
+        threads = 1;
+    _worker_count = threads;
+    _workers = calloc((size_t)threads, sizeof(*_workers));
+    if (!_workers)
+        return 2;
+    for (int i = 0; i < threads; i++) {
+        pthread_mutex_init(&_workers[i].lock, NULL);
+        _workers[i].begin = (int)((long)count * i / threads);
+        _workers[i].end = (int)((long)count * (i + 1) / threads);
+    }
+    for (int i = 1; i < threads; i++)
+        pthread_create(&_workers[i].thread, NULL, _worker_main, (void *)(intptr_t)i);
+    _worker_main((void *)0);
+    for (int i = 1; i < threads; i++)
+        pthread_join(_workers[i].thread, NULL);
+
+    printf("index,spd,acc,plan_shift,inertia,move_time,error,residual,slips,load_angle_max,ok\n");
+    for (int i = 0; i < count; i++) {
+        const struct job *job = &_jobs[i];
+        printf("%d,%g,%g,%d,%g,%.5f,%.4f,%.4f,%d,%.1f,%d\n",
+               i, (double)job->p.spd, (double)job->p.acc, job->p.plan_shift,
+               (double)job->inertia, job->r.move_time, job->r.error,
+               job->r.residual, job->r.slips, job->r.load_angle_max, job->r.ok);
+    }
+
+    // combinations are grouped by inertia
+    int per_inertia = count / inertia.count;
+    for (int k = 0; k < inertia.count; k++) {
+        const struct job *best = NULL;
+        for (int i = k * per_inertia; i < (k + 1) * per_inertia; i++) {
+            const struct job *job = &_jobs[i];
+            if (job->r.ok && (!best || job->r.move_time < best->r.move_time))
+                best = job;
+        }
+        if (best) {
+            fprintf(stderr, "inertia x%g: spd %g acc %g plan_shift %d, move %.3f s\n",
+                    (double)best->inertia, (double)best->p.spd, (double)best->p.acc,
+                    best->p.plan_shift, best->r.move_time);
+        } else {
+            fprintf(stderr, "inertia x%g: no setting within tolerance\n",
+                    (double)inertia.v[k]);
+        }
+    }
+
+    free(_workers);
+    free(_jobs);
+    return 0;
+}
@@ -0,0 +1,490 @@
+/*
+ *  trajbatch.c
+ *
+ *  Copyright (c) 2019 Gabriele Mondada.
+ *  This software is distributed under the terms of the MIT license.
+ *  See https://opensource.org/licenses/MIT
+ *
+ */
+
+#include <stdlib.h>
+#include "trajbatch.h"
+
+#ifndef TRAJ_64BIT
+#error "the batch kernel works on 64-bit positions"
+#endif
+
+/*
+ * Batch trajectory kernel.
+ *
+ * Steps many trajectories with the same arithmetic as traj_step(), so that
+ * every lane matches what traj_step() gives for the same inputs.
+ *
+ * Most cycles of a movement accelerate, cruise or brake without changing
+ * state. These lanes are stepped with SIMD operations, a vector holding one
+ * 64-bit lane per trajectory. The 64-bit divisions of traj_plan() are
+ * replaced by exact multiplications or by double divisions whose floor is
+ * checked to be exact. Lanes for which the vector path cannot prove the
+ * result, such as state changes or int overflow, are stepped by
+ * traj_plan() itself. The jerk limiter is always vectorized.
+ *
+ * The instruction set is chosen at compile time: AVX2 (4 lanes), SSE4.2
+ * (2 lanes) or plain C, which steps every lane with traj_step() itself.
+ */
+
+#if defined(__AVX2__)
+
+#include <immintrin.h>
+
+#define VEC_ISA            "avx2"
+#define VEC_LANES          4
+
+typedef __m256i vec;
+
+#define V_LOAD(p)          _mm256_loadu_si256((const __m256i *)(p))
+#define V_LOAD32(p)        _mm256_cvtepi32_epi64(_mm_loadu_si128((const __m128i *)(p)))
+#define V_STORE(p, a)      _mm256_storeu_si256((__m256i *)(p), a)
+#define V_STORE32(p, a)    _mm_storeu_si128((__m128i *)(p), _mm256_castsi256_si128( \
+                               _mm256_permutevar8x32_epi32(a, _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6))))
+#define V_SET(n)           _mm256_set1_epi64x(n)
+#define V_ADD(a, b)        _mm256_add_epi64(a, b)
+#define V_SUB(a, b)        _mm256_sub_epi64(a, b)
+#define V_AND(a, b)        _mm256_and_si256(a, b)
+#define V_OR(a, b)         _mm256_or_si256(a, b)
+#define V_ANDNOT(a, b)     _mm256_andnot_si256(a, b) // ~a & b
+#define V_XOR(a, b)        _mm256_xor_si256(a, b)
+#define V_EQ(a, b)         _mm256_cmpeq_epi64(a, b)
+#define V_GT(a, b)         _mm256_cmpgt_epi64(a, b)
+#define V_SEL(m, a, b)     _mm256_blendv_epi8(b, a, m) // m ? a : b
+#define V_MUL32(a, b)      _mm256_mul_epi32(a, b)      // of the signed low halves
+#define V_MULU32(a, b)     _mm256_mul_epu32(a, b)      // of the unsigned low halves
+#define V_SRL(a, n)        _mm256_srli_epi64(a, n)
+#define V_SLL(a, n)        _mm256_slli_epi64(a, n)
+#define V_MASK(m)          _mm256_movemask_pd(_mm256_castsi256_pd(m))
+
+typedef __m256d vecd;
+
+#define VD_SET(d)          _mm256_set1_pd(d)
+#define VD_CAST(a)         _mm256_castsi256_pd(a)
+#define VI_CAST(d)         _mm256_castpd_si256(d)
+#define VD_ADD(a, b)       _mm256_add_pd(a, b)
+#define VD_SUB(a, b)       _mm256_sub_pd(a, b)
+#define VD_DIV(a, b)       _mm256_div_pd(a, b)
+#define VD_FLOOR(a)        _mm256_floor_pd(a)
+#define VD_GT(a, b)        VI_CAST(_mm256_cmp_pd(a, b, _CMP_GT_OQ))
+
+#elif defined(__SSE4_2__)
+
+#include <nmmintrin.h>
+
+#define VEC_ISA            "sse4.2"
+#define VEC_LANES          2
+
+typedef __m128i vec;
+
+#define V_LOAD(p)          _mm_loadu_si128((const __m128i *)(p))
+#define V_LOAD32(p)        _mm_cvtepi32_epi64(_mm_loadl_epi64((const __m128i *)(p)))
+#define V_STORE(p, a)      _mm_storeu_si128((__m128i *)(p), a)
+#define V_STORE32(p, a)    _mm_storel_epi64((__m128i *)(p), _mm_shuffle_epi32(a, _MM_SHUFFLE(3, 3, 2, 0)))
+#define V_SET(n)           _mm_set1_epi64x(n)
+#define V_ADD(a, b)        _mm_add_epi64(a, b)
+#define V_SUB(a, b)        _mm_sub_epi64(a, b)
+#define V_AND(a, b)        _mm_and_si128(a, b)
+#define V_OR(a, b)         _mm_or_si128(a, b)
+#define V_ANDNOT(a, b)     _mm_andnot_si128(a, b)
+#define V_XOR(a, b)        _mm_xor_si128(a, b)
+#define V_EQ(a, b)         _mm_cmpeq_epi64(a, b)
+#define V_GT(a, b)         _mm_cmpgt_epi64(a, b)
+#define V_SEL(m, a, b)     _mm_blendv_epi8(b, a, m)
+#define V_MUL32(a, b)      _mm_mul_epi32(a, b)
+#define V_MULU32(a, b)     _mm_mul_epu32(a, b)
+#define V_SRL(a, n)        _mm_srli_epi64(a, n)
+#define V_SLL(a, n)        _mm_slli_epi64(a, n)
+#define V_MASK(m)          _mm_movemask_pd(_mm_castsi128_pd(m))
+
+typedef __m128d vecd;
+
+#define VD_SET(d)          _mm_set1_pd(d)
+#define VD_CAST(a)         _mm_castsi128_pd(a)
+#define VI_CAST(d)         _mm_castpd_si128(d)
+#define VD_ADD(a, b)       _mm_add_pd(a, b)
+#define VD_SUB(a, b)       _mm_sub_pd(a, b)
+#define VD_DIV(a, b)       _mm_div_pd(a, b)
+#define VD_FLOOR(a)        _mm_floor_pd(a)
+#define VD_GT(a, b)        _mm_castpd_si128(_mm_cmpgt_pd(a, b))
+
+#else
+
+#define VEC_ISA            "scalar"
+#define VEC_LANES          1
+
+#endif
+
+
+/*
+ * Copy the lane to or from a struct traj, except for the jerk limiter
+ * ring, which is the only part traj_plan() does not use.
+ */
+static void _get(const struct traj_batch *me, int i, struct traj *t)
+{
+    t->sa = me->sa[i];
+    t->sv = me->sv[i];
+    t->sx = me->sx[i];
+    t->sdir = me->sdir[i];
+    t->limits = me->limits[i];
+    t->min_x = me->min_x[i];
+    t->max_x = me->max_x[i];
+    t->dir = me->dir[i];
+    t->state = me->state[i];
+    t->x = me->x[i];
+    t->v = me->v[i];
+    t->moving = me->moving[i];
+    t->limited = me->limited[i];
+    t->limit_count = me->limit_count[i];
+    t->jl_acc = me->jl_acc[i];
+    t->jl_x = me->jl_x[i];
+    t->jl_moving = me->jl_moving[i];
+}
+
+static void _put(struct traj_batch *me, int i, const struct traj *t)
+{
+    me->sa[i] = t->sa;
+    me->sv[i] = t->sv;
+    me->sx[i] = t->sx;
+    me->sdir[i] = t->sdir;
+    me->limits[i] = t->limits;
+    me->min_x[i] = t->min_x;
+    me->max_x[i] = t->max_x;
+    me->dir[i] = t->dir;
+    me->state[i] = t->state;
+    me->x[i] = t->x;
+    me->v[i] = t->v;
+    me->moving[i] = t->moving;
+    me->limited[i] = t->limited;
+    me->limit_count[i] = t->limit_count;
+    me->jl_acc[i] = t->jl_acc;
+    me->jl_x[i] = t->jl_x;
+    me->jl_moving[i] = t->jl_moving;
+}
+
+#if VEC_LANES > 1
+
+static void _plan(struct traj_batch *me, int i)
+{
+    struct traj t;
+    _get(me, i, &t);
+    traj_plan(&t);
+    _put(me, i, &t);
+}
+
+// a * dir, for dir = 1 or -1 given as a mask of negative lanes
+static inline vec _dir_mul(vec a, vec neg)
+{
+    return V_SUB(V_XOR(a, neg), neg);
+}
+
+// mask of lanes holding an int
+static inline vec _fits32(vec a)
+{
+    return V_EQ(V_SRL(V_ADD(a, V_SET(0x80000000)), 32), V_SET(0));
+}
+
+// a >> n, arithmetic
+#define V_SRA(a, n)        V_OR(V_SRL(a, n), V_SLL(V_GT(V_SET(0), a), 64 - (n)))
+
+// conversions of integers from 0 to 2^52, exact
+#define V_MAGIC            0x4330000000000000 // 2^52 as a double
+#define VD_FROM(a)         VD_SUB(VD_CAST(V_OR(a, V_SET(V_MAGIC))), VD_SET(0x1p52))
+#define VD_TO(d)           V_XOR(VI_CAST(VD_ADD(d, VD_SET(0x1p52))), V_SET(V_MAGIC))
+
+/**
+ * Vector part of traj_plan() for lanes i to i + VEC_LANES - 1, for the
+ * states where it does not change state. Other lanes are left to
+ * traj_plan().
+ */
+static void _plan_vec(struct traj_batch *me, int i)
+{
+    const vec zero = V_SET(0);
+    const vec ones = V_SET(-1);
+
+    vec x = V_LOAD(me->x + i);
+    vec sx = V_LOAD(me->sx + i);
+    vec v = V_LOAD32(me->v + i);
+    vec sa = V_LOAD32(me->sa + i);
+    vec sv = V_LOAD32(me->sv + i);
+    vec sdir = V_LOAD32(me->sdir + i);
+    vec dir = V_LOAD32(me->dir + i);
+    vec state = V_LOAD32(me->state + i);
+    vec limits = V_ANDNOT(V_EQ(V_LOAD32(me->limits + i), zero), ones);
+    vec sdir_z = V_EQ(sdir, zero);
+
+    // an infinite movement with limits is planned toward the limit
+    vec bounded = V_OR(sdir_z, limits);
+    vec limit = V_SEL(V_GT(sdir, zero), V_LOAD(me->max_x + i), V_LOAD(me->min_x + i));
+    vec sx_b = V_SEL(V_ANDNOT(sdir_z, limits), limit, sx);
+
+    vec neg = V_GT(zero, dir);
+    vec vv = V_MUL32(v, v);
+    vec st_wait = V_EQ(state, V_SET(TRAJ_STATE_WAIT));
+    vec st_acc = V_EQ(state, V_SET(TRAJ_STATE_ACC));
+    vec st_dec = V_EQ(state, V_SET(TRAJ_STATE_DEC));
+    vec st_cs = V_EQ(state, V_SET(TRAJ_STATE_CONST_SPEED));
+
+    vec st_dz = V_EQ(state, V_SET(TRAJ_STATE_DEC_TO_ZERO));
+
+    /*
+     * Braking to zero, traj_plan() slows down by na = (vv + x_r) / (x_r * 2).
+     * Below 2^52, both operands are exact doubles and the quotient is
+     * rounded by less than 2^-22 when below 2^30. The floor is exact unless
+     * the quotient is that close to an integer, then traj_plan() decides.
+     */
+    vec dz_ok = zero;
+    vec dz_nv = v;
+    if (V_MASK(st_dz)) {
+        vec x_r = _dir_mul(V_SUB(sx_b, x), neg);
+        vec num = V_ADD(vv, x_r);
+        vecd q = VD_DIV(VD_FROM(num), VD_FROM(V_SLL(x_r, 1)));
+        vecd f = VD_FLOOR(q);
+        vecd frac = VD_SUB(q, f);
+        vec na = VD_TO(f);
+        na = V_SEL(V_EQ(na, zero), V_SET(1), na);
+        dz_nv = V_SUB(v, _dir_mul(na, neg));
+        dz_ok = V_AND(V_AND(st_dz, V_GT(x_r, zero)), V_GT(V_SET(1LL << 51), x_r));
+        dz_ok = V_AND(dz_ok, V_GT(V_SET(1LL << 52), num));
+        dz_ok = V_AND(dz_ok, V_AND(VD_GT(VD_SET(0x1p30), q), VD_GT(frac, VD_SET(0x1p-20))));
+        dz_ok = V_AND(dz_ok, VD_GT(VD_SET(1.0 - 0x1p-20), frac));
+    }
+
+    vec da = _dir_mul(sa, neg);
+    vec nv = V_SEL(st_acc, V_ADD(v, da),
+             V_SEL(st_dec, V_SUB(v, da),
+             V_SEL(st_cs, _dir_mul(sv, neg), dz_nv)));
+    vec s = V_ADD(v, nv);
+    vec nx = V_ADD(x, V_SRA(V_SUB(s, V_GT(zero, s)), 1)); // x + (v + nv) / 2
+    vec nvd = _dir_mul(nv, neg);
+    vec nx_r = _dir_mul(V_SUB(sx_b, nx), neg);
+
+    /*
+     * traj_plan() brakes when vv / (nx_r * 2) + 1 > sa, that is, when
+     * vv >= sa * nx_r * 2. With nx_r * 2 < 2^32, the product is exact.
+     * Above, vv < sa * 2^32 is enough to keep on.
+     */
+    vec small = V_GT(V_SET(0x80000000), nx_r);
+    vec far = V_SEL(small, V_GT(V_MULU32(sa, V_SLL(nx_r, 1)), vv), V_GT(sa, V_SRL(vv, 32)));
+    far = V_AND(far, V_AND(V_GT(nx_r, zero), V_EQ(V_SRL(nx_r, 62), zero)));
+
+    vec over = V_GT(nvd, sv);
+    vec checked = V_AND(V_GT(nvd, zero), bounded);
+    vec acc_ok = V_ANDNOT(over, V_AND(st_acc, V_OR(V_ANDNOT(checked, ones), far)));
+    vec dec_ok = V_AND(st_dec, over);
+    vec cs_ok = V_AND(st_cs, V_OR(V_ANDNOT(bounded, ones), far));
+    dz_ok = V_AND(dz_ok, V_GT(nvd, zero));
+    vec wait_ok = V_AND(st_wait, V_AND(sdir_z, V_EQ(sx, x)));
+
+    vec valid = V_AND(V_AND(_fits32(nv), _fits32(s)), _fits32(nvd));
+    valid = V_ANDNOT(V_EQ(dir, zero), V_AND(valid, V_GT(sa, zero)));
+    vec moved = V_AND(valid, V_OR(V_OR(acc_ok, dz_ok), V_OR(dec_ok, cs_ok)));
+
+    V_STORE(me->x + i, V_SEL(moved, nx, x));
+    V_STORE32(me->v + i, V_SEL(moved, nv, v));
+
+    int rest = ~V_MASK(V_OR(moved, wait_ok)) & ((1 << VEC_LANES) - 1);
+    while (rest) {
+        int k = __builtin_ctz((unsigned)rest);
+        _plan(me, i + k);
+        rest &= rest - 1;
+    }
+}
+
+static void _filter_vec(struct traj_batch *me, int i)
+{
+    const vec zero = V_SET(0);
+    traj_pos_t *slot = me->jl + me->jl_index * me->stride + i;
+
+    vec x = V_LOAD(me->x + i);
+    vec out = V_LOAD(slot);
+    V_STORE(slot, x);
+    vec acc = V_ADD(V_LOAD(me->jl_acc + i), V_SUB(x, out));
+    V_STORE(me->jl_acc + i, acc);
+    V_STORE(me->jl_x + i, V_SRA(acc, TRAJ_JL_SIZE_SHIFT));
+
+    vec jl_moving = V_LOAD32(me->jl_moving + i);
+    vec stopped = V_AND(V_EQ(V_LOAD32(me->moving + i), zero), V_GT(jl_moving, zero));
+    V_STORE32(me->jl_moving + i, V_ADD(jl_moving, stopped));
+}
+
+#endif
+
+/**
+ * Return the instruction set the kernel was built for.
+ */
+const char *traj_batch_isa(void)
+{
+    return VEC_ISA;
+}
+
+/**
+ * Allocate the given number of lanes, standstill at position 0. Return 0 on
+ * success, or -1 if out of memory.
+ */
+int traj_batch_init(struct traj_batch *me, int count)
+{
+    int n = (count + VEC_LANES - 1) / VEC_LANES * VEC_LANES;
+
+    *me = (struct traj_batch){
+        .count = count,
+        .stride = n,
+        .sa = calloc((size_t)n, sizeof(int32_t)),
+        .sv = calloc((size_t)n, sizeof(int32_t)),
+        .sx = calloc((size_t)n, sizeof(traj_pos_t)),
+        .sdir = calloc((size_t)n, sizeof(int32_t)),
+        .limits = calloc((size_t)n, sizeof(int32_t)),
+        .min_x = calloc((size_t)n, sizeof(traj_pos_t)),
+        .max_x = calloc((size_t)n, sizeof(traj_pos_t)),
+        .dir = calloc((size_t)n, sizeof(int32_t)),
+        .state = calloc((size_t)n, sizeof(int32_t)),
+        .x = calloc((size_t)n, sizeof(traj_pos_t)),
+        .v = calloc((size_t)n, sizeof(int32_t)),
+        .moving = calloc((size_t)n, sizeof(int32_t)),
+        .limited = calloc((size_t)n, sizeof(int32_t)),
+        .limit_count = calloc((size_t)n, sizeof(int32_t)),
+        .jl = calloc((size_t)n * TRAJ_JL_SIZE, sizeof(traj_pos_t)),
+        .jl_acc = calloc((size_t)n, sizeof(traj_pos_t)),
+        .jl_x = calloc((size_t)n, sizeof(traj_pos_t)),
+        .jl_moving = calloc((size_t)n, sizeof(int32_t)),
+    };
+
+    if (!me->sa || !me->sv || !me->sx || !me->sdir || !me->limits ||
+        !me->min_x || !me->max_x || !me->dir || !me->state || !me->x ||
+        !me->v || !me->moving || !me->limited || !me->limit_count ||
+        !me->jl || !me->jl_acc || !me->jl_x || !me->jl_moving) {
+        traj_batch_free(me);
+        return -1;
+    }
+    return 0;
+}
+
+void traj_batch_free(struct traj_batch *me)
+{
+    free(me->sa);
+    free(me->sv);
+    free(me->sx);
+    free(me->sdir);
+    free(me->limits);
+    free(me->min_x);
+    free(me->max_x);
+    free(me->dir);
+    free(me->state);
+    free(me->x);
+    free(me->v);
+    free(me->moving);
+    free(me->limited);
+    free(me->limit_count);
+    free(me->jl);
+    free(me->jl_acc);
+    free(me->jl_x);
+    free(me->jl_moving);
+    *me = (struct traj_batch){ 0 };
+}
+
+/**
+ * Copy a trajectory into the given lane, for instance to go on with a
+ * trajectory stepped by traj_step().
+ */
+void traj_batch_load(struct traj_batch *me, int lane, const struct traj *traj)
+{
+    _put(me, lane, traj);
+    for (int k = 0; k < TRAJ_JL_SIZE; k++) {
+        int j = (traj->jl_index + k - me->jl_index) & TRAJ_JL_SIZE_MASK;
+        me->jl[k * me->stride + lane] = traj->jl_array[j];
+    }
+}
+
+/**
+ * Copy the given lane into a trajectory, which then gives the same results
+ * with traj_step() as the lane would.
+ */
+void traj_batch_store(const struct traj_batch *me, int lane, struct traj *traj)
+{
+    _get(me, lane, traj);
+    traj->jl_index = 0;
+    for (int k = 0; k < TRAJ_JL_SIZE; k++) {
+        int j = (me->jl_index + k) & TRAJ_JL_SIZE_MASK;
+        traj->jl_array[k] = me->jl[j * me->stride + lane];
+    }
+}
+
+#if VEC_LANES == 1
+
+/**
+ * Step a lane with traj_step() itself. traj_step() only reads and writes
+ * the current slot of the jerk limiter ring, so the copy only gets that
+ * one, as its slot 0.
+ */
+static void _step(struct traj_batch *me, int i)
+{
+    traj_pos_t *slot = me->jl + me->jl_index * me->stride + i;
+    struct traj t;
+    _get(me, i, &t);
+    t.jl_index = 0;
+    t.jl_array[0] = *slot;
+    traj_step(&t);
+    _put(me, i, &t);
+    *slot = t.jl_array[0];
+}
+
+#endif
+
+/**
+ * Step all lanes, as traj_step() does.
+ */
+void traj_batch_step(struct traj_batch *me)
+{
+#if VEC_LANES > 1
+    for (int i = 0; i < me->stride; i += VEC_LANES) {
+        _plan_vec(me, i);
+        _filter_vec(me, i);
+    }
+#else
+    for (int i = 0; i < me->stride; i++)
+        _step(me, i);
+#endif
+    me->jl_index = (me->jl_index + 1) & TRAJ_JL_SIZE_MASK;
+}
+
+/**
+ * Same as traj_update(), for the given lane.
+ */
+void traj_batch_update(struct traj_batch *me, int lane)
+{
+    if (me->moving[lane])
+        me->state[lane] = TRAJ_STATE_START;
+}
+
+/**
+ * Same as traj_brake(), for the given lane.
+ */
+void traj_batch_brake(struct traj_batch *me, int lane)
+{
+    switch (me->state[lane]) {
+        case TRAJ_STATE_ACC:
+        case TRAJ_STATE_DEC:
+        case TRAJ_STATE_CONST_SPEED:
+        case TRAJ_STATE_DEC_TO_ZERO:
+            me->state[lane] = TRAJ_STATE_BRAKE;
+            break;
+    }
+}
+
+/**
+ * Same as traj_jump(), for the given lane.
+ */
+void traj_batch_jump(struct traj_batch *me, int lane, traj_pos_t x)
+{
+    struct traj t;
+    _get(me, lane, &t);
+    traj_jump(&t, x);
+    _put(me, lane, &t);
+    for (int k = 0; k < TRAJ_JL_SIZE; k++)
+        me->jl[k * me->stride + lane] = x;
+}
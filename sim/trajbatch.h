@@ -0,0 +1,74 @@
+/*
+ *  trajbatch.h
+ *
+ *  Copyright (c) 2019 Gabriele Mondada.
+ *  This software is distributed under the terms of the MIT license.
+ *  See https://opensource.org/licenses/MIT
+ *
+ */
+
+#ifndef _TRAJBATCH_H_
+#define _TRAJBATCH_H_
+
+#include <stdint.h>
+#include "traj.h"
+
+
+/*** types ***/
+
+/*
+ * Many independent trajectories stepped together, stored as one array per
+ * field of struct traj, indexed by lane. Fields have the same meaning as in
+ * struct traj. Inputs can be written directly, followed by
+ * traj_batch_update() if the lane is moving, as with traj_update().
+ *
+ * All lanes are stepped on every call, so the jerk limiter ring index is
+ * shared: lane i of slot k is jl[k * stride + i].
+ */
+struct traj_batch {
+    int count;    // lanes
+    int stride;   // count rounded up to the vector width
+    int jl_index;
+
+    // inputs
+    int32_t *sa;
+    int32_t *sv;
+    traj_pos_t *sx;
+    int32_t *sdir;
+    int32_t *limits;
+    traj_pos_t *min_x;
+    traj_pos_t *max_x;
+
+    // private
+    int32_t *dir;
+    int32_t *state;
+
+    // outputs
+    traj_pos_t *x;
+    int32_t *v;
+    int32_t *moving;
+    int32_t *limited;
+    int32_t *limit_count;
+
+    // jerk limiter
+    traj_pos_t *jl;
+    traj_pos_t *jl_acc;
+    traj_pos_t *jl_x;
+    int32_t *jl_moving;
+};
+
+
+/*** prototypes ***/
+
+const char *traj_batch_isa(void);
+int traj_batch_init(struct traj_batch *me, int count);
+void traj_batch_free(struct traj_batch *me);
+void traj_batch_load(struct traj_batch *me, int lane, const struct traj *traj);
+void traj_batch_store(const struct traj_batch *me, int lane, struct traj *traj);
+void traj_batch_step(struct traj_batch *me);
+void traj_batch_update(struct traj_batch *me, int lane);
+void traj_batch_brake(struct traj_batch *me, int lane);
+void traj_batch_jump(struct traj_batch *me, int lane, traj_pos_t x);
+
+
+#endif
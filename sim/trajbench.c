@@ -0,0 +1,257 @@
+/*
+ *  trajbench.c
+ *
+ *  Copyright (c) 2019 Gabriele Mondada.
+ *  This software is distributed under the terms of the MIT license.
+ *  See https://opensource.org/licenses/MIT
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "trajbatch.h"
+
+/*
+ * Benchmark of the batch trajectory kernel, see trajbatch.c.
+ *
+ * Runs the same random movements, with on-the-fly target changes, brakes
+ * and soft limits, with traj_step() on an array of struct traj and with
+ * traj_batch_step(), and reports steps per second on one core. Only the
+ * stepping is timed, not the commands. With -v,
+ * both are run side by side and every lane is compared after every step;
+ * the exit status is 1 on the first mismatch.
+ *
+ *   trajbench -n 512 -c 20000 -v
+ */
+
+#define CMD_NONE    0
+#define CMD_MOVE    1
+#define CMD_RUN     2 // infinite movement within soft limits
+#define CMD_RETARGET 3
+#define CMD_BRAKE   4
+
+
+struct cmd {
+    int type;
+    int sa;
+    int sv;
+    traj_pos_t sx;
+    int sdir;
+    traj_pos_t min_x;
+    traj_pos_t max_x;
+};
+
+
+static uint32_t _rand(uint32_t *seed)
+{
+    *seed = *seed * 1664525u + 1013904223u;
+    return *seed >> 8;
+}
+
+/**
+ * Decide what to do with a lane, from its state only, so that both runs
+ * get the same commands.
+ */
+static void _command(uint32_t *seed, bool moving, int jl_moving, traj_pos_t x, struct cmd *c)
+{
+    c->type = CMD_NONE;
+    if (!moving && !jl_moving) {
+        uint32_t r = _rand(seed);
+        c->sa = 1 + (int)(_rand(seed) % 2000);
+        c->sv = 1000 + (int)(_rand(seed) % (1 << 20));
+        if (r % 4) {
+            c->type = CMD_MOVE;
+            c->sx = x + (traj_pos_t)((int64_t)_rand(seed) - (1 << 23)) * 512;
+        } else {
+            c->type = CMD_RUN;
+            c->sdir = r & 0x100 ? 1 : -1;
+            c->min_x = x - (traj_pos_t)_rand(seed) * 256;
+            c->max_x = x + (traj_pos_t)_rand(seed) * 256;
+        }
+    } else if (moving) {
+        uint32_t r = _rand(seed) % 4096;
+        if (r == 0) {
+            c->type = CMD_BRAKE;
+        } else if (r == 1) {
+            c->type = CMD_RETARGET;
+            c->sa = 1 + (int)(_rand(seed) % 2000);
+            c->sv = 1000 + (int)(_rand(seed) % (1 << 20));
+            c->sx = x + (traj_pos_t)((int64_t)_rand(seed) - (1 << 23)) * 64;
+        }
+    }
+}
+
+static void _apply(struct traj *t, const struct cmd *c)
+{
+    switch (c->type) {
+    case CMD_MOVE:
+    case CMD_RETARGET:
+        t->sa = c->sa;
+        t->sv = c->sv;
+        t->sx = c->sx;
+        t->sdir = 0;
+        t->limits = false;
+        traj_update(t);
+        break;
+    case CMD_RUN:
+        t->sa = c->sa;
+        t->sv = c->sv;
+        t->sdir = c->sdir;
+        t->min_x = c->min_x;
+        t->max_x = c->max_x;
+        t->limits = true;
+        break;
+    case CMD_BRAKE:
+        traj_brake(t);
+        break;
+    }
+}
+
+static void _apply_batch(struct traj_batch *b, int i, const struct cmd *c)
+{
+    switch (c->type) {
+    case CMD_MOVE:
+    case CMD_RETARGET:
+        b->sa[i] = c->sa;
+        b->sv[i] = c->sv;
+        b->sx[i] = c->sx;
+        b->sdir[i] = 0;
+        b->limits[i] = false;
+        traj_batch_update(b, i);
+        break;
+    case CMD_RUN:
+        b->sa[i] = c->sa;
+        b->sv[i] = c->sv;
+        b->sdir[i] = c->sdir;
+        b->min_x[i] = c->min_x;
+        b->max_x[i] = c->max_x;
+        b->limits[i] = true;
+        break;
+    case CMD_BRAKE:
+        traj_batch_brake(b, i);
+        break;
+    }
+}
+
+static bool _same(const struct traj *t, const struct traj_batch *b, int i)
+{
+    return t->x == b->x[i] && t->v == b->v[i] && t->sx == b->sx[i] &&
+           t->sdir == b->sdir[i] && t->dir == b->dir[i] &&
+           t->state == b->state[i] && t->moving == b->moving[i] &&
+           t->limited == b->limited[i] && t->limit_count == b->limit_count[i] &&
+           t->jl_x == b->jl_x[i] && t->jl_acc == b->jl_acc[i] &&
+           t->jl_moving == b->jl_moving[i];
+}
+
+static double _now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static void _usage(void)
+{
+    fprintf(stderr, "usage: trajbench [-n lanes] [-c cycles] [-v]\n");
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    int count = 256;
+    int cycles = 20000;
+    bool verify = false;
+
+    int c;
+    while ((c = getopt(argc, argv, "n:c:vh")) != -1) {
+        switch (c) {
+        case 'n': count = atoi(optarg); break;
+        case 'c': cycles = atoi(optarg); break;
+        case 'v': verify = true; break;
+        default: _usage();
+        }
+    }
+    if (count < 1 || cycles < 1)
+        _usage();
+
+    struct traj *trajs = calloc((size_t)count, sizeof(*trajs));
+    uint32_t *seeds = calloc((size_t)count, sizeof(*seeds));
+    struct traj_batch batch;
+    if (!trajs || !seeds || traj_batch_init(&batch, count))
+        return 2;
+
+    struct cmd cmd;
+    long mismatches = 0;
+
+    // reference
+    for (int i = 0; i < count; i++) {
+        traj_jump(&trajs[i], 0);
+        seeds[i] = (uint32_t)i;
+    }
+    double t_ref = 0.0;
+    for (int n = 0; n < cycles; n++) {
+        for (int i = 0; i < count; i++) {
+            struct traj *t = &trajs[i];
+            _command(&seeds[i], t->moving, t->jl_moving, t->x, &cmd);
+            _apply(t, &cmd);
+        }
+        double t0 = _now();
+        for (int i = 0; i < count; i++)
+            traj_step(&trajs[i]);
+        t_ref += _now() - t0;
+    }
+
+    // batch
+    for (int i = 0; i < count; i++)
+        seeds[i] = (uint32_t)i;
+    double t_batch = 0.0;
+    for (int n = 0; n < cycles; n++) {
+        for (int i = 0; i < count; i++) {
+            _command(&seeds[i], batch.moving[i], batch.jl_moving[i], batch.x[i], &cmd);
+            _apply_batch(&batch, i, &cmd);
+        }
+        double t0 = _now();
+        traj_batch_step(&batch);
+        t_batch += _now() - t0;
+    }
+
+    if (verify) {
+        traj_batch_free(&batch);
+        if (traj_batch_init(&batch, count))
+            return 2;
+        for (int i = 0; i < count; i++) {
+            trajs[i] = (struct traj){ 0 };
+            traj_jump(&trajs[i], 0);
+            seeds[i] = (uint32_t)i;
+        }
+        for (int n = 0; n < cycles && !mismatches; n++) {
+            for (int i = 0; i < count; i++) {
+                uint32_t seed = seeds[i];
+                _command(&seeds[i], trajs[i].moving, trajs[i].jl_moving, trajs[i].x, &cmd);
+                _apply(&trajs[i], &cmd);
+                _command(&seed, batch.moving[i], batch.jl_moving[i], batch.x[i], &cmd);
+                _apply_batch(&batch, i, &cmd);
+                traj_step(&trajs[i]);
+            }
+            traj_batch_step(&batch);
+            for (int i = 0; i < count; i++) {
+                if (!_same(&trajs[i], &batch, i) && !mismatches++)
+                    fprintf(stderr, "lane %d differs at cycle %d\n", i, n);
+            }
+        }
+    }
+
+    double steps = (double)count * cycles;
+    printf("lanes %d, cycles %d, kernel %s\n", count, cycles, traj_batch_isa());
+    printf("traj_step:       %6.1f Msteps/s\n", steps / t_ref * 1e-6);
+    printf("traj_batch_step: %6.1f Msteps/s (x%.2f)\n", steps / t_batch * 1e-6, t_ref / t_batch);
+    if (verify)
+        printf("verify: %s\n", mismatches ? "MISMATCH" : "identical");
+
+    traj_batch_free(&batch);
+    free(seeds);
+    free(trajs);
+    return mismatches ? 1 : 0;
+}
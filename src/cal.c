@@ -0,0 +1,176 @@
+/*
+ *  cal.c
+ *
+ *  Copyright (c) 2019 Gabriele Mondada.
+ *  This software is distributed under the terms of the MIT license.
+ *  See https://opensource.org/licenses/MIT
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "stm32f4xx.h"
+#include "cal.h"
+#include "sinlut.h"
+
+
+/*
+ * Storage:
+ * Tables are stored in flash sector 11, the last 128K of the flash, which is
+ * excluded from the program area by the linker script. The image starts with
+ * a header validated by a magic number, the table geometry and a checksum.
+ * Erasing the sector stalls the CPU for about 1 s, so it must not be done
+ * while motors are running.
+ */
+#define CAL_FLASH_ADDR      0x080E0000
+#define CAL_FLASH_SECTOR    FLASH_Sector_11
+#define CAL_MAGIC           0x4c414363 // "cCAL"
+
+
+struct cal_header {
+    uint32_t magic;
+    uint32_t size;   // CAL_SIZE
+    uint32_t count;  // number of tables
+    uint32_t sum;    // FNV-1a of the tables
+};
+
+
+static uint32_t _sum(const void *data, int size)
+{
+    const uint8_t *p = data;
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < size; i++) {
+        h ^= p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static int _hex_digit(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+void cal_init_sine(struct cal_table *t)
+{
+    for (int i = 0; i < CAL_SIZE; i++) {
+        uint32_t angle = (uint32_t)i << (32 - CAL_SIZE_SHIFT);
+        t->pt[i].a = (int16_t)sinlut_sin(angle);
+        t->pt[i].b = (int16_t)sinlut_cos(angle);
+    }
+}
+
+/**
+ * Write points from the given index, decoded from a hex string of raw
+ * little-endian int16 pairs. Return the number of points written, or -1 if
+ * the string is malformed or does not fit in the table.
+ */
+int cal_from_hex(struct cal_table *t, int index, const char *hex)
+{
+    int len = (int)strlen(hex);
+    int count = len / (2 * sizeof(struct cal_point));
+
+    if (len % (2 * sizeof(struct cal_point)) || index < 0 || index + count > CAL_SIZE)
+        return -1;
+
+    uint8_t buf[sizeof(struct cal_point)];
+    for (int i = 0; i < count; i++) {
+        for (int j = 0; j < (int)sizeof(buf); j++) {
+            int h = _hex_digit(hex[0]);
+            int l = _hex_digit(hex[1]);
+            if (h < 0 || l < 0)
+                return -1;
+            buf[j] = (uint8_t)(h << 4 | l);
+            hex += 2;
+        }
+        t->pt[index + i].a = (int16_t)(buf[0] | buf[1] << 8);
+        t->pt[index + i].b = (int16_t)(buf[2] | buf[3] << 8);
+    }
+    return count;
+}
+
+/**
+ * Print points in the format accepted by cal_from_hex().
+ */
+void cal_print_hex(const struct cal_table *t, int index, int count)
+{
+    if (index < 0)
+        index = 0;
+    if (index + count > CAL_SIZE)
+        count = CAL_SIZE - index;
+
+    for (int i = index; i < index + count; i++) {
+        uint16_t a = (uint16_t)t->pt[i].a;
+        uint16_t b = (uint16_t)t->pt[i].b;
+        printf("%02x%02x%02x%02x", a & 0xff, a >> 8, b & 0xff, b >> 8);
+    }
+    printf("\n");
+}
+
+/**
+ * Load tables from flash. Return 0 on success, or -1 if the flash does not
+ * hold a valid image for the given number of tables, in which case the
+ * tables are left unchanged.
+ */
+int cal_load(struct cal_table *tables, int count)
+{
+    const struct cal_header *h = (const struct cal_header *)CAL_FLASH_ADDR;
+    const struct cal_table *data = (const struct cal_table *)(h + 1);
+    int size = count * (int)sizeof(struct cal_table);
+
+    if (count > CAL_TABLE_MAX)
+        return -1;
+    if (h->magic != CAL_MAGIC || h->size != CAL_SIZE || h->count != (uint32_t)count)
+        return -1;
+    if (h->sum != _sum(data, size))
+        return -1;
+
+    memcpy(tables, data, (size_t)size);
+    return 0;
+}
+
+/**
+ * Erase the flash sector and write the tables. Return 0 on success.
+ */
+int cal_save(const struct cal_table *tables, int count)
+{
+    struct cal_header h = {
+        .magic = CAL_MAGIC,
+        .size = CAL_SIZE,
+        .count = (uint32_t)count,
+        .sum = _sum(tables, count * (int)sizeof(struct cal_table)),
+    };
+    int rc = -1;
+
+    if (count > CAL_TABLE_MAX)
+        return -1;
+
+    FLASH_Unlock();
+    FLASH_ClearFlag(FLASH_FLAG_EOP | FLASH_FLAG_OPERR | FLASH_FLAG_WRPERR |
+                    FLASH_FLAG_PGAERR | FLASH_FLAG_PGPERR | FLASH_FLAG_PGSERR);
+    if (FLASH_EraseSector(CAL_FLASH_SECTOR, VoltageRange_3) != FLASH_COMPLETE)
+        goto end;
+
+    uint32_t addr = CAL_FLASH_ADDR;
+    const uint32_t *p = (const uint32_t *)&h;
+    for (int i = 0; i < (int)(sizeof(h) / 4); i++, addr += 4) {
+        if (FLASH_ProgramWord(addr, p[i]) != FLASH_COMPLETE)
+            goto end;
+    }
+    p = (const uint32_t *)tables;
+    for (int i = 0; i < count * (int)(sizeof(struct cal_table) / 4); i++, addr += 4) {
+        if (FLASH_ProgramWord(addr, p[i]) != FLASH_COMPLETE)
+            goto end;
+    }
+    rc = 0;
+
+end:
+    FLASH_Lock();
+    return rc;
+}
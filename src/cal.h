@@ -0,0 +1,67 @@
+/*
+ *  cal.h
+ *
+ *  Copyright (c) 2019 Gabriele Mondada.
+ *  This software is distributed under the terms of the MIT license.
+ *  See https://opensource.org/licenses/MIT
+ *
+ */
+
+#ifndef _CAL_H_
+#define _CAL_H_
+
+#include <stdint.h>
+
+
+/*** literals ***/
+
+#define CAL_SIZE_SHIFT  8
+#define CAL_SIZE        (1 << CAL_SIZE_SHIFT) // points per electric tour
+#define CAL_TABLE_MAX   6                     // tables stored in flash
+
+
+/*** types ***/
+
+/*
+ * Microstep waveform of one motor: the amplitudes of phases a and b in Q15
+ * at CAL_SIZE evenly spaced electric angles. A pure sine gives a = sin and
+ * b = cos. Uploaded in binary as little-endian int16 pairs.
+ */
+struct cal_point {
+    int16_t a;
+    int16_t b;
+};
+
+struct cal_table {
+    struct cal_point pt[CAL_SIZE];
+};
+
+
+/*** prototypes ***/
+
+void cal_init_sine(struct cal_table *t);
+int cal_from_hex(struct cal_table *t, int index, const char *hex);
+void cal_print_hex(const struct cal_table *t, int index, int count);
+int cal_load(struct cal_table *tables, int count);
+int cal_save(const struct cal_table *tables, int count);
+
+
+/*** inline functions ***/
+
+/**
+ * Return the amplitudes of both phases at the given electric angle, a full
+ * electric tour being 2^32, interpolating linearly between points.
+ */
+static inline void cal_lookup(const struct cal_table *t, uint32_t angle, int *a, int *b)
+{
+    int i = (int)(angle >> (32 - CAL_SIZE_SHIFT));
+    int j = (i + 1) & (CAL_SIZE - 1);
+    int f = (int)((angle >> (32 - CAL_SIZE_SHIFT - 15)) & 0x7fff);
+    const struct cal_point *p0 = &t->pt[i];
+    const struct cal_point *p1 = &t->pt[j];
+    *a = p0->a + (((p1->a - p0->a) * f + 0x4000) >> 15);
+    *b = p0->b + (((p1->b - p0->b) * f + 0x4000) >> 15);
+}
+
+
+#endif
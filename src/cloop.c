@@ -0,0 +1,94 @@
+/*
+ *  cloop.c
+ *
+ *  Copyright (c) 2019 Gabriele Mondada.
+ *  This software is distributed under the terms of the MIT license.
+ *  See https://opensource.org/licenses/MIT
+ *
+ */
+
+#include "cloop.h"
+#include "sinlut.h"
+
+/*
+ * Closed-loop commutation.
+ *
+ * The rotor position is measured by an incremental encoder and compared to
+ * the commanded position every control cycle. As long as the following
+ * error is below lead_max, the commanded position is used as is, which is
+ * plain microstepping. Beyond, the commutation angle is set lead_max ahead
+ * of the measured position instead, so that the load angle stays bounded
+ * and the motor keeps producing torque until it catches up, rather than
+ * slipping poles. lead_max is typically a quarter of an electric tour, the
+ * angle of max torque.
+ *
+ * The amplitude is raised with the load angle, by gain at lead_max, so that
+ * the current follows the torque demand.
+ *
+ * An error beyond loss_thr is counted as a step-loss event, i.e. a step
+ * that open-loop control would have lost. The event is armed again when the
+ * error gets below half the threshold.
+ *
+ * All positions are in increments, like the ramp. The encoder count is the
+ * raw 32-bit counter, wrapping around.
+ */
+
+/**
+ * Clear the loop. Parameters are then set directly in the structure.
+ */
+void cloop_init(struct cloop *me)
+{
+    *me = (struct cloop){ 0 };
+}
+
+/**
+ * Align the measured position on the given one, the motor being assumed to
+ * hold it.
+ */
+void cloop_start(struct cloop *me, uint32_t count, traj_pos_t x)
+{
+    me->count = count;
+    me->acc = 0;
+    me->x0 = x;
+    me->x = x;
+    me->err = 0;
+    me->lost = false;
+}
+
+/**
+ * Return the position to commutate to for the commanded position x, and
+ * adjust the amplitude amp in Q15.
+ */
+traj_pos_t cloop_cycle(struct cloop *me, uint32_t count, traj_pos_t x, int *amp)
+{
+    me->acc += (int64_t)(int32_t)(count - me->count) * me->scale;
+    me->count = count;
+    me->x = me->x0 + (traj_pos_t)(me->acc >> 16);
+
+    traj_pos_t err = x - me->x;
+    traj_pos_t u = err < 0 ? -err : err;
+    me->err = err;
+    if (u > me->err_max)
+        me->err_max = u;
+    if (u > me->loss_thr) {
+        if (!me->lost)
+            me->losses++;
+        me->lost = true;
+    } else if (u < me->loss_thr / 2) {
+        me->lost = false;
+    }
+
+    traj_pos_t lead = err;
+    if (lead > me->lead_max)
+        lead = me->lead_max;
+    else if (lead < -me->lead_max)
+        lead = -me->lead_max;
+
+    if (me->gain && me->lead_max) {
+        traj_pos_t l = lead < 0 ? -lead : lead;
+        int a = *amp + (int)((int64_t)l * me->gain / me->lead_max);
+        *amp = a > SINLUT_ONE ? SINLUT_ONE : a;
+    }
+
+    return me->x + lead;
+}
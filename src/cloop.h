@@ -0,0 +1,50 @@
+/*
+ *  cloop.h
+ *
+ *  Copyright (c) 2019 Gabriele Mondada.
+ *  This software is distributed under the terms of the MIT license.
+ *  See https://opensource.org/licenses/MIT
+ *
+ */
+
+#ifndef _CLOOP_H_
+#define _CLOOP_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "traj.h"
+
+
+/*** types ***/
+
+struct cloop {
+    // parameters
+    int64_t scale;         // position increments per encoder count, in 1/65536
+    traj_pos_t lead_max;   // max load angle, in increments
+    traj_pos_t loss_thr;   // following error counted as a step loss
+    int gain;              // amplitude added at lead_max, in Q15
+
+    // encoder tracking
+    uint32_t count;        // encoder count of the last cycle
+    int64_t acc;           // position moved since cloop_start(), in 1/65536
+    traj_pos_t x0;         // position at cloop_start()
+
+    // state
+    traj_pos_t x;          // measured position
+    traj_pos_t err;        // following error, commanded - measured
+
+    // statistics
+    traj_pos_t err_max;    // max absolute following error
+    int losses;            // step-loss events
+    bool lost;             // following error above loss_thr
+};
+
+
+/*** prototypes ***/
+
+void cloop_init(struct cloop *me);
+void cloop_start(struct cloop *me, uint32_t count, traj_pos_t x);
+traj_pos_t cloop_cycle(struct cloop *me, uint32_t count, traj_pos_t x, int *amp);
+
+
+#endif
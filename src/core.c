@@ -63,6 +63,11 @@ void core_init(void)
     // equivalent to NVIC_PriorityGroupConfig(NVIC_PriorityGroup_2);
 
     SysTick_Config(SystemCoreClock / 1000);
+
+    // enable the cycle counter, used to measure CPU load
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
 }
 
 void core_set_stdio(const struct cli_io *io)
@@ -12,6 +12,7 @@
 
 #include <stdint.h>
 #include <stdatomic.h>
+#include "stm32f4xx.h"
 #include "mod.h"
 #include "cli.h"
 
@@ -41,5 +42,14 @@ static inline int32_t core_get_tick(void)
     return tick;
 }
 
+/**
+ * Return the number of CPU cycles elapsed since core_init(). Rolls over
+ * every 2^32 cycles, so always compute differences.
+ */
+static inline uint32_t core_get_cycles(void)
+{
+    return DWT->CYCCNT;
+}
+
 
 #endif
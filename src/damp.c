@@ -0,0 +1,161 @@
+/*
+ *  damp.c
+ *
+ *  Copyright (c) 2019 Gabriele Mondada.
+ *  This software is distributed under the terms of the MIT license.
+ *  See https://opensource.org/licenses/MIT
+ *
+ */
+
+#include <math.h>
+#include "damp.h"
+#include "ramp.h"
+
+/*
+ * Anti-resonance damping.
+ *
+ * In open loop, the rotor is tied to the commanded angle by the magnetic
+ * stiffness only, which forms a spring-mass system with the load inertia.
+ * In the mid-speed band, the lag of the winding currents turns its damping
+ * negative and the rotor starts to oscillate around the commanded angle,
+ * until it slips poles.
+ *
+ * The damper measures the velocity error, i.e. how fast the following error
+ * changes, and shifts the commutation angle by gain times that error: the
+ * field is advanced while the rotor lags more and more and retarded while
+ * it catches up, which adds the missing damping. The velocity error is
+ * high-passed, so that a steady following error, like the load angle, is
+ * not corrected, and optionally low-passed, to keep the loop away from the
+ * control rate. The correction is bounded by max, and the damper is idle
+ * below v_min, where the following error is not measured reliably.
+ *
+ * The following error comes from the encoder or, on motors with current
+ * sensors, from the back-EMF observer: the back-EMF, v - R * i - L * di/dt,
+ * is a vector rotating with the rotor, so that the angle it moves by from
+ * one sample to the next is the angle moved by the rotor. Its angle, theta,
+ * is the integral of these moves and tracks the rotor up to a constant,
+ * arbitrary offset, which the high-pass removes. The angle between theta
+ * and the commanded angle is unwrapped from cycle to cycle, so that the
+ * following error does not jump by a tour when it crosses half a tour.
+ * Only the direction of the back-EMF is used, so that the motor constant
+ * does not matter, but R and L must not be overestimated: values 30% too
+ * low still work, 10% too high do not.
+ *
+ * damp_observe() is called when currents are sampled, i.e. in the ISR, and
+ * only writes theta, a single word, for damp_cycle() in PendSV.
+ */
+
+/**
+ * Clear the damper, disabled. Parameters are then set directly in the
+ * structure.
+ */
+void damp_init(struct damp *me)
+{
+    *me = (struct damp){ 0 };
+}
+
+/**
+ * Restart the damper and the observer, e.g. when the motor is enabled.
+ */
+void damp_reset(struct damp *me)
+{
+    me->n = 0;
+    me->ea = 0.0f;
+    me->eb = 0.0f;
+    me->emf_primed = false;
+    me->primed = false;
+    me->out = 0;
+}
+
+/**
+ * Update the back-EMF observer with the currents ia and ib, sampled at the
+ * end of the previous voltage, and record the voltage va, vb output now for
+ * the next n cycles.
+ */
+void damp_observe(struct damp *me, int ia, int ib, int va, int vb, int n)
+{
+    if (me->n) {
+        float k = me->l / (float)me->n;
+        float ea = (float)me->va - me->r * 0.5f * (float)(ia + me->ia) - k * (float)(ia - me->ia);
+        float eb = (float)me->vb - me->r * 0.5f * (float)(ib + me->ib) - k * (float)(ib - me->ib);
+
+        // sin of the angle between both vectors, too noisy below 1/512 of the bus voltage
+        float nn = (ea * ea + eb * eb) * (me->ea * me->ea + me->eb * me->eb);
+        if (nn > 4096.0f * 4096.0f) {
+            float s = (ea * me->eb - eb * me->ea) / sqrtf(nn);
+            me->theta += (uint32_t)(int32_t)lrintf(s * (float)(4294967296.0 / (2.0 * M_PI)));
+        }
+        me->ea = ea;
+        me->eb = eb;
+    }
+    me->ia = ia;
+    me->ib = ib;
+    me->va = va;
+    me->vb = vb;
+    me->n = n;
+}
+
+/**
+ * Return the following error of the back-EMF angle behind the commanded
+ * position x, up to a constant offset. Must be called every cycle, the
+ * error moving by less than half a tour from one call to the next.
+ */
+traj_pos_t damp_emf_err(struct damp *me, traj_pos_t x)
+{
+    uint32_t d = ((uint32_t)x << (32 - RAMP_POS_SHIFT)) - me->theta;
+    if (!me->emf_primed) {
+        me->emf_primed = true;
+        me->emf_acc = 0;
+    } else {
+        me->emf_acc += (int32_t)(d - me->emf_prev);
+    }
+    me->emf_prev = d;
+    return (traj_pos_t)(me->emf_acc >> (32 - RAMP_POS_SHIFT));
+}
+
+/**
+ * Run n cycles for the following error err, commanded - measured, at the
+ * velocity v in increments per cycle, and return the correction to add to
+ * the commutation angle, in increments.
+ */
+traj_pos_t damp_cycle(struct damp *me, traj_pos_t err, int v, int n)
+{
+    int32_t u = v < 0 ? -v : v;
+    if (!me->gain || u < me->v_min) {
+        me->primed = false;
+        me->out = 0;
+        return 0;
+    }
+    if (!me->primed) {
+        me->primed = true;
+        me->err = err;
+        me->lp = 0;
+        me->avg = 0;
+        return 0;
+    }
+
+    int64_t sig = ((int64_t)(err - me->err) << DAMP_FRAC_SHIFT) / n;
+    me->err = err;
+    if (sig > INT32_MAX / 4)
+        sig = INT32_MAX / 4;
+    else if (sig < -INT32_MAX / 4)
+        sig = -INT32_MAX / 4;
+
+    // n cycles at once, as long as the filters stay stable
+    if (me->lp_shift) {
+        int k = n < (1 << me->lp_shift) ? n : (1 << me->lp_shift);
+        me->lp += (int32_t)(((sig - me->lp) * k) >> me->lp_shift);
+    } else {
+        me->lp = (int32_t)sig;
+    }
+    int k = n < (1 << DAMP_HP_SHIFT) ? n : (1 << DAMP_HP_SHIFT);
+    me->avg += (int32_t)(((int64_t)(me->lp - me->avg) * k) >> DAMP_HP_SHIFT);
+
+    traj_pos_t out = (traj_pos_t)(((int64_t)me->gain * (me->lp - me->avg)) >> (16 + DAMP_FRAC_SHIFT));
+    if (out > me->max)
+        out = me->max;
+    else if (out < -me->max)
+        out = -me->max;
+    me->out = out;
+    return out;
+}
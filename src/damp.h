@@ -0,0 +1,67 @@
+/*
+ *  damp.h
+ *
+ *  Copyright (c) 2019 Gabriele Mondada.
+ *  This software is distributed under the terms of the MIT license.
+ *  See https://opensource.org/licenses/MIT
+ *
+ */
+
+#ifndef _DAMP_H_
+#define _DAMP_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "traj.h"
+
+
+/*** literals ***/
+
+#define DAMP_HP_SHIFT       7 // time constant of the high-pass, in 2^n cycles
+#define DAMP_FRAC_SHIFT     8 // fractional bits of the filter states
+#define DAMP_EMF_LP_SHIFT   3 // low-pass needed with the back-EMF observer, in 2^n cycles
+
+
+/*** types ***/
+
+struct damp {
+    // parameters
+    int32_t gain;          // correction per velocity error, in cycles, in 1/65536, 0 to disable
+    traj_pos_t max;        // max correction, in increments
+    int32_t v_min;         // idle below this speed, in increments per cycle
+    int lp_shift;          // low-pass of the velocity error, in 2^n cycles, 0 for none
+    float r;               // winding resistance, in Q15 voltage per current count
+    float l;               // winding inductance, in Q15 voltage per current count per cycle
+
+    // back-EMF observer
+    int va;                // voltage output at the last sample, in Q15
+    int vb;
+    int n;                 // cycles from the last sample to the next one
+    int ia;                // last current sample, in counts
+    int ib;
+    float ea;              // last back-EMF, in Q15 voltage
+    float eb;
+    volatile uint32_t theta; // back-EMF angle, a full electric tour being 2^32
+    bool emf_primed;
+    uint32_t emf_prev;     // commanded angle - theta of the last cycle
+    int64_t emf_acc;       // its unwrapped sum, a full electric tour being 2^32
+
+    // filter
+    bool primed;
+    traj_pos_t err;        // following error of the last cycle
+    int32_t lp;            // low-passed velocity error, in 1/2^DAMP_FRAC_SHIFT increments per cycle
+    int32_t avg;           // its slow average, removed by the high-pass
+    traj_pos_t out;        // last correction, in increments
+};
+
+
+/*** prototypes ***/
+
+void damp_init(struct damp *me);
+void damp_reset(struct damp *me);
+void damp_observe(struct damp *me, int ia, int ib, int va, int vb, int n);
+traj_pos_t damp_emf_err(struct damp *me, traj_pos_t x);
+traj_pos_t damp_cycle(struct damp *me, traj_pos_t err, int v, int n);
+
+
+#endif
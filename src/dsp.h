@@ -0,0 +1,181 @@
+/*
+ *  dsp.h
+ *
+ *  Copyright (c) 2019 Gabriele Mondada.
+ *  This software is distributed under the terms of the MIT license.
+ *  See https://opensource.org/licenses/MIT
+ *
+ */
+
+#ifndef _DSP_H_
+#define _DSP_H_
+
+#include <stdint.h>
+#include <string.h>
+#include "cal.h"
+#include "sinlut.h"
+
+/*
+ * Packed Q15 arithmetic.
+ *
+ * The voltages of phases a and b of a motor are packed in one word, a in the
+ * low half and b in the high half, and processed together with the SIMD
+ * instructions of the Cortex-M4 (SMLAD, SSUB16, PKHBT, PKHTB). Elsewhere,
+ * for host testing, the same operations are done in plain C. Every function
+ * gives the same result as the scalar code it replaces: sinlut_sin() and
+ * sinlut_cos(), cal_lookup(), the amplitude scaling of stepper.c and
+ * duty_get().
+ */
+
+
+/*** inline functions ***/
+
+static inline uint32_t dsp_pack(int lo, int hi)
+{
+    return (uint16_t)lo | (uint32_t)hi << 16;
+}
+
+static inline int dsp_lo(uint32_t x)
+{
+    return (int16_t)x;
+}
+
+static inline int dsp_hi(uint32_t x)
+{
+    return (int16_t)(x >> 16);
+}
+
+#if defined(__ARM_FEATURE_DSP)
+
+#include "stm32f4xx.h" // CMSIS SIMD intrinsics
+
+static inline int32_t dsp_smlad(uint32_t x, uint32_t y, int32_t acc)
+{
+    return (int32_t)__SMLAD(x, y, (uint32_t)acc);
+}
+
+static inline uint32_t dsp_ssub16(uint32_t x, uint32_t y)
+{
+    return __SSUB16(x, y);
+}
+
+// low half of lo, high half of hi << shift
+#define dsp_pkhbt(lo, hi, shift)  __PKHBT(lo, hi, shift)
+
+// high half of hi, low half of lo >> shift
+#define dsp_pkhtb(hi, lo, shift)  __PKHTB(hi, lo, shift)
+
+#else
+
+static inline int32_t dsp_smlad(uint32_t x, uint32_t y, int32_t acc)
+{
+    return (int32_t)((uint32_t)acc + (uint32_t)(dsp_lo(x) * dsp_lo(y)) +
+                     (uint32_t)(dsp_hi(x) * dsp_hi(y)));
+}
+
+static inline uint32_t dsp_ssub16(uint32_t x, uint32_t y)
+{
+    return dsp_pack(dsp_lo(x) - dsp_lo(y), dsp_hi(x) - dsp_hi(y));
+}
+
+static inline uint32_t dsp_pkhbt(uint32_t lo, uint32_t hi, int shift)
+{
+    return (lo & 0xffff) | ((hi << shift) & 0xffff0000);
+}
+
+static inline uint32_t dsp_pkhtb(uint32_t hi, uint32_t lo, int shift)
+{
+    return (hi & 0xffff0000) | (((uint32_t)((int32_t)lo >> shift)) & 0xffff);
+}
+
+#endif
+
+/**
+ * Interpolate linearly between y0 and y1, f being in Q15, with a single
+ * multiply-accumulate: y0 * (1 - f) + y1 * f = y0 + (y1 - y0) * f. The pair
+ * (y0, y1) must be packed.
+ */
+static inline int dsp_interp(int y0, uint32_t pair, uint32_t weights)
+{
+    return dsp_smlad(pair, weights, (y0 << 15) + 0x4000) >> 15;
+}
+
+/**
+ * Return sinlut_sin() and sinlut_cos() of the given angle, packed. Both
+ * table pairs are read as words, which is allowed unaligned on the M4.
+ */
+static inline uint32_t dsp_sincos(uint32_t angle)
+{
+    uint32_t p = angle & 0x3fffffff;
+    uint32_t ps = (angle & 0x40000000) ? 0x40000000 - p : p;
+    uint32_t pc = (angle & 0x40000000) ? p : 0x40000000 - p;
+    int is = (int)(ps >> SINLUT_FRAC_SHIFT);
+    int ic = (int)(pc >> SINLUT_FRAC_SHIFT);
+    int fs = (int)((ps >> (SINLUT_FRAC_SHIFT - 15)) & 0x7fff);
+    int fc = (int)((pc >> (SINLUT_FRAC_SHIFT - 15)) & 0x7fff);
+
+    // at the end of the table, f is 0 and the pair only needs to exist
+    uint32_t ws, wc;
+    memcpy(&ws, &sinlut_table[is - (is >> SINLUT_SHIFT)], sizeof(ws));
+    memcpy(&wc, &sinlut_table[ic - (ic >> SINLUT_SHIFT)], sizeof(wc));
+    int s = dsp_interp(sinlut_table[is], ws, dsp_pack(-fs, fs));
+    int c = dsp_interp(sinlut_table[ic], wc, dsp_pack(-fc, fc));
+
+    // negate the lanes of the 3rd and 4th quadrants: -x = ~x - (-1)
+    uint32_t neg = ((angle & 0x80000000) ? 0xffff : 0) |
+                   (((angle + 0x40000000) & 0x80000000) ? 0xffff0000 : 0);
+    return dsp_ssub16(dsp_pack(s, c) ^ neg, neg);
+}
+
+/**
+ * Return cal_lookup() of the given angle, packed. Points are stored as
+ * packed pairs already.
+ */
+static inline uint32_t dsp_cal_lookup(const struct cal_table *t, uint32_t angle)
+{
+    int i = (int)(angle >> (32 - CAL_SIZE_SHIFT));
+    int j = (i + 1) & (CAL_SIZE - 1);
+    int f = (int)((angle >> (32 - CAL_SIZE_SHIFT - 15)) & 0x7fff);
+    uint32_t p0, p1;
+    memcpy(&p0, &t->pt[i], sizeof(p0));
+    memcpy(&p1, &t->pt[j], sizeof(p1));
+    uint32_t w = dsp_pack(-f, f);
+    int a = dsp_interp(dsp_lo(p0), dsp_pkhbt(p0, p1, 16), w);
+    int b = dsp_interp(dsp_hi(p0), dsp_pkhtb(p1, p0, 16), w);
+    return dsp_pack(a, b);
+}
+
+/**
+ * Scale both lanes by amp in Q15.
+ */
+static inline uint32_t dsp_scale(uint32_t x, int amp)
+{
+    int a = dsp_lo(x) * amp;
+    int b = dsp_hi(x) * amp;
+    return dsp_pkhbt((uint32_t)(a >> 15), (uint32_t)b, 1);
+}
+
+/**
+ * Convert both lanes from Q15 in [-1, 1] to duties in [0, top], top being
+ * the max duty, as duty_get(). The sum is computed by a 16x16
+ * multiply-accumulate per lane, and the results are packed from their high
+ * halves.
+ */
+static inline uint32_t dsp_duty(uint32_t x, int top)
+{
+    int k = SINLUT_ONE * top + SINLUT_ONE;
+    int a = dsp_lo(x) * top + k;
+    int b = dsp_hi(x) * top + k;
+    return dsp_pkhtb((uint32_t)b, (uint32_t)a, 16);
+}
+
+/**
+ * Return top - duty on both lanes, the duties of the negated ports.
+ */
+static inline uint32_t dsp_complement(uint32_t duties, int top)
+{
+    return dsp_ssub16(dsp_pack(top, top), duties);
+}
+
+
+#endif
@@ -0,0 +1,44 @@
+/*
+ *  duty.h
+ *
+ *  Copyright (c) 2019 Gabriele Mondada.
+ *  This software is distributed under the terms of the MIT license.
+ *  See https://opensource.org/licenses/MIT
+ *
+ */
+
+#ifndef _DUTY_H_
+#define _DUTY_H_
+
+#include <stdint.h>
+#include "sinlut.h"
+
+
+/*** inline functions ***/
+
+/**
+ * Convert a Q15 value in [-1, 1] to a duty cycle in [0, top], top being the
+ * max duty, i.e. pwm_range - 1. 2 * SINLUT_ONE is approximated by 2^16, the
+ * error is below 2 * top / 65536 count.
+ */
+static inline int duty_get(int value, int top)
+{
+    return ((value + SINLUT_ONE) * top + SINLUT_ONE) >> 16;
+}
+
+/**
+ * Same as duty_get() but with first-order error feedback: the fraction
+ * dropped by the truncation is kept in err and added to the next duty, so
+ * that the sum of successive duties stays within one count of the exact
+ * sum. The average thus reaches a resolution of 1/65536 count instead of
+ * 1/2 count.
+ */
+static inline int duty_dither(int value, int top, uint16_t *err)
+{
+    uint32_t x = (uint32_t)(value + SINLUT_ONE) * (uint32_t)top + *err;
+    *err = (uint16_t)x;
+    return (int)(x >> 16);
+}
+
+
+#endif
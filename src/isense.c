@@ -0,0 +1,132 @@
+/*
+ *  isense.c
+ *
+ *  Copyright (c) 2019 Gabriele Mondada.
+ *  This software is distributed under the terms of the MIT license.
+ *  See https://opensource.org/licenses/MIT
+ *
+ */
+
+#include "stm32f4xx.h"
+#include "isense.h"
+
+/*
+ * Phase current sampling:
+ * ADC1 converts the current sensors as a regular scan, triggered by the
+ * TRGO of TIM3, which outputs its update events. In center-aligned mode,
+ * update events occur at both ends of the PWM triangle, so every scan is
+ * taken in the middle of a PWM pulse, away from the switching edges. TIM3 is
+ * synchronized to TIM1, so the sampling points are the ones of all timers
+ * unless a stagger is configured, see pwm.c.
+ * In edge-aligned mode, the update event is the rising edge of all ports,
+ * and the falling edges move with the duties, so no compare channel would
+ * stay away from them either. Samples are then taken at a switching edge
+ * and users must not rely on them: the stepper refuses current sensing in
+ * that mode.
+ * Injected conversions would be the classic choice, but they cannot be
+ * transferred by DMA, so a regular scan is used instead. DMA2 Stream0
+ * copies each scan into a ring in circular mode, without any interrupt.
+ * Readers find the last complete scan from the DMA counter.
+ *
+ * Pins are PC1, PC2, PC4 and PC5 (ADC123_IN11, IN12, IN14 and IN15).
+ */
+#define ISENSE_DMA_STREAM   DMA2_Stream0
+#define ISENSE_DMA_CHANNEL  DMA_Channel_0
+
+static const uint8_t _channels[ISENSE_COUNT] = {
+    ADC_Channel_11, ADC_Channel_12, ADC_Channel_14, ADC_Channel_15,
+};
+
+volatile struct isense_scan isense_ring[ISENSE_RING];
+
+
+static void _gpio_init(void)
+{
+    GPIO_InitTypeDef pgio_def = {
+        .GPIO_Pin = GPIO_Pin_1 | GPIO_Pin_2 | GPIO_Pin_4 | GPIO_Pin_5,
+        .GPIO_Mode = GPIO_Mode_AN,
+        .GPIO_PuPd = GPIO_PuPd_NOPULL,
+    };
+    RCC_AHB1PeriphClockCmd(RCC_AHB1Periph_GPIOC, ENABLE);
+    GPIO_Init(GPIOC, &pgio_def);
+}
+
+static void _dma_init(void)
+{
+    DMA_InitTypeDef dma_def = {
+        .DMA_Channel = ISENSE_DMA_CHANNEL,
+        .DMA_PeripheralBaseAddr = (uint32_t)&ADC1->DR,
+        .DMA_Memory0BaseAddr = (uint32_t)isense_ring,
+        .DMA_DIR = DMA_DIR_PeripheralToMemory,
+        .DMA_BufferSize = ISENSE_RING * ISENSE_COUNT,
+        .DMA_PeripheralInc = DMA_PeripheralInc_Disable,
+        .DMA_MemoryInc = DMA_MemoryInc_Enable,
+        .DMA_PeripheralDataSize = DMA_PeripheralDataSize_HalfWord,
+        .DMA_MemoryDataSize = DMA_MemoryDataSize_HalfWord,
+        .DMA_Mode = DMA_Mode_Circular,
+        .DMA_Priority = DMA_Priority_High,
+        .DMA_FIFOMode = DMA_FIFOMode_Disable,
+        .DMA_FIFOThreshold = DMA_FIFOThreshold_Full,
+        .DMA_MemoryBurst = DMA_MemoryBurst_Single,
+        .DMA_PeripheralBurst = DMA_PeripheralBurst_Single,
+    };
+    RCC_AHB1PeriphClockCmd(RCC_AHB1Periph_DMA2, ENABLE);
+    DMA_Cmd(ISENSE_DMA_STREAM, DISABLE);
+    while (DMA_GetCmdStatus(ISENSE_DMA_STREAM) != DISABLE);
+    DMA_Init(ISENSE_DMA_STREAM, &dma_def);
+    DMA_Cmd(ISENSE_DMA_STREAM, ENABLE);
+}
+
+static void _adc_init(void)
+{
+    RCC_APB2PeriphClockCmd(RCC_APB2Periph_ADC1, ENABLE);
+
+    // 21 MHz ADC clock, a scan lasts ISENSE_COUNT * 1.3 us
+    ADC_CommonInitTypeDef common_def = {
+        .ADC_Mode = ADC_Mode_Independent,
+        .ADC_Prescaler = ADC_Prescaler_Div4,
+        .ADC_DMAAccessMode = ADC_DMAAccessMode_Disabled,
+        .ADC_TwoSamplingDelay = ADC_TwoSamplingDelay_5Cycles,
+    };
+    ADC_CommonInit(&common_def);
+
+    ADC_InitTypeDef adc_def = {
+        .ADC_Resolution = ADC_Resolution_12b,
+        .ADC_ScanConvMode = ENABLE,
+        .ADC_ContinuousConvMode = DISABLE,
+        .ADC_ExternalTrigConvEdge = ADC_ExternalTrigConvEdge_Rising,
+        .ADC_ExternalTrigConv = ADC_ExternalTrigConv_T3_TRGO,
+        .ADC_DataAlign = ADC_DataAlign_Right,
+        .ADC_NbrOfConversion = ISENSE_COUNT,
+    };
+    ADC_Init(ADC1, &adc_def);
+    for (int i = 0; i < ISENSE_COUNT; i++)
+        ADC_RegularChannelConfig(ADC1, _channels[i], (uint8_t)(i + 1), ADC_SampleTime_15Cycles);
+
+    ADC_DMARequestAfterLastTransferCmd(ADC1, ENABLE);
+    ADC_DMACmd(ADC1, ENABLE);
+    ADC_Cmd(ADC1, ENABLE);
+}
+
+/**
+ * Start sampling. Scans begin with the first update event of TIM3, so this
+ * can be called before or after the PWM is started.
+ */
+void isense_init(void)
+{
+    for (int i = 0; i < ISENSE_RING; i++) {
+        for (int j = 0; j < ISENSE_COUNT; j++)
+            isense_ring[i].raw[j] = ISENSE_ZERO;
+    }
+    _gpio_init();
+    _dma_init();
+    _adc_init();
+}
+
+/**
+ * Return the number of transfers remaining in the DMA ring before it wraps.
+ */
+int isense_remaining(void)
+{
+    return (int)DMA_GetCurrDataCounter(ISENSE_DMA_STREAM);
+}
@@ -0,0 +1,82 @@
+/*
+ *  isense.h
+ *
+ *  Copyright (c) 2019 Gabriele Mondada.
+ *  This software is distributed under the terms of the MIT license.
+ *  See https://opensource.org/licenses/MIT
+ *
+ */
+
+#ifndef _ISENSE_H_
+#define _ISENSE_H_
+
+#include <stdint.h>
+
+
+/*** literals ***/
+
+/*
+ * Phase currents are sampled for the first ISENSE_COUNT / 2 motors, phase a
+ * and b of motor n being channels 2n and 2n + 1.
+ */
+#define ISENSE_COUNT        4
+#define ISENSE_RING         16 // scans kept, power of 2
+#define ISENSE_ZERO         2048 // ADC count at 0 A, bidirectional sensors
+
+
+/*** types ***/
+
+struct isense_scan {
+    uint16_t raw[ISENSE_COUNT];
+};
+
+
+/*** globals ***/
+
+/*
+ * Written by DMA, one scan per PWM update event of TIM3.
+ */
+extern volatile struct isense_scan isense_ring[ISENSE_RING];
+
+
+/*** prototypes ***/
+
+void isense_init(void);
+int isense_remaining(void);
+
+
+/*** inline functions ***/
+
+/**
+ * Return the index of the last complete scan, given the number of transfers
+ * remaining in the DMA ring.
+ */
+static inline int isense_last(int remaining)
+{
+    int done = ISENSE_RING * ISENSE_COUNT - remaining;
+    return (done / ISENSE_COUNT - 1) & (ISENSE_RING - 1);
+}
+
+/**
+ * Return the raw value of a channel in the last complete scan.
+ */
+static inline int isense_raw(int channel)
+{
+    return isense_ring[isense_last(isense_remaining())].raw[channel];
+}
+
+/**
+ * Return the mean raw value of a channel over the n last complete scans,
+ * n from 1 to ISENSE_RING - 1.
+ */
+static inline int isense_mean(int channel, int n)
+{
+    int last = isense_last(isense_remaining());
+    int sum = 0;
+    for (int i = 0; i < n; i++)
+        sum += isense_ring[(last - i) & (ISENSE_RING - 1)].raw[channel];
+    return (sum + n / 2) / n;
+}
+
+
+#endif
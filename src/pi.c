@@ -0,0 +1,38 @@
+/*
+ *  pi.c
+ *
+ *  Copyright (c) 2019 Gabriele Mondada.
+ *  This software is distributed under the terms of the MIT license.
+ *  See https://opensource.org/licenses/MIT
+ *
+ */
+
+#include "pi.h"
+
+/*
+ * Fixed-point PI regulator.
+ *
+ * Gains are integers scaled by 2^PI_SHIFT, the integrator keeps the same
+ * scale so that small errors still accumulate. The integrator is bounded
+ * by the clamping in pi_cycle() only, as it never moves further once the
+ * output saturates.
+ */
+
+/**
+ * Clear the regulator, with the given output limits and zero gains.
+ */
+void pi_init(struct pi *me, int32_t min, int32_t max)
+{
+    *me = (struct pi){
+        .min = min,
+        .max = max,
+    };
+}
+
+/**
+ * Clear the integrator, e.g. when the loop is (re)started.
+ */
+void pi_reset(struct pi *me)
+{
+    me->integ = 0;
+}
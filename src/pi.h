@@ -0,0 +1,66 @@
+/*
+ *  pi.h
+ *
+ *  Copyright (c) 2019 Gabriele Mondada.
+ *  This software is distributed under the terms of the MIT license.
+ *  See https://opensource.org/licenses/MIT
+ *
+ */
+
+#ifndef _PI_H_
+#define _PI_H_
+
+#include <stdint.h>
+
+
+/*** literals ***/
+
+#define PI_SHIFT  12 // fractional bits of gains and integrator
+
+
+/*** types ***/
+
+struct pi {
+    int32_t kp;     // output per error unit, in 1/2^PI_SHIFT
+    int32_t ki;     // output per error unit per sample, in 1/2^PI_SHIFT
+    int32_t min;    // output limits
+    int32_t max;
+    int64_t integ;  // integral term, in 1/2^PI_SHIFT
+};
+
+
+/*** prototypes ***/
+
+void pi_init(struct pi *me, int32_t min, int32_t max);
+void pi_reset(struct pi *me);
+
+
+/*** inline functions ***/
+
+/**
+ * Run one sample for the given error and return the output. When the output
+ * saturates, the integrator is frozen in the direction of the saturation
+ * (clamping anti-windup), so that it does not wind up and the loop recovers
+ * as soon as the error changes sign.
+ */
+static inline int32_t pi_cycle(struct pi *me, int32_t err)
+{
+    int64_t p = (int64_t)me->kp * err;
+    int64_t i = me->integ + (int64_t)me->ki * err;
+    int64_t u = (p + i) >> PI_SHIFT;
+
+    if (u > me->max) {
+        u = me->max;
+        if (i > me->integ)
+            i = me->integ;
+    } else if (u < me->min) {
+        u = me->min;
+        if (i < me->integ)
+            i = me->integ;
+    }
+    me->integ = i;
+    return (int32_t)u;
+}
+
+
+#endif
@@ -0,0 +1,695 @@
+/*
+ *  pwm.c
+ *
+ *  Copyright (c) 2019 Gabriele Mondada.
+ *  This software is distributed under the terms of the MIT license.
+ *  See https://opensource.org/licenses/MIT
+ *
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+#include "stm32f4xx.h"
+#include "pwm.h"
+#include "pwmcore.h"
+
+
+/*
+ * Base clock: 168000000 Hz
+ * Timer 1 + 8 clock: 168000000 Hz
+ * Other Timer clock: 84000000 Hz
+ * For a classic triangular waveform, the counter goes from 0 to PWM_RANGE and
+ * back to 0 with a frequency of:
+ *   PWM_FREQ = PWM_COUNTER_FREQ / (2 * PWM_RANGE)
+ * We want a PWM clock of a multiple of 25 Hz.
+ *   PWM_FREQ = 20000 Hz
+ *   PWM_RANGE = 1050
+ *   PWM_COUNTER_FREQ = 42000000 Hz
+ * The prescaler is computed from PCLK but timers run at twice PCLK, so the
+ * counter actually runs at 2 * PWM_COUNTER_FREQ and the range is doubled:
+ *   range = PWM_COUNTER_FREQ / PWM_FREQ
+ * In edge-aligned mode, the counter goes from 0 to range - 1 and restarts,
+ * so the range is doubled again for the same frequency.
+ *
+ * Update events occur at both ends of the triangle, so at 2 * PWM_FREQ, or
+ * at the end of each period in edge-aligned mode.
+ * The repetition counter of TIM1 divides them by the cycle_div given to
+ * pwm_init(), so that the TIM1 update interrupt only fires once per control
+ * cycle. With an even divider, it always fires at the same end. The divider
+ * can be changed on the fly by pwm_set_repeat().
+ */
+
+/*
+ * DMA:
+ * In DMA mode, duties are written to a RAM frame per timer and each update
+ * event of the timer bursts its frame to CCR1..CCR4 through DMAR. The DMA
+ * runs in circular mode, so the CPU never touches the timer. The burst
+ * follows the update event that latches the preloaded CCRs, so the new
+ * values are only effective one update event later than with CCR writes.
+ * TIM1 is always written directly: its update events are gated by the
+ * repetition counter, so a burst would delay it by a whole cycle.
+ * Switching DMA off while the duties change at each update event drops the
+ * frame being burst, since the lag decreases by one event.
+ * TIM8 update requests are also used by the step/dir output, which then
+ * takes over the stream of TIM8.
+ * Staging and routing are done by pwmcore.c, which accesses the timers and
+ * DMA streams through _hal below.
+ */
+
+/*
+ * Frame alignment:
+ * CCRs are preloaded. Those of TIM1 are only latched by the update events
+ * that pass its repetition counter, i.e. at the update interrupts, so the
+ * duties written by the interrupt are output from the next one on, for the
+ * count set along with them by pwm_set_repeat(). Other timers latch at each
+ * of their update events. Their duties are therefore staged and only
+ * written by pwm_flush(), called by the next interrupt, so that they are
+ * latched one update event after TIM1, or two in DMA mode, and held for the
+ * same count. All ports then change together, up to this constant lag.
+ */
+
+/*
+ * Synchronization:
+ * TIM1 is the master. Other timers are slaves in trigger mode, their counter
+ * being started by the TRGO of their master, which outputs its counter
+ * enable. TIM5 has no trigger input from TIM1, so it is chained to TIM2.
+ * Masters are in master/slave mode, delaying their own start to match their
+ * slaves, so enabling TIM1 starts all counters within a couple of clocks.
+ * Before starting, the counter of timer i is preset to i * pwm_stagger
+ * periods, so that switching edges of different timers do not coincide.
+ * In center-aligned mode, a counter can only be preset while counting up,
+ * so offsets are limited to half a period.
+ * Slaves output their update events on TRGO, TIM3 triggering the current
+ * sampling, see isense.c.
+ */
+#define JOIN_MARGIN  16 // counts, see _tim_join()
+
+struct pwm_tim {
+    TIM_TypeDef *tim;
+    DMA_Stream_TypeDef *dma_stream;
+    uint32_t dma_channel; // update request
+    uint32_t dma_clock;
+    bool trgo;            // starts other timers
+    bool slave;           // started by the trigger input
+    uint16_t trigger;     // internal trigger connected to the master
+};
+
+static const struct pwm_tim _tims[PWM_TIM_COUNT] = {
+    { TIM1, DMA2_Stream5, DMA_Channel_6, RCC_AHB1Periph_DMA2, true,  false, 0 },
+    { TIM2, DMA1_Stream1, DMA_Channel_3, RCC_AHB1Periph_DMA1, true,  true,  TIM_TS_ITR0 }, // TIM1
+    { TIM3, DMA1_Stream2, DMA_Channel_5, RCC_AHB1Periph_DMA1, false, true,  TIM_TS_ITR0 }, // TIM1
+    { TIM4, DMA1_Stream6, DMA_Channel_2, RCC_AHB1Periph_DMA1, false, true,  TIM_TS_ITR0 }, // TIM1
+    { TIM5, DMA1_Stream0, DMA_Channel_6, RCC_AHB1Periph_DMA1, false, true,  TIM_TS_ITR0 }, // TIM2
+    { TIM8, DMA2_Stream1, DMA_Channel_7, RCC_AHB1Periph_DMA2, false, true,  TIM_TS_ITR0 }, // TIM1
+};
+
+#define STEP_TIM  (&_tims[PWM_TIM_COUNT - 1]) // TIM8
+#define ENC_TIM   (&_tims[PWM_ENC_PORT / 4])  // TIM5
+
+// a DMA burst writes consecutive registers from its base, one word each
+#define TIM_REG_OFFSET(base, n)  (((base) + (n)) * sizeof(uint32_t))
+
+_Static_assert(sizeof(struct pwm_frame) == 4 * sizeof(uint32_t)
+               && offsetof(TIM_TypeDef, CCR1) == TIM_REG_OFFSET(TIM_DMABase_CCR1, 0)
+               && offsetof(TIM_TypeDef, CCR4) == TIM_REG_OFFSET(TIM_DMABase_CCR1, 3),
+               "struct pwm_frame must match CCR1..CCR4");
+_Static_assert(sizeof(struct stepgen_slot) == 4 * sizeof(uint32_t)
+               && offsetof(TIM_TypeDef, ARR) == TIM_REG_OFFSET(TIM_DMABase_ARR, 0)
+               && offsetof(TIM_TypeDef, RCR) == TIM_REG_OFFSET(TIM_DMABase_ARR, 1)
+               && offsetof(TIM_TypeDef, CCR1) == TIM_REG_OFFSET(TIM_DMABase_ARR, 2)
+               && offsetof(TIM_TypeDef, CCR2) == TIM_REG_OFFSET(TIM_DMABase_ARR, 3)
+               && offsetof(struct stepgen_slot, ccr2) == 3 * sizeof(uint32_t),
+               "struct stepgen_slot must match ARR, RCR, CCR1 and CCR2");
+
+
+static int _step_count;
+static int _cycle_div = 1;
+static bool _started;
+
+int pwm_freq = PWM_FREQ;
+bool pwm_edge;
+int pwm_range = PWM_COUNTER_FREQ / PWM_FREQ;
+float pwm_stagger;
+
+
+static void _gpio_init(void)
+{
+    GPIO_InitTypeDef pgio_def = { 0 };
+    pgio_def.GPIO_Mode = GPIO_Mode_AF;
+    pgio_def.GPIO_OType = GPIO_OType_PP;
+    pgio_def.GPIO_Speed = GPIO_Speed_100MHz;
+    pgio_def.GPIO_PuPd = GPIO_PuPd_NOPULL;
+
+    RCC_AHB1PeriphClockCmd(RCC_AHB1Periph_GPIOA, ENABLE);
+    RCC_AHB1PeriphClockCmd(RCC_AHB1Periph_GPIOB, ENABLE);
+    RCC_AHB1PeriphClockCmd(RCC_AHB1Periph_GPIOC, ENABLE);
+    RCC_AHB1PeriphClockCmd(RCC_AHB1Periph_GPIOD, ENABLE);
+    RCC_AHB1PeriphClockCmd(RCC_AHB1Periph_GPIOE, ENABLE);
+
+    // setup GPIOs TIM1 (PE9, PE11, PE13, PE14)
+
+    GPIO_PinAFConfig(GPIOE, GPIO_PinSource9,  GPIO_AF_TIM1);
+    GPIO_PinAFConfig(GPIOE, GPIO_PinSource11, GPIO_AF_TIM1);
+    GPIO_PinAFConfig(GPIOE, GPIO_PinSource13, GPIO_AF_TIM1);
+    GPIO_PinAFConfig(GPIOE, GPIO_PinSource14, GPIO_AF_TIM1);
+
+    pgio_def.GPIO_Pin = GPIO_Pin_9 | GPIO_Pin_11 | GPIO_Pin_13 | GPIO_Pin_14;
+    GPIO_Init(GPIOE, &pgio_def);
+
+    // setup GPIOs TIM2 (PA15, PB3, PB10, PB11)
+
+    GPIO_PinAFConfig(GPIOA, GPIO_PinSource15, GPIO_AF_TIM2);
+    GPIO_PinAFConfig(GPIOB, GPIO_PinSource3,  GPIO_AF_TIM2);
+    GPIO_PinAFConfig(GPIOB, GPIO_PinSource10, GPIO_AF_TIM2);
+    GPIO_PinAFConfig(GPIOB, GPIO_PinSource11, GPIO_AF_TIM2);
+
+    pgio_def.GPIO_Pin = GPIO_Pin_15;
+    GPIO_Init(GPIOA, &pgio_def);
+    pgio_def.GPIO_Pin = GPIO_Pin_3 | GPIO_Pin_10 | GPIO_Pin_11;
+    GPIO_Init(GPIOB, &pgio_def);
+
+    // setup GPIOs TIM3 (PA6, PA7, PB0, PB1)
+
+    GPIO_PinAFConfig(GPIOA, GPIO_PinSource6,  GPIO_AF_TIM3);
+    GPIO_PinAFConfig(GPIOA, GPIO_PinSource7,  GPIO_AF_TIM3);
+    GPIO_PinAFConfig(GPIOB, GPIO_PinSource0,  GPIO_AF_TIM3);
+    GPIO_PinAFConfig(GPIOB, GPIO_PinSource1,  GPIO_AF_TIM3);
+
+    pgio_def.GPIO_Pin = GPIO_Pin_6 | GPIO_Pin_7;
+    GPIO_Init(GPIOA, &pgio_def);
+    pgio_def.GPIO_Pin = GPIO_Pin_0 | GPIO_Pin_1;
+    GPIO_Init(GPIOB, &pgio_def);
+
+    // setup GPIOs TIM4 (PD12, PD13, PD14, PD15)
+
+    GPIO_PinAFConfig(GPIOD, GPIO_PinSource12, GPIO_AF_TIM4);
+    GPIO_PinAFConfig(GPIOD, GPIO_PinSource13, GPIO_AF_TIM4);
+    GPIO_PinAFConfig(GPIOD, GPIO_PinSource14, GPIO_AF_TIM4);
+    GPIO_PinAFConfig(GPIOD, GPIO_PinSource15, GPIO_AF_TIM4);
+
+    pgio_def.GPIO_Pin = GPIO_Pin_12 | GPIO_Pin_13 | GPIO_Pin_14 | GPIO_Pin_15;
+    GPIO_Init(GPIOD, &pgio_def);
+
+    // setup GPIOs TIM5 (PA0, PA1, PA2, PA3)
+
+    GPIO_PinAFConfig(GPIOA, GPIO_PinSource0,  GPIO_AF_TIM5);
+    GPIO_PinAFConfig(GPIOA, GPIO_PinSource1,  GPIO_AF_TIM5);
+    GPIO_PinAFConfig(GPIOA, GPIO_PinSource2,  GPIO_AF_TIM5);
+    GPIO_PinAFConfig(GPIOA, GPIO_PinSource3,  GPIO_AF_TIM5);
+
+    pgio_def.GPIO_Pin = GPIO_Pin_0 | GPIO_Pin_1 | GPIO_Pin_2 | GPIO_Pin_3;
+    GPIO_Init(GPIOA, &pgio_def);
+
+    // setup GPIOs TIM8 (PC6, PC7, PC8, PC9)
+
+    GPIO_PinAFConfig(GPIOC, GPIO_PinSource6, GPIO_AF_TIM8);
+    GPIO_PinAFConfig(GPIOC, GPIO_PinSource7, GPIO_AF_TIM8);
+    GPIO_PinAFConfig(GPIOC, GPIO_PinSource8, GPIO_AF_TIM8);
+    GPIO_PinAFConfig(GPIOC, GPIO_PinSource9, GPIO_AF_TIM8);
+
+    pgio_def.GPIO_Pin = GPIO_Pin_6 | GPIO_Pin_7 | GPIO_Pin_8 | GPIO_Pin_9;
+    GPIO_Init(GPIOC, &pgio_def);
+}
+
+static void _irq_init(TIM_TypeDef *tim)
+{
+    NVIC_InitTypeDef NVIC_InitStructure;
+    NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = 0;
+    NVIC_InitStructure.NVIC_IRQChannelSubPriority = 0;
+    NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
+    if (tim == TIM1) {
+        NVIC_InitStructure.NVIC_IRQChannel = TIM1_UP_TIM10_IRQn;
+        NVIC_Init(&NVIC_InitStructure);
+    }
+    if (tim == TIM8) {
+        NVIC_InitStructure.NVIC_IRQChannel = TIM8_UP_TIM13_IRQn;
+        NVIC_Init(&NVIC_InitStructure);
+    }
+
+    TIM_ITConfig(tim, TIM_IT_Update, ENABLE);
+}
+
+static void _tim_init(TIM_TypeDef *tim)
+{
+    TIM_TimeBaseInitTypeDef TIM_TimeBaseStructure = {0};
+    RCC_ClocksTypeDef RCC_ClocksFreq;
+    int base_clock = 0;
+    int tim_index = -1;
+
+    // enable and configure clock
+    RCC_GetClocksFreq(&RCC_ClocksFreq);
+    if (tim == TIM1) {
+        tim_index = 1;
+        RCC_APB2PeriphClockCmd(RCC_APB2Periph_TIM1, ENABLE);
+        base_clock = (int)RCC_ClocksFreq.PCLK2_Frequency;
+    }
+    if (tim == TIM2) {
+        tim_index = 2;
+        RCC_APB1PeriphClockCmd(RCC_APB1Periph_TIM2, ENABLE);
+        base_clock = (int)RCC_ClocksFreq.PCLK1_Frequency;
+    }
+    if (tim == TIM3) {
+        tim_index = 3;
+        RCC_APB1PeriphClockCmd(RCC_APB1Periph_TIM3, ENABLE);
+        base_clock = (int)RCC_ClocksFreq.PCLK1_Frequency;
+    }
+    if (tim == TIM4) {
+        tim_index = 4;
+        RCC_APB1PeriphClockCmd(RCC_APB1Periph_TIM4, ENABLE);
+        base_clock = (int)RCC_ClocksFreq.PCLK1_Frequency;
+    }
+    if (tim == TIM5) {
+        tim_index = 5;
+        RCC_APB1PeriphClockCmd(RCC_APB1Periph_TIM5, ENABLE);
+        base_clock = (int)RCC_ClocksFreq.PCLK1_Frequency;
+    }
+    if (tim == TIM8) {
+        tim_index = 8;
+        RCC_APB2PeriphClockCmd(RCC_APB2Periph_TIM8, ENABLE);
+        base_clock = (int)RCC_ClocksFreq.PCLK2_Frequency;
+    }
+    TIM_TimeBaseStructure.TIM_Period = (uint32_t)pwm_get_arr(pwm_range, pwm_edge); // TIMx->ARR register
+    if (pwm_edge)
+        TIM_TimeBaseStructure.TIM_CounterMode = TIM_CounterMode_Up; // TIMx->CR1 register
+    else
+        TIM_TimeBaseStructure.TIM_CounterMode = TIM_CounterMode_CenterAligned2;
+    TIM_TimeBaseStructure.TIM_Prescaler = (base_clock / PWM_COUNTER_FREQ) - 1;
+    TIM_TimeBaseStructure.TIM_RepetitionCounter = (tim == TIM1) ? _cycle_div - 1 : 0; // TIMx->RCR
+    TIM_TimeBaseInit(tim, &TIM_TimeBaseStructure);
+    printf("timer %d: base_clock=%d pwm_freq=%g range=%d rep=%d%s\n",
+            tim_index, base_clock,
+            2.0 * base_clock / (TIM_TimeBaseStructure.TIM_Prescaler + 1) / (pwm_edge ? 1 : 2) / pwm_range,
+            pwm_range, TIM_TimeBaseStructure.TIM_RepetitionCounter + 1,
+            pwm_edge ? " edge" : "");
+
+    // set output mode
+    TIM_OCInitTypeDef TIM_OCInitStructure = {
+        .TIM_OCMode = TIM_OCMode_PWM1,
+        .TIM_OutputState = TIM_OutputState_Enable,
+        .TIM_OutputNState = TIM_OutputNState_Disable,
+        .TIM_OCPolarity = TIM_OCPolarity_High,
+        .TIM_OCNPolarity = TIM_OCNPolarity_High,
+        .TIM_OCIdleState = TIM_OCIdleState_Reset,
+    };
+    TIM_OC1Init(tim, &TIM_OCInitStructure);
+    TIM_OC2Init(tim, &TIM_OCInitStructure);
+    TIM_OC3Init(tim, &TIM_OCInitStructure);
+    TIM_OC4Init(tim, &TIM_OCInitStructure);
+
+    // enable outputs (do TIMx->BDTR |= TIM_BDTR_MOE)
+    TIM_CtrlPWMOutputs(tim, ENABLE);
+
+    // set preload mode (working with shadow registers, see CCMR1)
+    TIM_OC1PreloadConfig(tim, TIM_OCPreload_Enable);
+    TIM_OC2PreloadConfig(tim, TIM_OCPreload_Enable);
+    TIM_OC3PreloadConfig(tim, TIM_OCPreload_Enable);
+    TIM_OC4PreloadConfig(tim, TIM_OCPreload_Enable);
+
+    // set counter starting value
+    tim->CNT = 0;
+}
+
+static void _tim_sync_init(const struct pwm_tim *t)
+{
+    if (t->slave) {
+        TIM_SelectInputTrigger(t->tim, t->trigger);
+        TIM_SelectSlaveMode(t->tim, TIM_SlaveMode_Trigger);
+    }
+    if (t->trgo) {
+        TIM_SelectOutputTrigger(t->tim, TIM_TRGOSource_Enable);
+        TIM_SelectMasterSlaveMode(t->tim, TIM_MasterSlaveMode_Enable);
+    } else {
+        TIM_SelectOutputTrigger(t->tim, TIM_TRGOSource_Update);
+    }
+}
+
+/**
+ * Return the counter offset of the given timer relative to TIM1.
+ */
+static int _tim_offset(int index)
+{
+    int period = pwm_edge ? pwm_range : 2 * pwm_range;
+    int offset = (int)((float)index * pwm_stagger * (float)period);
+    return pwm_edge ? offset % pwm_range : offset;
+}
+
+/**
+ * Start the PWM timers. Only TIM1 is enabled, the others follow through
+ * their trigger input.
+ */
+static void _tim_start(void)
+{
+    for (int i = 1; i < PWM_TIM_COUNT; i++) {
+        if (pwm_core_is_pwm(i))
+            _tims[i].tim->CNT = (uint32_t)_tim_offset(i);
+    }
+    TIM1->CNT = 0;
+    TIM_Cmd(TIM1, ENABLE);
+}
+
+/**
+ * Start a timer while TIM1 is running, setting its counter from the one of
+ * TIM1. Waits until TIM1 counts up far enough from its top, so that it does
+ * not wrap or turn back before the counter is written. The result is exact
+ * within a few counts.
+ */
+static void _tim_join(int index)
+{
+    TIM_TypeDef *tim = _tims[index].tim;
+    int offset = _tim_offset(index);
+    int top = (int)TIM1->ARR;
+    int cnt;
+
+    __disable_irq();
+    do {
+        cnt = (int)TIM1->CNT;
+    } while ((TIM1->CR1 & TIM_CR1_DIR) || (pwm_edge ? cnt : cnt + offset) > top - JOIN_MARGIN);
+    tim->CNT = (uint32_t)(pwm_edge ? (cnt + offset) % pwm_range : cnt + offset);
+    TIM_Cmd(tim, ENABLE);
+    __enable_irq();
+}
+
+static void _dma_start(const struct pwm_tim *t, uint32_t base, const void *buf, int size)
+{
+    DMA_InitTypeDef dma_def = {
+        .DMA_Channel = t->dma_channel,
+        .DMA_PeripheralBaseAddr = (uint32_t)&t->tim->DMAR,
+        .DMA_Memory0BaseAddr = (uint32_t)buf,
+        .DMA_DIR = DMA_DIR_MemoryToPeripheral,
+        .DMA_BufferSize = (uint32_t)size,
+        .DMA_PeripheralInc = DMA_PeripheralInc_Disable,
+        .DMA_MemoryInc = DMA_MemoryInc_Enable,
+        .DMA_PeripheralDataSize = DMA_PeripheralDataSize_Word,
+        .DMA_MemoryDataSize = DMA_MemoryDataSize_Word,
+        .DMA_Mode = DMA_Mode_Circular,
+        .DMA_Priority = DMA_Priority_VeryHigh,
+        .DMA_FIFOMode = DMA_FIFOMode_Disable,
+        .DMA_FIFOThreshold = DMA_FIFOThreshold_Full,
+        .DMA_MemoryBurst = DMA_MemoryBurst_Single,
+        .DMA_PeripheralBurst = DMA_PeripheralBurst_Single,
+    };
+    RCC_AHB1PeriphClockCmd(t->dma_clock, ENABLE);
+    DMA_DeInit(t->dma_stream);
+    DMA_Init(t->dma_stream, &dma_def);
+    DMA_Cmd(t->dma_stream, ENABLE);
+    TIM_DMAConfig(t->tim, base, TIM_DMABurstLength_4Transfers);
+    TIM_DMACmd(t->tim, TIM_DMA_Update, ENABLE);
+}
+
+static void _dma_stop(const struct pwm_tim *t)
+{
+    TIM_DMACmd(t->tim, TIM_DMA_Update, DISABLE);
+    DMA_Cmd(t->dma_stream, DISABLE);
+    while (DMA_GetCmdStatus(t->dma_stream) == ENABLE);
+}
+
+static volatile uint32_t *_hal_ccr(int index)
+{
+    return &_tims[index].tim->CCR1;
+}
+
+static void _hal_dma_start(int index, const struct pwm_frame *frame)
+{
+    _dma_start(&_tims[index], TIM_DMABase_CCR1, frame, 4);
+}
+
+static void _hal_dma_stop(int index)
+{
+    _dma_stop(&_tims[index]);
+}
+
+static const struct pwm_hal _hal = {
+    .ccr = _hal_ccr,
+    .dma_start = _hal_dma_start,
+    .dma_stop = _hal_dma_stop,
+};
+
+/**
+ * Setup all timers, TIM1 raising its update interrupt every cycle_div update
+ * events, from 1 to 256.
+ */
+void pwm_init(int freq, bool edge, int cycle_div)
+{
+    pwm_freq = freq;
+    pwm_edge = edge;
+    pwm_range = pwm_get_range(freq, edge);
+    _cycle_div = cycle_div;
+    _gpio_init();
+    pwm_core_init(&_hal);
+
+    for (int i = 0; i < PWM_TIM_COUNT; i++) {
+        _tim_init(_tims[i].tim);
+        _tim_sync_init(&_tims[i]);
+    }
+
+    // TIM1 update drives the control cycle
+    _irq_init(TIM1);
+}
+
+void pwm_start(void)
+{
+    _tim_start();
+    _started = true;
+}
+
+/**
+ * Change the PWM frequency and mode, and the divider of TIM1 update events
+ * as in pwm_init(). Timers are stopped right after a TIM1 update event,
+ * reprogrammed and restarted together, current duties being rescaled to the
+ * new range. Return 0, or -1 if the frequency is out of range or if
+ * pwm_stagger does not fit the mode.
+ * Must be called with the control interrupt masked. Timers taken over by the
+ * step/dir output or the encoder input are left untouched.
+ */
+int pwm_configure(int freq, bool edge, int cycle_div)
+{
+    int range = pwm_get_range(freq, edge);
+    if (!range || !pwm_check_stagger(pwm_stagger, edge))
+        return -1;
+
+    uint32_t duty[PWM_PORT_COUNT];
+    for (int i = 0; i < PWM_PORT_COUNT; i++)
+        duty[i] = (uint32_t)((uint64_t)*pwm_regs[i] * (uint32_t)range / (uint32_t)pwm_range);
+
+    if (_started) {
+        TIM_ClearFlag(TIM1, TIM_FLAG_Update);
+        while (TIM_GetFlagStatus(TIM1, TIM_FLAG_Update) == RESET);
+    }
+    for (int i = 0; i < PWM_TIM_COUNT; i++) {
+        if (pwm_core_is_pwm(i))
+            TIM_Cmd(_tims[i].tim, DISABLE);
+    }
+
+    pwm_freq = freq;
+    pwm_edge = edge;
+    pwm_range = range;
+    _cycle_div = cycle_div;
+
+    // load duties, also in DMA frames, then transfer them by an update event
+    for (int i = 0; i < PWM_TIM_COUNT; i++) {
+        if (!pwm_core_is_pwm(i))
+            continue;
+        _tim_init(_tims[i].tim);
+        for (int j = 0; j < 4; j++)
+            *pwm_regs[i * 4 + j] = duty[i * 4 + j];
+        if (i)
+            pwm_core_flush(i);
+        TIM_GenerateEvent(_tims[i].tim, TIM_EventSource_Update);
+    }
+    TIM_ClearITPendingBit(TIM1, TIM_IT_Update);
+    NVIC_ClearPendingIRQ(TIM1_UP_TIM10_IRQn);
+
+    if (_started)
+        _tim_start();
+    return 0;
+}
+
+/**
+ * Change the counter offset between successive timers, in periods, and
+ * restart the timers as pwm_configure() does. Return 0, or -1 if the
+ * stagger does not fit the current mode.
+ */
+int pwm_set_stagger(float stagger)
+{
+    if (!pwm_check_stagger(stagger, pwm_edge))
+        return -1;
+    pwm_stagger = stagger;
+    return pwm_configure(pwm_freq, pwm_edge, _cycle_div);
+}
+
+/**
+ * Return the clock of TIM1 and TIM8, twice PCLK2 since APB2 is prescaled.
+ */
+int pwm_tim_clock(void)
+{
+    RCC_ClocksTypeDef clocks;
+    RCC_GetClocksFreq(&clocks);
+    return 2 * (int)clocks.PCLK2_Frequency;
+}
+
+/**
+ * Return the period of cycle_div update events, as given to pwm_init(), in
+ * pwm_tim_clock() ticks.
+ */
+int pwm_cycle_ticks(void)
+{
+    return pwm_get_ticks(pwm_range, _cycle_div, pwm_tim_clock());
+}
+
+/**
+ * Set the number of update events between 2 TIM1 update interrupts, from 1
+ * to 256. RCR is preloaded, so when called from the TIM1 update interrupt,
+ * the current period is kept and the new one starts at the next interrupt.
+ */
+void pwm_set_repeat(int count)
+{
+    TIM1->RCR = (uint32_t)(count - 1);
+}
+
+/**
+ * Switch TIM8 to step/dir output. The timer runs edge-aligned at full clock
+ * and each update event transfers the next slot of the circular buffer to
+ * ARR, RCR, CCR1 and CCR2, see struct stepgen_slot. Ports 20 to 23 are not
+ * driven anymore.
+ */
+void pwm_step_start(const struct stepgen_slot *slots, int count)
+{
+    const struct pwm_tim *t = STEP_TIM;
+
+    TIM_Cmd(t->tim, DISABLE);
+    pwm_core_take(PWM_TIM_COUNT - 1);
+
+    // edge-aligned, full clock, ARR preloaded
+    TIM_TimeBaseInitTypeDef TIM_TimeBaseStructure = {0};
+    TIM_TimeBaseStructure.TIM_Period = slots[0].arr;
+    TIM_TimeBaseStructure.TIM_Prescaler = 0;
+    TIM_TimeBaseStructure.TIM_CounterMode = TIM_CounterMode_Up;
+    TIM_TimeBaseStructure.TIM_RepetitionCounter = 0;
+    TIM_TimeBaseInit(t->tim, &TIM_TimeBaseStructure);
+    TIM_ARRPreloadConfig(t->tim, ENABLE);
+
+    // step output is active at the end of the period, dir output is a level
+    TIM_OCInitTypeDef TIM_OCInitStructure = {
+        .TIM_OCMode = TIM_OCMode_PWM2,
+        .TIM_OutputState = TIM_OutputState_Enable,
+        .TIM_OutputNState = TIM_OutputNState_Disable,
+        .TIM_OCPolarity = TIM_OCPolarity_High,
+        .TIM_OCNPolarity = TIM_OCNPolarity_High,
+        .TIM_OCIdleState = TIM_OCIdleState_Reset,
+        .TIM_Pulse = slots[0].ccr1,
+    };
+    TIM_OC1Init(t->tim, &TIM_OCInitStructure);
+    TIM_OCInitStructure.TIM_OCMode = TIM_OCMode_PWM1;
+    TIM_OCInitStructure.TIM_Pulse = slots[0].ccr2;
+    TIM_OC2Init(t->tim, &TIM_OCInitStructure);
+    TIM_OCInitStructure.TIM_Pulse = 0;
+    TIM_OC3Init(t->tim, &TIM_OCInitStructure);
+    TIM_OC4Init(t->tim, &TIM_OCInitStructure);
+
+    _step_count = count;
+    _dma_start(t, TIM_DMABase_ARR, slots, count * 4);
+
+    t->tim->CNT = 0;
+    TIM_Cmd(t->tim, ENABLE);
+}
+
+/**
+ * Give TIM8 back to PWM output.
+ */
+void pwm_step_stop(void)
+{
+    const struct pwm_tim *t = STEP_TIM;
+
+    TIM_Cmd(t->tim, DISABLE);
+    _dma_stop(t);
+    _tim_init(t->tim);
+    pwm_core_give(PWM_TIM_COUNT - 1);
+    _tim_join(PWM_TIM_COUNT - 1);
+}
+
+/**
+ * Return the index of the slot being transferred by the step DMA.
+ */
+int pwm_step_index(void)
+{
+    int n = (int)DMA_GetCurrDataCounter(STEP_TIM->dma_stream);
+    return (_step_count * 4 - n) / 4;
+}
+
+/**
+ * Switch TIM5 to quadrature encoder input on CH1 (PA0) and CH2 (PA1), the
+ * counter counting both edges of both inputs over the full 32 bits. Ports
+ * 16 to 19 are not driven anymore, their duties are staged but not flushed.
+ */
+void pwm_enc_start(void)
+{
+    const struct pwm_tim *t = ENC_TIM;
+
+    TIM_Cmd(t->tim, DISABLE);
+    pwm_core_take(PWM_ENC_PORT / 4);
+
+    // CH3 and CH4 would compare against the encoder count
+    TIM_CCxCmd(t->tim, TIM_Channel_3, TIM_CCx_Disable);
+    TIM_CCxCmd(t->tim, TIM_Channel_4, TIM_CCx_Disable);
+
+    GPIO_InitTypeDef pgio_def = {
+        .GPIO_Pin = GPIO_Pin_0 | GPIO_Pin_1,
+        .GPIO_Mode = GPIO_Mode_AF,
+        .GPIO_OType = GPIO_OType_PP,
+        .GPIO_Speed = GPIO_Speed_100MHz,
+        .GPIO_PuPd = GPIO_PuPd_UP, // open collector encoders
+    };
+    GPIO_Init(GPIOA, &pgio_def);
+
+    TIM_TimeBaseInitTypeDef TIM_TimeBaseStructure = {0};
+    TIM_TimeBaseStructure.TIM_Period = 0xffffffff;
+    TIM_TimeBaseStructure.TIM_Prescaler = 0;
+    TIM_TimeBaseStructure.TIM_CounterMode = TIM_CounterMode_Up;
+    TIM_TimeBaseInit(t->tim, &TIM_TimeBaseStructure);
+
+    TIM_ICInitTypeDef TIM_ICInitStructure;
+    TIM_ICStructInit(&TIM_ICInitStructure);
+    TIM_ICInitStructure.TIM_ICFilter = 6; // 8 samples at fCK_INT / 4
+    TIM_ICInitStructure.TIM_Channel = TIM_Channel_1;
+    TIM_ICInit(t->tim, &TIM_ICInitStructure);
+    TIM_ICInitStructure.TIM_Channel = TIM_Channel_2;
+    TIM_ICInit(t->tim, &TIM_ICInitStructure);
+    TIM_EncoderInterfaceConfig(t->tim, TIM_EncoderMode_TI12,
+                               TIM_ICPolarity_Rising, TIM_ICPolarity_Rising);
+
+    t->tim->CNT = 0;
+    TIM_Cmd(t->tim, ENABLE);
+}
+
+/**
+ * Give TIM5 back to PWM output.
+ */
+void pwm_enc_stop(void)
+{
+    const struct pwm_tim *t = ENC_TIM;
+    int index = PWM_ENC_PORT / 4;
+
+    TIM_Cmd(t->tim, DISABLE);
+
+    GPIO_InitTypeDef pgio_def = {
+        .GPIO_Pin = GPIO_Pin_0 | GPIO_Pin_1,
+        .GPIO_Mode = GPIO_Mode_AF,
+        .GPIO_OType = GPIO_OType_PP,
+        .GPIO_Speed = GPIO_Speed_100MHz,
+        .GPIO_PuPd = GPIO_PuPd_NOPULL,
+    };
+    GPIO_Init(GPIOA, &pgio_def);
+
+    _tim_init(t->tim);
+    _tim_sync_init(t);
+    pwm_core_give(index);
+    _tim_join(index);
+}
+
+/**
+ * Return the encoder count, see pwm_enc_start().
+ */
+uint32_t pwm_enc_count(void)
+{
+    return ENC_TIM->tim->CNT;
+}
@@ -0,0 +1,98 @@
+/*
+ *  pwm.h
+ *
+ *  Copyright (c) 2019 Gabriele Mondada.
+ *  This software is distributed under the terms of the MIT license.
+ *  See https://opensource.org/licenses/MIT
+ *
+ */
+
+#ifndef _PWM_H_
+#define _PWM_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "stepgen.h"
+
+
+/*** literals ***/
+
+/*
+ * Ports are the 4 channels of TIM1, TIM2, TIM3, TIM4, TIM5 and TIM8, in this
+ * order. Port n is channel n % 4 of timer n / 4.
+ */
+#define PWM_TIM_COUNT       6
+#define PWM_PORT_COUNT      (PWM_TIM_COUNT * 4)
+#define PWM_ENC_PORT        16 // first port lost when TIM5 reads an encoder
+#ifndef PWM_FREQ
+#define PWM_FREQ            20000 // Hz, default
+#endif
+#define PWM_COUNTER_FREQ    42000000 // Hz, see pwm.c
+#define PWM_RANGE_MIN       256
+#define PWM_RANGE_MAX       32768 // keeps duty computations within 32 bits
+
+
+/*** types ***/
+
+/*
+ * One timer worth of duty cycles. The layout matches a timer DMA burst
+ * starting at CCR1.
+ */
+struct pwm_frame {
+    uint32_t ccr[4];
+};
+
+
+/*** globals ***/
+
+/*
+ * Where the duty of each port is written: the CCR register itself for TIM1,
+ * a staging frame flushed by pwm_flush() for the other timers.
+ */
+extern volatile uint32_t *pwm_regs[PWM_PORT_COUNT];
+
+/*
+ * Current configuration, set by pwm_init() and pwm_configure(). Duties go
+ * from 0 to pwm_range - 1.
+ */
+extern int pwm_freq;
+extern bool pwm_edge;
+extern int pwm_range;
+extern float pwm_stagger; // counter offset between successive timers, in periods
+
+
+/*** prototypes ***/
+
+int pwm_get_range(int freq, bool edge);
+int pwm_get_arr(int range, bool edge);
+int pwm_get_ticks(int range, int cycle_div, int tim_clock);
+int pwm_get_cycle_div(int range, bool edge, int cycle_freq, int div_max);
+float pwm_get_cycle_time(int range, int cycle_div);
+void pwm_init(int freq, bool edge, int cycle_div);
+int pwm_configure(int freq, bool edge, int cycle_div);
+bool pwm_check_stagger(float stagger, bool edge);
+int pwm_set_stagger(float stagger);
+void pwm_start(void);
+void pwm_set_dma(bool enable);
+bool pwm_get_dma(void);
+int pwm_tim_clock(void);
+int pwm_cycle_ticks(void);
+void pwm_set_repeat(int count);
+void pwm_flush(void);
+void pwm_step_start(const struct stepgen_slot *slots, int count);
+void pwm_step_stop(void);
+int pwm_step_index(void);
+void pwm_enc_start(void);
+void pwm_enc_stop(void);
+uint32_t pwm_enc_count(void);
+
+
+/*** inline functions ***/
+
+static inline void pwm_set(int port, int duty)
+{
+    *pwm_regs[port] = (uint32_t)duty;
+}
+
+
+#endif
@@ -0,0 +1,214 @@
+/*
+ *  pwmcore.c
+ *
+ *  Copyright (c) 2019 Gabriele Mondada.
+ *  This software is distributed under the terms of the MIT license.
+ *  See https://opensource.org/licenses/MIT
+ *
+ */
+
+#include <math.h>
+#include "pwmcore.h"
+
+/*
+ * Hardware-independent part of the pwm module: the timing arithmetic of a
+ * configuration, duty staging, routing of the staged duties to the CCR
+ * registers or to the DMA frames, and timers taken over by the step/dir
+ * output or the encoder input. See frame alignment and DMA in pwm.c.
+ * Registers are only accessed through struct pwm_hal.
+ */
+
+
+volatile uint32_t *pwm_regs[PWM_PORT_COUNT];
+
+static const struct pwm_hal *_hal;
+static struct pwm_frame _frames[PWM_TIM_COUNT]; // DMA frames
+static struct pwm_frame _stage[PWM_TIM_COUNT];  // duties to flush, not used for TIM1
+static volatile uint32_t *_dst[PWM_TIM_COUNT];  // CCR1 or DMA frame flushed to
+static uint32_t _taken;                         // mask of timers not outputting PWM
+static bool _dma;
+
+
+/**
+ * Route the staged duties of a timer other than TIM1 to its CCR registers or
+ * to its DMA frame, the duties being carried over.
+ */
+static void _route(int index, bool dma)
+{
+    volatile uint32_t *ccr = _hal->ccr(index);
+
+    if (dma) {
+        for (int i = 0; i < 4; i++)
+            _frames[index].ccr[i] = ccr[i];
+        _dst[index] = _frames[index].ccr;
+        _hal->dma_start(index, &_frames[index]);
+    } else {
+        _hal->dma_stop(index);
+        for (int i = 0; i < 4; i++)
+            ccr[i] = _frames[index].ccr[i];
+        _dst[index] = ccr;
+    }
+}
+
+/**
+ * Return the range for the given PWM frequency and mode, or 0 if out of
+ * [PWM_RANGE_MIN, PWM_RANGE_MAX].
+ */
+int pwm_get_range(int freq, bool edge)
+{
+    if (freq <= 0)
+        return 0;
+    int range = (edge ? 2 : 1) * (PWM_COUNTER_FREQ / freq);
+    if (range < PWM_RANGE_MIN || range > PWM_RANGE_MAX)
+        return 0;
+    return range;
+}
+
+/**
+ * Return the ARR value for the given range and mode. In edge-aligned mode,
+ * the counter goes from 0 to ARR and restarts, in center-aligned mode up to
+ * ARR and back, so update events occur every range counts in both modes.
+ */
+int pwm_get_arr(int range, bool edge)
+{
+    return edge ? range - 1 : range;
+}
+
+/**
+ * Return the period of cycle_div update events at the given range, in ticks
+ * of a timer clock of tim_clock Hz, twice the APB clock the prescaler is
+ * computed from, see pwm_tim_clock().
+ */
+int pwm_get_ticks(int range, int cycle_div, int tim_clock)
+{
+    return range * cycle_div * (tim_clock / (2 * PWM_COUNTER_FREQ)); // prescaler
+}
+
+/**
+ * Return the update events per control cycle for the given range and mode,
+ * the closest to a cycle frequency of cycle_freq Hz, up to div_max. In
+ * center-aligned mode, the result is even, so that the TIM1 interrupt stays
+ * at the same end of the triangle.
+ */
+int pwm_get_cycle_div(int range, bool edge, int cycle_freq, int div_max)
+{
+    float events = 2.0f * PWM_COUNTER_FREQ / (float)range / (float)cycle_freq;
+    int step = edge ? 1 : 2;
+    int div = (int)lroundf(events / (float)step) * step;
+    if (div < step)
+        div = step;
+    if (div > div_max)
+        div = div_max;
+    return div;
+}
+
+/**
+ * Return the duration of cycle_div update events at the given range, in
+ * seconds.
+ */
+float pwm_get_cycle_time(int range, int cycle_div)
+{
+    return (float)(cycle_div * range) / (2.0f * PWM_COUNTER_FREQ);
+}
+
+/**
+ * Return whether the given stagger, in periods between successive timers,
+ * can be applied in the given mode.
+ */
+bool pwm_check_stagger(float stagger, bool edge)
+{
+    if (stagger < 0.0f || stagger >= 1.0f)
+        return false;
+    return edge || (float)(PWM_TIM_COUNT - 1) * stagger <= 0.5f;
+}
+
+/**
+ * Point pwm_regs to the CCR registers of TIM1 and to the staging frames of
+ * the other timers, which are written directly, without DMA.
+ */
+void pwm_core_init(const struct pwm_hal *hal)
+{
+    _hal = hal;
+    _taken = 0;
+    _dma = false;
+    for (int i = 0; i < PWM_TIM_COUNT; i++) {
+        volatile uint32_t *ccr = hal->ccr(i);
+        for (int j = 0; j < 4; j++)
+            pwm_regs[i * 4 + j] = i ? &_stage[i].ccr[j] : &ccr[j];
+        _dst[i] = ccr;
+    }
+}
+
+/**
+ * Return whether the given timer outputs PWM.
+ */
+bool pwm_core_is_pwm(int index)
+{
+    return !(_taken & (1u << index));
+}
+
+/**
+ * Stop writing duties to a timer other than TIM1, e.g. when the step/dir
+ * output takes it over. Its duties are still staged.
+ */
+void pwm_core_take(int index)
+{
+    _taken |= 1u << index;
+    _hal->dma_stop(index);
+}
+
+/**
+ * Give a timer taken by pwm_core_take() back to PWM output, routed as set
+ * by pwm_set_dma() meanwhile, and write its staged duties.
+ */
+void pwm_core_give(int index)
+{
+    _taken &= ~(1u << index);
+    _route(index, _dma);
+    pwm_core_flush(index);
+}
+
+/**
+ * Write the staged duties of a timer other than TIM1.
+ */
+void pwm_core_flush(int index)
+{
+    volatile uint32_t *dst = _dst[index];
+    for (int i = 0; i < 4; i++)
+        dst[i] = _stage[index].ccr[i];
+}
+
+/**
+ * Write the duties staged since the previous call for the timers other than
+ * TIM1, see frame alignment. Called by the TIM1 update interrupt before it
+ * writes the duties of the next frame.
+ */
+void pwm_flush(void)
+{
+    for (int i = 1; i < PWM_TIM_COUNT; i++) {
+        if (pwm_core_is_pwm(i))
+            pwm_core_flush(i);
+    }
+}
+
+/**
+ * Switch between DMA and direct CCR updates. Must not race with pwm_set(),
+ * so the caller masks the control interrupt.
+ */
+void pwm_set_dma(bool enable)
+{
+    if (enable == _dma)
+        return;
+    _dma = enable;
+
+    // TIM1 is always written directly, see DMA
+    for (int i = 1; i < PWM_TIM_COUNT; i++) {
+        if (pwm_core_is_pwm(i))
+            _route(i, enable);
+    }
+}
+
+bool pwm_get_dma(void)
+{
+    return _dma;
+}
@@ -0,0 +1,41 @@
+/*
+ *  pwmcore.h
+ *
+ *  Copyright (c) 2019 Gabriele Mondada.
+ *  This software is distributed under the terms of the MIT license.
+ *  See https://opensource.org/licenses/MIT
+ *
+ */
+
+#ifndef _PWMCORE_H_
+#define _PWMCORE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "pwm.h"
+
+
+/*** types ***/
+
+/*
+ * Register access of the pwm module logic, implemented by pwm.c on the
+ * target and by a mock on the host, see sim/pwmtest.c. Timers are given by
+ * their index, 0 being TIM1.
+ */
+struct pwm_hal {
+    volatile uint32_t *(*ccr)(int index);                        // CCR1..CCR4
+    void (*dma_start)(int index, const struct pwm_frame *frame); // burst the frame at each update event
+    void (*dma_stop)(int index);                                 // no burst occurs anymore on return
+};
+
+
+/*** prototypes ***/
+
+void pwm_core_init(const struct pwm_hal *hal);
+bool pwm_core_is_pwm(int index);
+void pwm_core_take(int index);
+void pwm_core_give(int index);
+void pwm_core_flush(int index);
+
+
+#endif
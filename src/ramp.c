@@ -10,34 +10,142 @@
 #include "ramp.h"
 #include <math.h>
 
+/*
+ * Two-rate pipeline:
+ * The trajectory planner (traj_step() and its jerk filter) can run at a
+ * lower rate than ramp_cycle() is called. With plan_shift=n, the planner
+ * runs once every 2^n cycles and the positions in between are interpolated,
+ * either linearly between the last two planner positions or with a parabola
+ * going through the last three. The interpolation introduces a delay of one
+ * planner period. Note that the jerk time, given by TRAJ_JL_SIZE, is
+ * expressed in planner periods and thus becomes 2^n times longer.
+ * A cycle lasts cycle_time, given at init. The caller may skip cycles by
+ * passing n > 1 to ramp_cycle(), the trajectory time stays the same.
+ */
+
+
+static float _plan_time(struct ramp *me)
+{
+    return me->cycle_time * (float)(1 << me->plan_shift);
+}
 
-void ramp_init(struct ramp *me)
+void ramp_init(struct ramp *me, float cycle_time)
 {
+    me->cycle_time = cycle_time;
+    me->plan_shift = 0;
+    me->tick = 1; // planner steps at the first cycle
+    me->interp = RAMP_INTERP_LINEAR;
     ramp_set_spd(me, RAMP_SPD);
     ramp_set_acc(me, RAMP_ACC);
 }
 
 void ramp_set_spd(struct ramp *me, float spd)
 {
-    me->traj.sv = (int)round(spd * (float)RAMP_POS_SCALE * RAMP_CYCLE_TIME);
+    me->spd = spd;
+    me->traj.sv = (int)round(spd * (float)RAMP_POS_SCALE * _plan_time(me));
     traj_update(&me->traj);
 }
 
 void ramp_set_acc(struct ramp *me, float acc)
 {
-    me->traj.sa = (int)round(acc * (float)RAMP_POS_SCALE * RAMP_CYCLE_TIME * RAMP_CYCLE_TIME);
+    float t = _plan_time(me);
+    me->acc = acc;
+    me->traj.sa = (int)round(acc * (float)RAMP_POS_SCALE * t * t);
     traj_update(&me->traj);
 }
 
+// min and max are in electric tours
+void ramp_set_limits(struct ramp *me, bool enable, float min, float max)
+{
+    me->traj.min_x = (traj_pos_t)llround((double)min * RAMP_POS_SCALE);
+    me->traj.max_x = (traj_pos_t)llround((double)max * RAMP_POS_SCALE);
+    me->traj.limits = enable;
+    traj_update(&me->traj);
+}
+
+/**
+ * Change the planner rate. It can be done while moving, in which case the
+ * current speed is rescaled to the new planner period.
+ */
+void ramp_set_plan(struct ramp *me, int plan_shift, int interp)
+{
+    if (plan_shift < 0)
+        plan_shift = 0;
+    if (plan_shift > RAMP_PLAN_SHIFT_MAX)
+        plan_shift = RAMP_PLAN_SHIFT_MAX;
+
+    int d = plan_shift - me->plan_shift;
+    if (d > 0)
+        me->traj.v <<= d;
+    else
+        me->traj.v >>= -d;
+
+    me->plan_shift = plan_shift;
+    me->interp = interp;
+    me->tick = 1 << plan_shift; // planner steps at the next cycle
+    ramp_set_spd(me, me->spd);
+    ramp_set_acc(me, me->acc);
+}
+
+/**
+ * Change the cycle time. It can be done while moving, in which case the
+ * current speed is rescaled to the new period.
+ */
+void ramp_set_cycle_time(struct ramp *me, float cycle_time)
+{
+    me->traj.v = (int)lroundf((float)me->traj.v * cycle_time / me->cycle_time);
+    me->cycle_time = cycle_time;
+    ramp_set_spd(me, me->spd);
+    ramp_set_acc(me, me->acc);
+}
+
 void ramp_start(struct ramp *me)
 {
     me->traj.sdir = 1;
 }
 
-// return the electric angle
-float ramp_cycle(struct ramp *me)
+static traj_pos_t _interpolate(struct ramp *me)
 {
-    traj_step(&me->traj);
-    float u = (float)(me->traj.jl_x & (RAMP_POS_SCALE - 1)) / (float)RAMP_POS_SCALE;
-    return u * 2.0f * (float)M_PI;
+    int s = me->plan_shift;
+    traj_pos_t k = me->tick; // position in the planner period, from 1 to 2^s
+    traj_pos_t x0 = me->px[0];
+    traj_pos_t x1 = me->px[1];
+    traj_pos_t x2 = me->px[2];
+
+    if (s == 0)
+        return x2;
+
+    if (me->interp == RAMP_INTERP_QUADRATIC) {
+        // parabola going through x0, x1, x2 at t = -1, 0, 1 with t = k / 2^s
+        traj_pos_t d1 = x2 - x0;
+        traj_pos_t d2 = x2 - 2 * x1 + x0;
+        return x1 + ((((d1 << s) + d2 * k) * k) >> (2 * s + 1));
+    }
+
+    return x1 + (((x2 - x1) * k) >> s);
+}
+
+/**
+ * Advance by n cycles and return the electric angle, a full electric tour
+ * being 2^32. The planner keeps its own rate whatever n, stepping as many
+ * times as needed.
+ */
+uint32_t ramp_cycle(struct ramp *me, int n)
+{
+    int period = 1 << me->plan_shift;
+
+    me->tick += n;
+    while (me->tick > period) {
+        traj_step(&me->traj);
+        me->px[0] = me->px[1];
+        me->px[1] = me->px[2];
+        me->px[2] = me->traj.jl_x;
+        me->tick -= period;
+    }
+
+    traj_pos_t x = _interpolate(me);
+    me->v = (int)((x - me->x) / n);
+    me->x = x;
+
+    return (uint32_t)me->x << (32 - RAMP_POS_SHIFT);
 }
@@ -13,23 +13,41 @@
 #include "traj.h"
 
 
-#define RAMP_CYCLE_TIME  0.0001f   // seconds per cycle
 #define RAMP_ACC         50.0f     // max acceleration in electric tours per second
 #define RAMP_SPD         50.0f     // max speed in electric tours per second
 #define RAMP_POS_SHIFT   23
 #define RAMP_POS_SCALE   (1 << RAMP_POS_SHIFT) // increments per electric tours
 
+#define RAMP_PLAN_SHIFT_MAX    6   // planner runs at least every 64 cycles
+
+#define RAMP_INTERP_LINEAR     0
+#define RAMP_INTERP_QUADRATIC  1
+
 
 struct ramp {
     struct traj traj;
+    float cycle_time;  // seconds per cycle
+    float spd;
+    float acc;
+
+    // two-rate pipeline: the planner runs once every (1 << plan_shift) cycles
+    int plan_shift;
+    int interp;
+    int tick;          // cycles elapsed since px[1], from 1 to 2^plan_shift
+    traj_pos_t px[3];  // last planner positions, px[2] is the most recent
+    traj_pos_t x;      // interpolated position
+    int v;             // velocity in increments per cycle
 };
 
 
-void ramp_init(struct ramp *me);
+void ramp_init(struct ramp *me, float cycle_time);
 void ramp_set_spd(struct ramp *me, float spd);
 void ramp_set_acc(struct ramp *me, float acc);
+void ramp_set_limits(struct ramp *me, bool enable, float min, float max);
+void ramp_set_plan(struct ramp *me, int plan_shift, int interp);
+void ramp_set_cycle_time(struct ramp *me, float cycle_time);
 void ramp_start(struct ramp *me);
-float ramp_cycle(struct ramp *me);
+uint32_t ramp_cycle(struct ramp *me, int n);
 
 
 #endif
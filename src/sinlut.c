@@ -0,0 +1,53 @@
+/*
+ *  sinlut.c
+ *
+ *  Copyright (c) 2019 Gabriele Mondada.
+ *  This software is distributed under the terms of the MIT license.
+ *  See https://opensource.org/licenses/MIT
+ *
+ */
+
+#include <math.h>
+#include "sinlut.h"
+
+/*
+ * The quarter-wave table is computed by the compiler: gcc folds
+ * __builtin_sin() applied to constants, so the table lands in flash
+ * without any code running at start-up. The resolution is chosen with
+ * SINLUT_SHIFT, from 4 to 10.
+ */
+
+#define E(i)     (int16_t)(__builtin_sin((i) * (M_PI / 2 / SINLUT_SIZE)) * SINLUT_ONE + 0.5),
+#define R2(i)    E(i) E((i) + 1)
+#define R4(i)    R2(i) R2((i) + 2)
+#define R8(i)    R4(i) R4((i) + 4)
+#define R16(i)   R8(i) R8((i) + 8)
+#define R32(i)   R16(i) R16((i) + 16)
+#define R64(i)   R32(i) R32((i) + 32)
+#define R128(i)  R64(i) R64((i) + 64)
+#define R256(i)  R128(i) R128((i) + 128)
+#define R512(i)  R256(i) R256((i) + 256)
+#define R1024(i) R512(i) R512((i) + 512)
+
+#if SINLUT_SHIFT == 4
+#define TABLE R16(0)
+#elif SINLUT_SHIFT == 5
+#define TABLE R32(0)
+#elif SINLUT_SHIFT == 6
+#define TABLE R64(0)
+#elif SINLUT_SHIFT == 7
+#define TABLE R128(0)
+#elif SINLUT_SHIFT == 8
+#define TABLE R256(0)
+#elif SINLUT_SHIFT == 9
+#define TABLE R512(0)
+#elif SINLUT_SHIFT == 10
+#define TABLE R1024(0)
+#else
+#error "unsupported SINLUT_SHIFT"
+#endif
+
+const int16_t sinlut_table[SINLUT_SIZE + 1] = {
+    TABLE
+    SINLUT_ONE
+};
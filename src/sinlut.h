@@ -0,0 +1,60 @@
+/*
+ *  sinlut.h
+ *
+ *  Copyright (c) 2019 Gabriele Mondada.
+ *  This software is distributed under the terms of the MIT license.
+ *  See https://opensource.org/licenses/MIT
+ *
+ */
+
+#ifndef _SINLUT_H_
+#define _SINLUT_H_
+
+#include <stdint.h>
+
+
+/*** literals ***/
+
+#ifndef SINLUT_SHIFT
+#define SINLUT_SHIFT  8 // the quarter wave is split in 2^SINLUT_SHIFT intervals
+#endif
+
+#define SINLUT_SIZE   (1 << SINLUT_SHIFT)
+#define SINLUT_ONE    32767 // amplitude, sin and cos are in Q15
+
+#define SINLUT_FRAC_SHIFT  (30 - SINLUT_SHIFT) // angle bits between two entries
+
+
+/*** globals ***/
+
+extern const int16_t sinlut_table[SINLUT_SIZE + 1];
+
+
+/*** inline functions ***/
+
+/**
+ * Return the sine of the given angle, in Q15. A full tour is 2^32, so an
+ * angle is obtained from a position by shifting it to the left.
+ * Linear interpolation between table entries.
+ */
+static inline int sinlut_sin(uint32_t angle)
+{
+    uint32_t p = angle & 0x3fffffff; // angle within the quadrant
+    if (angle & 0x40000000)
+        p = 0x40000000 - p;          // 2nd and 4th quadrants are mirrored
+
+    int i = (int)(p >> SINLUT_FRAC_SHIFT);
+    int f = (int)((p >> (SINLUT_FRAC_SHIFT - 15)) & 0x7fff);
+    int y0 = sinlut_table[i];
+    int y = y0 + (((sinlut_table[i + (i < SINLUT_SIZE)] - y0) * f + 0x4000) >> 15);
+
+    return (angle & 0x80000000) ? -y : y;
+}
+
+static inline int sinlut_cos(uint32_t angle)
+{
+    return sinlut_sin(angle + 0x40000000);
+}
+
+
+#endif
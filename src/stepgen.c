@@ -0,0 +1,154 @@
+/*
+ *  stepgen.c
+ *
+ *  Copyright (c) 2019 Gabriele Mondada.
+ *  This software is distributed under the terms of the MIT license.
+ *  See https://opensource.org/licenses/MIT
+ *
+ */
+
+#include "stepgen.h"
+
+/*
+ * Step-interval generator.
+ *
+ * Converts a position profile, given once per control cycle, into a stream
+ * of timer periods (slots) having each a step pulse at its end. The slots
+ * are meant to be fed by DMA to a timer running in edge-aligned mode, so
+ * that step pulses are timed by hardware with a resolution of one timer
+ * tick, independently of the control cycle.
+ *
+ * Within a control cycle, the position is considered to move linearly from
+ * the previous position to the new one. A step is generated each time the
+ * position crosses a multiple of step_size. The rising edge of the pulse is
+ * placed at the exact crossing time. The dir output is set at the beginning
+ * of the slot, which guarantees a setup time of at least min_ticks - pulse_ticks.
+ * When there is no step for a while, idle slots without pulse are inserted.
+ *
+ * The generator lags behind the given position by at most idle_ticks +
+ * min_ticks. The DMA must therefore run late by more than that, which is
+ * obtained by calling stepgen_prefill() before starting the timer.
+ */
+
+
+static traj_pos_t _floor_div(traj_pos_t n, traj_pos_t d)
+{
+    return (n < 0) ? -((-n - 1) / d + 1) : n / d;
+}
+
+static void _push(struct stepgen *me, int ticks, bool pulse)
+{
+    struct stepgen_slot *slot = me->buf + me->wr;
+    slot->arr = ticks - 1;
+    slot->rcr = 0;
+    slot->ccr1 = pulse ? (uint32_t)(ticks - me->pulse_ticks) : STEPGEN_CCR_OFF;
+    slot->ccr2 = (me->dir > 0) ? STEPGEN_CCR_OFF : 0;
+    me->t_slot += ticks;
+    me->wr++;
+    if (me->wr == me->size)
+        me->wr = 0;
+}
+
+static void _step(struct stepgen *me, int64_t t_edge, int dir)
+{
+    int64_t ticks = t_edge + me->pulse_ticks - me->t_slot;
+    if (ticks < me->min_ticks) {
+        ticks = me->min_ticks;
+        me->late++;
+    }
+    while (ticks > me->idle_ticks + me->min_ticks) {
+        _push(me, me->idle_ticks, false);
+        ticks -= me->idle_ticks;
+    }
+    me->dir = dir;
+    _push(me, (int)ticks, true);
+    me->steps++;
+}
+
+/**
+ * Return whether the slots generated for the given control cycle and pulse
+ * width fit a 16-bit timer, the longest one lasting idle_ticks + min_ticks.
+ */
+bool stepgen_fits(int cycle_ticks, int pulse_ticks)
+{
+    return cycle_ticks / 2 + 2 * pulse_ticks <= STEPGEN_TICKS_MAX;
+}
+
+void stepgen_init(struct stepgen *me, struct stepgen_slot *buf, int size,
+                  int cycle_ticks, int pulse_ticks, traj_pos_t step_size, traj_pos_t x)
+{
+    me->step_size = step_size;
+    me->cycle_ticks = cycle_ticks;
+    me->pulse_ticks = pulse_ticks;
+    me->min_ticks = 2 * pulse_ticks;
+    me->idle_ticks = cycle_ticks / 2;
+    me->buf = buf;
+    me->size = size;
+    me->wr = 0;
+    me->x = x;
+    me->t = 0;
+    me->t_slot = 0;
+    me->dir = 1;
+    me->steps = 0;
+    me->late = 0;
+}
+
+/**
+ * Fill the ring with idle slots covering the given time, defining the delay
+ * between the given positions and the generated steps.
+ */
+void stepgen_prefill(struct stepgen *me, int ticks)
+{
+    while (ticks > 0) {
+        int n = (ticks > me->idle_ticks) ? me->idle_ticks : ticks;
+        _push(me, n, false);
+        ticks -= n;
+    }
+    me->t_slot = me->t;
+}
+
+/**
+ * Generate the slots for the next n control cycles, ending at position x.
+ */
+void stepgen_cycle(struct stepgen *me, traj_pos_t x, int n)
+{
+    int ticks = n * me->cycle_ticks;
+    traj_pos_t s = me->step_size;
+    traj_pos_t x0 = me->x;
+    traj_pos_t n0 = _floor_div(x0, s);
+    traj_pos_t n1 = _floor_div(x, s);
+    int64_t t0 = me->t;
+
+    if (n1 != n0) {
+        int dir;
+        traj_pos_t dx;
+        traj_pos_t d0; // distance to the first step
+        int count;
+        if (n1 > n0) {
+            dir = 1;
+            dx = x - x0;
+            d0 = (n0 + 1) * s - x0;
+            count = (int)(n1 - n0);
+        } else {
+            dir = -1;
+            dx = x0 - x;
+            d0 = x0 - n0 * s;
+            count = (int)(n0 - n1);
+        }
+
+        // step times in 1/65536 ticks
+        int64_t period = ((int64_t)s * ticks << 16) / dx;
+        int64_t t = ((int64_t)d0 * ticks << 16) / dx;
+        for (int i = 0; i < count; i++) {
+            _step(me, t0 + ((t + 0x8000) >> 16), dir);
+            t += period;
+        }
+    }
+
+    me->x = x;
+    me->t = t0 + ticks;
+
+    // fill the gap with idle slots, keeping room for the next step
+    while (me->t - me->t_slot >= me->idle_ticks + me->min_ticks)
+        _push(me, me->idle_ticks, false);
+}
@@ -0,0 +1,70 @@
+/*
+ *  stepgen.h
+ *
+ *  Copyright (c) 2019 Gabriele Mondada.
+ *  This software is distributed under the terms of the MIT license.
+ *  See https://opensource.org/licenses/MIT
+ *
+ */
+
+#ifndef _STEPGEN_H_
+#define _STEPGEN_H_
+
+#include <stdint.h>
+#include "traj.h"
+
+
+/*** literals ***/
+
+#define STEPGEN_CCR_OFF    0xffff // CCR value never reached by the counter
+#define STEPGEN_TICKS_MAX  0xffff // longest slot, its ARR staying below STEPGEN_CCR_OFF
+
+
+/*** types ***/
+
+/*
+ * One timer period. The layout matches a timer DMA burst starting at ARR,
+ * so that a slot is transferred in one go to ARR, RCR, CCR1 and CCR2.
+ */
+struct stepgen_slot {
+    uint32_t arr;   // period - 1
+    uint32_t rcr;   // always 0
+    uint32_t ccr1;  // step output (PWM2): pulse at the end of the period, or STEPGEN_CCR_OFF
+    uint32_t ccr2;  // dir output (PWM1): 0 for low, STEPGEN_CCR_OFF for high
+};
+
+struct stepgen {
+    // parameters
+    traj_pos_t step_size;  // position increments per step
+    int cycle_ticks;       // timer ticks per control cycle
+    int pulse_ticks;       // width of the step pulse
+    int min_ticks;         // min period, also the min dir setup time + pulse
+    int idle_ticks;        // period used when there is no step
+
+    // slot ring, consumed by DMA
+    struct stepgen_slot *buf;
+    int size;
+    int wr;
+
+    // state
+    traj_pos_t x;          // position at the end of the last cycle
+    int64_t t;             // time at the end of the last cycle
+    int64_t t_slot;        // time at which the last written slot ends
+    int dir;
+
+    // statistics
+    int steps;
+    int late;              // steps delayed because closer than min_ticks
+};
+
+
+/*** prototypes ***/
+
+bool stepgen_fits(int cycle_ticks, int pulse_ticks);
+void stepgen_init(struct stepgen *me, struct stepgen_slot *buf, int size,
+                  int cycle_ticks, int pulse_ticks, traj_pos_t step_size, traj_pos_t x);
+void stepgen_prefill(struct stepgen *me, int ticks);
+void stepgen_cycle(struct stepgen *me, traj_pos_t x, int n);
+
+
+#endif
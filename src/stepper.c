@@ -8,6 +8,7 @@
  */
 
 #include <string.h>
+#include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <math.h>
@@ -15,215 +16,416 @@
 #include "gmutil.h"
 #include "stepper.h"
 #include "cli.h"
+#include "cal.h"
+#include "cloop.h"
 #include "core.h"
+#include "damp.h"
+#include "dsp.h"
+#include "duty.h"
+#include "isense.h"
+#include "pi.h"
+#include "pwm.h"
 #include "ramp.h"
+#include "sinlut.h"
+#include "stepgen.h"
 
 
 /*
- * Base clock: 168000000 Hz
- * Timer 1 + 8 clock: 168000000 Hz
- * Other Timer clock: 84000000 Hz
- * For a classic triangular waveform, the counter goes from 0 to RC_RANGE and
- * back to 0 with a frequency of:
- *   RC_PWM_FREQ = RC_PWM_COUNTER_FREQ / (2 * RC_RANGE)
- * We want a PWM clock of a multiple of 25 Hz.
- *   RC_PWM_FREQ = 20000 Hz
- *   RC_RANGE = 1050
- *   RC_PWM_COUNTER_FREQ = 42000000 Hz
- */
-// #define RC_PWM_FREQ               20000 // Hz
-#define RC_PWM_COUNTER_FREQ       42000000 // Hz
-#define RC_RANGE                  (1050 * 2)
+ * Control rate:
+ * RC_CYCLE_FREQ is the max control rate and the time unit of ramps. The
+ * actual rate adapts to the speed of the fastest motor: every frame picks a
+ * rate shift r for the next interval, the longest keeping at least
+ * rate_samples samples per electric tour, and the TIM1 interrupt period is
+ * set to 2^r cycles accordingly. Ramps are advanced by 2^r cycles, so the
+ * trajectory time is not affected.
+ * A cycle lasts rc_cycle_div PWM update events, the closest to
+ * RC_CYCLE_FREQ, so the actual cycle time depends on the PWM configuration.
+ * In center-aligned mode, update events occur at both ends of the triangle
+ * and rc_cycle_div is kept even, so a cycle is a whole number of periods.
+ */
+#ifndef RC_CYCLE_FREQ
+#define RC_CYCLE_FREQ             20000 // Hz
+#endif
+#define RC_RATE_SHIFT_MAX         6
+#define RC_CYCLE_DIV_MAX          (256 >> RC_RATE_SHIFT_MAX)
 
+/*
+ * Duties are written through pwm_regs, either directly to the CCR registers
+ * or to the DMA frames of the pwm module, see stdma. The pwm module delays
+ * the timers other than TIM1 by one frame, so that all motors output a frame
+ * from the next interrupt on, for the period set along with it (see frame
+ * alignment in pwm.c).
+ * With stdsp, phases a and b are computed together, packed in one word,
+ * with the SIMD instructions of the M4 (see dsp.h). The results are the same
+ * as with the scalar code, see sim/dsptest.c, which is used by default until
+ * the time saved in the interrupt is measured, and always for dithering and
+ * current mode.
+ */
 
-static int c;
-static struct ramp ramp;
-static float spd = RAMP_SPD;
+/*
+ * Motors:
+ * Each motor drives 4 consecutive ports (a, -a, b, -b), has its own ramp
+ * and can be enabled separately. Motor registers are named st<n><name>, e.g.
+ * st0spd, and are resolved by _reg_lookup().
+ */
+#define MOTOR_COUNT               6
 
+/*
+ * Phase advance:
+ * The winding current lags the commanded voltage by atan(w * L / R), w being
+ * the electric angular velocity. The commutation angle is advanced by the
+ * same amount, capped to adv_max, using the ramp velocity. The curve is
+ * sampled into a table of ADV_TAB_SIZE steps up to the saturation speed when
+ * the parameters change, and interpolated linearly at run time.
+ */
+#define ADV_TAB_SIZE              32
+#define ADV_MAX_DEFAULT           60.0f // degrees
 
-static void _gpio_init(void)
-{
-    GPIO_InitTypeDef pgio_def = { 0 };
-    pgio_def.GPIO_Mode = GPIO_Mode_AF;
-    pgio_def.GPIO_OType = GPIO_OType_PP;
-    pgio_def.GPIO_Speed = GPIO_Speed_100MHz;
-    pgio_def.GPIO_PuPd = GPIO_PuPd_NOPULL;
+/*
+ * Amplitude law:
+ * The voltage amplitude is amp_hold at standstill and amp_run while moving,
+ * plus a back-EMF feedforward of amp_emf per electric tour per second, all as
+ * a fraction of the full scale. The result is clamped to the full scale.
+ */
 
-    RCC_AHB1PeriphClockCmd(RCC_AHB1Periph_GPIOA, ENABLE);
-    RCC_AHB1PeriphClockCmd(RCC_AHB1Periph_GPIOB, ENABLE);
-    RCC_AHB1PeriphClockCmd(RCC_AHB1Periph_GPIOC, ENABLE);
-    RCC_AHB1PeriphClockCmd(RCC_AHB1Periph_GPIOD, ENABLE);
-    RCC_AHB1PeriphClockCmd(RCC_AHB1Periph_GPIOE, ENABLE);
+/*
+ * Waveforms:
+ * Above wave_half electric tours per second, a motor switches from
+ * microstepping to half-step, and above wave_full to full-step. It switches
+ * back below the same speeds reduced by wave_hyst. A switch only takes place
+ * when the angle crosses a point of the coarser step grid, where both
+ * waveforms have the same direction, so that the position does not jump.
+ * Step vectors keep the amplitude of the sine, so the diagonal ones have
+ * both phases at 1/sqrt(2), unless wave_boost is set: both phases are then
+ * fully on, for 41% more torque, but the current steps by as much when the
+ * waveform switches. Coarse waveforms need fewer samples per electric tour,
+ * see WAVE_STEP_SAMPLES, which lowers the adaptive control rate.
+ */
+#define WAVE_MICRO                0
+#define WAVE_HALF                 1
+#define WAVE_FULL                 2
+#define WAVE_DIAG                 23170 // SINLUT_ONE / sqrt(2)
+#define WAVE_STEP_SAMPLES         8 // min samples per half or full step
 
-    // setup GPIOs TIM1 (PE9, PE11, PE13, PE14)
+/*
+ * Closed loop:
+ * Motor ENC_MOTOR can be driven in closed loop from a quadrature encoder
+ * read by TIM5, see cloop.c. All timers able to decode an encoder are used
+ * for PWM, so the encoder takes over TIM5 and ports PWM_ENC_PORT to
+ * PWM_ENC_PORT + 3 are not driven anymore. The encoder is aligned on the
+ * commanded position when the loop is enabled, the motor being assumed to
+ * hold it. A negative number of counts per tour inverts the direction.
+ * Frames are computed up to RC_AHEAD_COUNT frames before they are output,
+ * so the loop runs in the ISR instead: frames only hold the commanded
+ * position of the motor, which is commutated from the count read when the
+ * frame is output, and the adaptive rate is disabled while the loop is on.
+ */
+#define ENC_MOTOR                 0
+#define ENC_CPT_DEFAULT           80.0f // 1000 lines, 50 electric tours per turn
 
-    GPIO_PinAFConfig(GPIOE, GPIO_PinSource9,  GPIO_AF_TIM1);
-    GPIO_PinAFConfig(GPIOE, GPIO_PinSource11, GPIO_AF_TIM1);
-    GPIO_PinAFConfig(GPIOE, GPIO_PinSource13, GPIO_AF_TIM1);
-    GPIO_PinAFConfig(GPIOE, GPIO_PinSource14, GPIO_AF_TIM1);
+/*
+ * Current control:
+ * Motors having a current sensor, see isense.h, can be driven in current
+ * mode. Currents are only sampled away from the switching edges in
+ * center-aligned mode, so current mode, the back-EMF observer and the
+ * current readings are refused in edge-aligned mode. Frames then hold the
+ * current reference, sin and cos of the commutation angle times the
+ * amplitude law, in Q15 of cur_set. When the frame is output, a PI regulator
+ * per phase compares it with the last current sample and writes its output
+ * as duty. The regulators run every control cycle, so the adaptive rate is
+ * disabled while a motor is in current mode. With the default rates, that is
+ * 20 kHz, one run per PWM period in both PWM modes. The output takes effect
+ * one cycle after the sample on TIM1 and two on the other timers in DMA
+ * mode, see frame alignment in pwm.c. The step response is tested by
+ * sim/pitest.c.
+ */
 
-    pgio_def.GPIO_Pin = GPIO_Pin_9 | GPIO_Pin_11 | GPIO_Pin_13 | GPIO_Pin_14;
-    GPIO_Init(GPIOE, &pgio_def);
+/*
+ * Anti-resonance damping:
+ * A motor can shift its commutation angle against the oscillations of the
+ * rotor around the commanded position, see damp.c. The following error
+ * comes from the encoder on motor ENC_MOTOR in closed loop, otherwise from
+ * the back-EMF observer on motors having a current sensor, which needs the
+ * winding resistance and inductance and the bus voltage. It is fed by the
+ * ISR with the voltages written and the current samples. Other motors are
+ * not damped. The gain is the correction per velocity error, in ms, and
+ * depends on the load inertia; damping is off by default.
+ */
+#define DAMP_MAX_DEFAULT          90.0f // degrees
+#define DAMP_VMIN_DEFAULT         50.0f // electric tours per second
+#define VBUS_DEFAULT              12.0f // V
 
-    // setup GPIOs TIM2 (PA15, PB3, PB10, PB11)
+/*
+ * Step/dir output:
+ * TIM8 can be switched from H-bridge PWM to step/dir output following the
+ * ramp of motor STEP_MOTOR. CH1 (PC6) is the step output and CH2 (PC7) the
+ * dir output. The timer runs edge-aligned at full clock and each period is
+ * loaded by DMA from a ring of slots computed by the step generator, so that
+ * the step timing does not depend on the control cycle. Steps are delayed by
+ * STEP_LEAD_CYCLES.
+ */
+#define STEP_SLOT_COUNT           512
+#define STEP_LEAD_CYCLES          3
+#define STEP_PULSE_WIDTH_NS       1000
+#define STEP_MOTOR                5
 
-    GPIO_PinAFConfig(GPIOA, GPIO_PinSource15, GPIO_AF_TIM2);
-    GPIO_PinAFConfig(GPIOB, GPIO_PinSource3,  GPIO_AF_TIM2);
-    GPIO_PinAFConfig(GPIOB, GPIO_PinSource10, GPIO_AF_TIM2);
-    GPIO_PinAFConfig(GPIOB, GPIO_PinSource11, GPIO_AF_TIM2);
+/*
+ * Commutation pipeline:
+ * Control cycles are computed ahead by PendSV, at the lowest priority, into a
+ * ring of RC_AHEAD_COUNT frames. The TIM1 ISR only pops one frame, writes its
+ * duties and pends PendSV to refill the ring. The ring is single producer,
+ * single consumer, so indexes need no lock.
+ * When the ring is empty, the ISR computes the cycle in-line. It cannot if
+ * PendSV is in the middle of a frame, as ramps are being advanced: the last
+ * frame is then output again for one cycle, so that the current regulators
+ * still run, and the next frame computed advances the ramps by that cycle
+ * too, so that the trajectory time is kept. Both cases are counted as
+ * underruns.
+ */
+#define RC_AHEAD_COUNT            4 // power of 2
+#define RC_PENDSV_PRIORITY        15 // lowest
+
+
+struct motor {
+    int port;       // first of the 4 ports
+    bool enabled;
+    bool lim_en;
+    float lim_min;
+    float lim_max;
+    struct ramp ramp;
+
+    uint32_t cyc_acc; // cycles spent for this motor since last load update
+    uint32_t cyc;     // average cycles per control cycle
+
+    // phase advance
+    float adv_lead;   // L/R time constant in us, 0 disables phase advance
+    float adv_max;    // max phase advance in degrees
+    int adv_step;     // velocity per table step in increments per cycle, 0 if disabled
+    uint32_t adv_tab[ADV_TAB_SIZE + 1]; // a full electric tour being 2^32
+
+    bool cal_en;      // use the calibration table instead of sin/cos
+
+    // amplitude law
+    float amp_hold;   // amplitude at standstill
+    float amp_run;    // amplitude while moving
+    float amp_emf;    // additional amplitude per electric tour per second
+    int amp_hold_q;   // Q15
+    int amp_run_q;    // Q15
+    int64_t amp_emf_q; // Q15 per increment per cycle, in 1/65536
+
+    // waveform switching
+    float wave_half;  // speed in electric tours/s for half-step, 0 to disable
+    float wave_full;  // speed in electric tours/s for full-step, 0 to disable
+    int wave_half_v[2]; // thresholds to leave and enter, in increments per cycle
+    int wave_full_v[2];
+    int wave;         // current waveform, WAVE_xxx
+    uint32_t wave_alpha; // angle of the previous cycle
+
+    float i[2];       // phase currents in A, updated when read
+
+    // current control
+    bool cur_en;      // current mode
+    float cur_set;    // current in A at full amplitude
+    float cur_kp;     // full scale voltage per A of error
+    float cur_ki;     // full scale voltage per A of error per ms
+    int cur_scale;    // ADC counts at full amplitude
+    struct pi pi[2];  // phase a and b regulators, in Q15 voltage
+
+    // anti-resonance damping
+    float damp_gain;  // correction per velocity error in ms, 0 to disable
+    float damp_max;   // max correction in degrees
+    float damp_vmin;  // speed in electric tours/s below which the damper is idle
+    float damp_r;     // winding resistance in ohms, for the back-EMF observer
+    float damp_l;     // winding inductance in mH, for the back-EMF observer
+    bool damp_emf;    // damped from the back-EMF observer, fed by the ISR
+    struct damp damp;
 
-    pgio_def.GPIO_Pin = GPIO_Pin_15;
-    GPIO_Init(GPIOA, &pgio_def);
-    pgio_def.GPIO_Pin = GPIO_Pin_3 | GPIO_Pin_10 | GPIO_Pin_11;
-    GPIO_Init(GPIOB, &pgio_def);
+    uint16_t dither[2]; // duty residual of phases a and b, in 1/65536 count
+};
+
+struct rc_frame {
+    int16_t v[MOTOR_COUNT][2];     // voltage of phases a and b in Q15
+    uint32_t mask;                 // motors computed in this frame
+    int rate_shift;                // 2^rate_shift cycles until the next frame
+
+    // ENC_MOTOR in closed loop, commutated by the ISR
+    bool enc;                      // v[ENC_MOTOR] is computed from the following fields when output
+    traj_pos_t enc_x;              // commanded position
+    int enc_v;                     // velocity in increments per cycle
+    int enc_amp;                   // amplitude in Q15
+};
 
-    // setup GPIOs TIM3 (PA6, PA7, PB0, PB1)
 
-    GPIO_PinAFConfig(GPIOA, GPIO_PinSource6,  GPIO_AF_TIM3);
-    GPIO_PinAFConfig(GPIOA, GPIO_PinSource7,  GPIO_AF_TIM3);
-    GPIO_PinAFConfig(GPIOB, GPIO_PinSource0,  GPIO_AF_TIM3);
-    GPIO_PinAFConfig(GPIOB, GPIO_PinSource1,  GPIO_AF_TIM3);
+static int c;
+static int rc_cycle_div;       // PWM update events per cycle
+static float rc_cycle_time;    // seconds per cycle
+static float rc_cycle_freq;
+static struct motor motors[MOTOR_COUNT] = {
+    { .port = 0, .enabled = true },
+    { .port = 4 },
+    { .port = 8 },
+    { .port = 12 },
+    { .port = 16 },
+    { .port = 20 },
+};
+static struct cal_table cal_tables[MOTOR_COUNT];
+static int plan_shift = 1;
+static int plan_interp = RAMP_INTERP_LINEAR;
+static bool dma_en = true;
 
-    pgio_def.GPIO_Pin = GPIO_Pin_6 | GPIO_Pin_7;
-    GPIO_Init(GPIOA, &pgio_def);
-    pgio_def.GPIO_Pin = GPIO_Pin_0 | GPIO_Pin_1;
-    GPIO_Init(GPIOB, &pgio_def);
+// commutation pipeline
+static struct rc_frame ahead_ring[RC_AHEAD_COUNT];
+static volatile int ahead_rd;
+static volatile int ahead_wr;
+static volatile bool ahead_busy; // PendSV is computing a frame
+static int ahead_underruns;
+static struct rc_frame *ahead_last; // last frame output
+static volatile uint32_t ahead_repeats;   // cycles the last frame was output again
+static uint32_t ahead_repeats_done;       // of them, cycles already advanced by the ramps
 
-    // setup GPIOs TIM4 (PD12, PD13, PD14, PD15)
+// adaptive control rate
+static bool rate_adapt = true;
+static int rate_samples = 256; // min samples per electric tour
+static int rate_shift;         // of the interval before the next frame to compute
 
-    GPIO_PinAFConfig(GPIOD, GPIO_PinSource12, GPIO_AF_TIM4);
-    GPIO_PinAFConfig(GPIOD, GPIO_PinSource13, GPIO_AF_TIM4);
-    GPIO_PinAFConfig(GPIOD, GPIO_PinSource14, GPIO_AF_TIM4);
-    GPIO_PinAFConfig(GPIOD, GPIO_PinSource15, GPIO_AF_TIM4);
+// duty dithering
+static bool dither_en;
 
-    pgio_def.GPIO_Pin = GPIO_Pin_12 | GPIO_Pin_13 | GPIO_Pin_14 | GPIO_Pin_15;
-    GPIO_Init(GPIOD, &pgio_def);
-
-    // setup GPIOs TIM5 (PA0, PA1, PA2, PA3)
-
-    GPIO_PinAFConfig(GPIOA, GPIO_PinSource0,  GPIO_AF_TIM5);
-    GPIO_PinAFConfig(GPIOA, GPIO_PinSource1,  GPIO_AF_TIM5);
-    GPIO_PinAFConfig(GPIOA, GPIO_PinSource2,  GPIO_AF_TIM5);
-    GPIO_PinAFConfig(GPIOA, GPIO_PinSource3,  GPIO_AF_TIM5);
-
-    pgio_def.GPIO_Pin = GPIO_Pin_0 | GPIO_Pin_1 | GPIO_Pin_2 | GPIO_Pin_3;
-    GPIO_Init(GPIOA, &pgio_def);
-
-    // setup GPIOs TIM8 (PC6, PC7, PC8, PC9)
-
-    GPIO_PinAFConfig(GPIOC, GPIO_PinSource6, GPIO_AF_TIM8);
-    GPIO_PinAFConfig(GPIOC, GPIO_PinSource7, GPIO_AF_TIM8);
-    GPIO_PinAFConfig(GPIOC, GPIO_PinSource8, GPIO_AF_TIM8);
-    GPIO_PinAFConfig(GPIOC, GPIO_PinSource9, GPIO_AF_TIM8);
+// packed duty computation, see dsp.h
+static bool dsp_en;
+
+// closed loop
+static struct cloop cloop;
+static bool enc_en;
+static float enc_cpt = ENC_CPT_DEFAULT; // encoder counts per electric tour
+static float enc_lead = 90.0f;          // max load angle in degrees
+static float enc_thr = 90.0f;           // step-loss threshold in degrees
+static float enc_gain;                  // amplitude added at enc_lead
+
+// current sensing
+static float isense_gain = 3.3f / 4096.0f / 0.4f; // A per count, 400 mV/A sensors
+static int isense_zero = ISENSE_ZERO;
+static float vbus = VBUS_DEFAULT; // H-bridge supply, for the back-EMF observer
+
+// waveform switching
+static float wave_hyst = 0.1f; // fraction of the switching speeds
+static bool wave_boost;        // diagonal steps with both phases fully on
+static const int16_t wave_tab[2][8][2] = { // sin and cos every 45 degrees, in Q15
+    {
+        { 0, SINLUT_ONE }, { WAVE_DIAG, WAVE_DIAG }, { SINLUT_ONE, 0 }, { WAVE_DIAG, -WAVE_DIAG },
+        { 0, -SINLUT_ONE }, { -WAVE_DIAG, -WAVE_DIAG }, { -SINLUT_ONE, 0 }, { -WAVE_DIAG, WAVE_DIAG },
+    }, {
+        { 0, SINLUT_ONE }, { SINLUT_ONE, SINLUT_ONE }, { SINLUT_ONE, 0 }, { SINLUT_ONE, -SINLUT_ONE },
+        { 0, -SINLUT_ONE }, { -SINLUT_ONE, -SINLUT_ONE }, { -SINLUT_ONE, 0 }, { -SINLUT_ONE, SINLUT_ONE },
+    },
+};
 
-    pgio_def.GPIO_Pin = GPIO_Pin_6 | GPIO_Pin_7 | GPIO_Pin_8 | GPIO_Pin_9;
-    GPIO_Init(GPIOC, &pgio_def);
+// step/dir output
+static struct stepgen_slot step_slots[STEP_SLOT_COUNT];
+static struct stepgen stepgen;
+static bool step_en;
+static bool step_running;
+static int step_res = 256; // steps per electric tour
+static int step_underruns;
+
+// ISR load measurement
+static volatile uint32_t load_cycles; // cycles spent in the ISR since last update
+static volatile uint32_t load_calls;  // ISR calls since last update
+static volatile uint32_t load_cycle_calls; // control cycles since last update
+static float load;                    // ISR CPU load in percent
+static uint32_t cyc_avg;              // average cycles per ISR call
+static uint32_t cyc_max;              // max cycles per ISR call
+static uint32_t irq_rate;             // ISR calls per second
+static volatile uint32_t pend_cycles; // cycles spent in PendSV since last update, ISR excluded
+static volatile bool pend_running;
+static float pend_load;               // PendSV CPU load in percent
+static float load_avg;                // ISR + PendSV CPU load in percent
+
+
+static int _step_pulse_ticks(void)
+{
+    return (int)((int64_t)pwm_tim_clock() * STEP_PULSE_WIDTH_NS / 1000000000);
 }
 
-static void _irq_init(TIM_TypeDef *tim)
+static void _step_start(void)
 {
-    NVIC_InitTypeDef NVIC_InitStructure;
-    NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = 0;
-    NVIC_InitStructure.NVIC_IRQChannelSubPriority = 0;
-    NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
-    if (tim == TIM1) {
-        NVIC_InitStructure.NVIC_IRQChannel = TIM1_UP_TIM10_IRQn;
-        NVIC_Init(&NVIC_InitStructure);
-    }
-    if (tim == TIM8) {
-        NVIC_InitStructure.NVIC_IRQChannel = TIM8_UP_TIM13_IRQn;
-        NVIC_Init(&NVIC_InitStructure);
-    }
+    int cycle_ticks = pwm_cycle_ticks();
+    int pulse_ticks = _step_pulse_ticks();
 
-    TIM_ITConfig(tim, TIM_IT_Update, ENABLE);
+    stepgen_init(&stepgen, step_slots, STEP_SLOT_COUNT, cycle_ticks, pulse_ticks,
+                 RAMP_POS_SCALE / step_res, motors[STEP_MOTOR].ramp.x);
+    stepgen_prefill(&stepgen, STEP_LEAD_CYCLES * cycle_ticks);
+    pwm_step_start(step_slots, STEP_SLOT_COUNT);
 }
 
-static void _tim_init(TIM_TypeDef *tim)
+static void _step_cycle(int n)
 {
-    TIM_TimeBaseInitTypeDef TIM_TimeBaseStructure = {0};
-    RCC_ClocksTypeDef RCC_ClocksFreq;
-    int base_clock = 0;
-    int tim_index = -1;
+    stepgen_cycle(&stepgen, motors[STEP_MOTOR].ramp.x, n);
 
-    // enable and configure clock
-    RCC_GetClocksFreq(&RCC_ClocksFreq);
-    if (tim == TIM1) {
-        tim_index = 1;
-        RCC_APB2PeriphClockCmd(RCC_APB2Periph_TIM1, ENABLE);
-        base_clock = (int)RCC_ClocksFreq.PCLK2_Frequency;
-    }
-    if (tim == TIM2) {
-        tim_index = 2;
-        RCC_APB1PeriphClockCmd(RCC_APB1Periph_TIM2, ENABLE);
-        base_clock = (int)RCC_ClocksFreq.PCLK1_Frequency;
-    }
-    if (tim == TIM3) {
-        tim_index = 3;
-        RCC_APB1PeriphClockCmd(RCC_APB1Periph_TIM3, ENABLE);
-        base_clock = (int)RCC_ClocksFreq.PCLK1_Frequency;
-    }
-    if (tim == TIM4) {
-        tim_index = 4;
-        RCC_APB1PeriphClockCmd(RCC_APB1Periph_TIM4, ENABLE);
-        base_clock = (int)RCC_ClocksFreq.PCLK1_Frequency;
-    }
-    if (tim == TIM5) {
-        tim_index = 5;
-        RCC_APB1PeriphClockCmd(RCC_APB1Periph_TIM5, ENABLE);
-        base_clock = (int)RCC_ClocksFreq.PCLK1_Frequency;
-    }
-    if (tim == TIM8) {
-        tim_index = 8;
-        RCC_APB2PeriphClockCmd(RCC_APB2Periph_TIM8, ENABLE);
-        base_clock = (int)RCC_ClocksFreq.PCLK2_Frequency;
-    }
-    TIM_TimeBaseStructure.TIM_Period = RC_RANGE; // TIMx->ARR register
-    TIM_TimeBaseStructure.TIM_Prescaler = (base_clock / RC_PWM_COUNTER_FREQ) - 1;
-    TIM_TimeBaseStructure.TIM_CounterMode = TIM_CounterMode_CenterAligned2; // TIMx->CR1 register
-    TIM_TimeBaseStructure.TIM_RepetitionCounter = 0; // TIMx->RCR
-    TIM_TimeBaseInit(tim, &TIM_TimeBaseStructure);
-    printf("timer %d: base_clock=%d pwm_freq=%g range=%d\n",
-            tim_index, base_clock,
-            (double)base_clock / (TIM_TimeBaseStructure.TIM_Prescaler + 1) / 2 / RC_RANGE,
-            RC_RANGE);
+    int ahead = stepgen.wr - pwm_step_index();
+    if (ahead < 0)
+        ahead += STEP_SLOT_COUNT;
+    if (ahead < 2)
+        step_underruns++;
+}
 
-    // set output mode
-    TIM_OCInitTypeDef TIM_OCInitStructure = {
-        .TIM_OCMode = TIM_OCMode_PWM1,
-        .TIM_OutputState = TIM_OutputState_Enable,
-        .TIM_OutputNState = TIM_OutputNState_Disable,
-        .TIM_OCPolarity = TIM_OCPolarity_High,
-        .TIM_OCNPolarity = TIM_OCNPolarity_High,
-        .TIM_OCIdleState = TIM_OCIdleState_Reset,
-    };
-    TIM_OC1Init(tim, &TIM_OCInitStructure);
-    TIM_OC2Init(tim, &TIM_OCInitStructure);
-    TIM_OC3Init(tim, &TIM_OCInitStructure);
-    TIM_OC4Init(tim, &TIM_OCInitStructure);
+/**
+ * Drive the 4 ports of a motor starting at the given port, a and b being
+ * the voltages of both phases in Q15. Ports are ordered as a, -a, b, -b.
+ * The duty of a negated port is the complement of the positive one.
+ */
+static inline void _motor_duty(int port, int da, int db)
+{
+    volatile uint32_t **regs = pwm_regs + port;
+    *regs[0] = da;
+    *regs[1] = (pwm_range - 1) - da;
+    *regs[2] = db;
+    *regs[3] = (pwm_range - 1) - db;
+}
 
-    // enable outputs (do TIMx->BDTR |= TIM_BDTR_MOE)
-    TIM_CtrlPWMOutputs(tim, ENABLE);
+static inline void _motor_pwm(int port, int a, int b)
+{
+    _motor_duty(port, duty_get(a, pwm_range - 1), duty_get(b, pwm_range - 1));
+}
 
-    // set preload mode (working with shadow registers, see CCMR1)
-    TIM_OC1PreloadConfig(tim, TIM_OCPreload_Enable);
-    TIM_OC2PreloadConfig(tim, TIM_OCPreload_Enable);
-    TIM_OC3PreloadConfig(tim, TIM_OCPreload_Enable);
-    TIM_OC4PreloadConfig(tim, TIM_OCPreload_Enable);
+/**
+ * Drive the 4 ports of a motor low, so that both windings are unpowered.
+ * This cannot be done with _motor_duty(), which complements the negated
+ * ports.
+ */
+static void _motor_off(int port)
+{
+    for (int i = 0; i < 4; i++)
+        pwm_set(port + i, 0);
+}
 
-    // set counter starting value
-    tim->CNT = 0;
+/**
+ * Same as _motor_pwm() with both voltages packed, see dsp.h.
+ */
+static inline void _motor_pwm_packed(int port, uint32_t ab)
+{
+    volatile uint32_t **regs = pwm_regs + port;
+    uint32_t d = dsp_duty(ab, pwm_range - 1);
+    uint32_t n = dsp_complement(d, pwm_range - 1);
+    *regs[0] = d & 0xffff;
+    *regs[1] = n & 0xffff;
+    *regs[2] = d >> 16;
+    *regs[3] = n >> 16;
 }
 
-static void _tim_start(TIM_TypeDef *tim)
+/**
+ * Mask both the control ISR and the PendSV producer.
+ */
+static void _lock(void)
 {
-    TIM_Cmd(tim, ENABLE);
+    NVIC_DisableIRQ(TIM1_UP_TIM10_IRQn);
+    __set_BASEPRI(RC_PENDSV_PRIORITY << (8 - __NVIC_PRIO_BITS));
 }
 
-static volatile uint32_t *_tim_reg(int port)
+static void _unlock(void)
 {
-    TIM_TypeDef *tims[] = {TIM1, TIM2, TIM3, TIM4, TIM5, TIM8};
-    TIM_TypeDef *tim = tims[port / 4];
-    return &tim->CCR1 + (port % 4);
+    __set_BASEPRI(0);
+    NVIC_EnableIRQ(TIM1_UP_TIM10_IRQn);
 }
 
 static void _esc_handler(void)
@@ -241,54 +443,534 @@ static inline float shape(float x)
     return 0;
 }
 
+static void _adv_update(struct motor *m)
+{
+    const float two_pi = 2.0f * (float)M_PI;
+    float tau = m->adv_lead * 1e-6f;
+    float max = fminf(m->adv_max, 89.0f) * (two_pi / 360.0f);
+
+    if (tau <= 0.0f || max <= 0.0f) {
+        m->adv_step = 0;
+        return;
+    }
+
+    // speed at which the advance saturates, in increments per cycle
+    float inc = (float)RAMP_POS_SCALE * rc_cycle_time; // 1 tour/s
+    float v_sat = tanf(max) / (two_pi * tau) * inc;
+    int step = (int)ceilf(v_sat / ADV_TAB_SIZE);
+    if (step < 1)
+        step = 1;
+
+    for (int i = 0; i <= ADV_TAB_SIZE; i++) {
+        float v = (float)(i * step) / inc;
+        float a = fminf(atanf(two_pi * v * tau), max);
+        m->adv_tab[i] = (uint32_t)(a / two_pi * 4294967296.0f);
+    }
+    m->adv_step = step;
+}
+
+/**
+ * Return the phase advance for the velocity v in increments per cycle.
+ */
+static inline uint32_t _adv(const struct motor *m, int v)
+{
+    int u = v < 0 ? -v : v;
+    int i = u / m->adv_step;
+    uint32_t a;
+
+    if (i >= ADV_TAB_SIZE) {
+        a = m->adv_tab[ADV_TAB_SIZE];
+    } else {
+        int f = u - i * m->adv_step;
+        int32_t d = (int32_t)(m->adv_tab[i + 1] - m->adv_tab[i]);
+        a = m->adv_tab[i] + (uint32_t)((int64_t)d * f / m->adv_step);
+    }
+    return v < 0 ? -a : a;
+}
+
+static void _amp_update(struct motor *m)
+{
+    float inc = (float)RAMP_POS_SCALE * rc_cycle_time; // 1 tour/s
+    m->amp_hold_q = (int)lroundf(fminf(fmaxf(m->amp_hold, 0.0f), 1.0f) * SINLUT_ONE);
+    m->amp_run_q = (int)lroundf(fminf(fmaxf(m->amp_run, 0.0f), 1.0f) * SINLUT_ONE);
+    m->amp_emf_q = llroundf(fmaxf(m->amp_emf, 0.0f) * SINLUT_ONE / inc * 65536.0f);
+}
+
+/**
+ * Return the amplitude in Q15 for the velocity v in increments per cycle.
+ */
+static inline int _amp(const struct motor *m, int v)
+{
+    if (v == 0)
+        return m->amp_hold_q;
+
+    int u = v < 0 ? -v : v;
+    int64_t a = m->amp_run_q + (((int64_t)u * m->amp_emf_q) >> 16);
+    return a > SINLUT_ONE ? SINLUT_ONE : (int)a;
+}
+
+static void _wave_update(struct motor *m)
+{
+    float inc = (float)RAMP_POS_SCALE * rc_cycle_time; // 1 tour/s
+    float low = 1.0f - fminf(fmaxf(wave_hyst, 0.0f), 1.0f);
+    float half = fmaxf(m->wave_half, 0.0f) * inc;
+    float full = fmaxf(m->wave_full, 0.0f) * inc;
+    m->wave_half_v[0] = (int)lroundf(fminf(half * low, (float)INT32_MAX / 2));
+    m->wave_half_v[1] = (int)lroundf(fminf(half, (float)INT32_MAX / 2));
+    m->wave_full_v[0] = (int)lroundf(fminf(full * low, (float)INT32_MAX / 2));
+    m->wave_full_v[1] = (int)lroundf(fminf(full, (float)INT32_MAX / 2));
+}
+
+/**
+ * Pick the waveform for the velocity v in increments per cycle and switch
+ * to it if alpha crossed a point of the coarser step grid since the
+ * previous cycle. Half-step points are every 45 degrees, full-step points
+ * every 90 degrees from 45 degrees.
+ */
+static inline void _wave_select(struct motor *m, int v, uint32_t alpha)
+{
+    int u = v < 0 ? -v : v;
+    int w = WAVE_MICRO;
+    if (m->wave_full_v[1] && u > m->wave_full_v[m->wave != WAVE_FULL])
+        w = WAVE_FULL;
+    else if (m->wave_half_v[1] && u > m->wave_half_v[m->wave == WAVE_MICRO])
+        w = WAVE_HALF;
+
+    if (w != m->wave) {
+        bool full = w == WAVE_FULL || m->wave == WAVE_FULL;
+        int shift = full ? 30 : 29;
+        uint32_t offset = full ? 0x20000000 : 0;
+        if ((m->wave_alpha - offset) >> shift != (alpha - offset) >> shift)
+            m->wave = w;
+    }
+    m->wave_alpha = alpha;
+}
+
+static void _enc_update(void)
+{
+    float deg = (float)RAMP_POS_SCALE / 360.0f;
+    float cpt = fabsf(enc_cpt) < 1.0f ? 1.0f : enc_cpt;
+    cloop.scale = llroundf((float)RAMP_POS_SCALE / cpt * 65536.0f);
+    cloop.lead_max = (traj_pos_t)lroundf(fminf(fmaxf(enc_lead, 0.0f), 180.0f) * deg);
+    cloop.loss_thr = (traj_pos_t)lroundf(fminf(fmaxf(enc_thr, 0.0f), 360.0f) * deg);
+    cloop.gain = (int)lroundf(fminf(fmaxf(enc_gain, 0.0f), 1.0f) * SINLUT_ONE);
+}
+
+static void _cur_update(struct motor *m)
+{
+    float q = isense_gain * SINLUT_ONE * (1 << PI_SHIFT); // per A, scaled
+    m->cur_scale = (int)lroundf(fminf(fmaxf(m->cur_set, 0.0f) / isense_gain, 32767.0f));
+    for (int p = 0; p < 2; p++) {
+        m->pi[p].kp = (int32_t)lroundf(fminf(fmaxf(m->cur_kp, 0.0f) * q, (float)INT32_MAX / 2));
+        m->pi[p].ki = (int32_t)lroundf(fminf(fmaxf(m->cur_ki, 0.0f) * 1000.0f * rc_cycle_time * q,
+                                             (float)INT32_MAX / 2));
+    }
+}
+
+/**
+ * Pick the source of the following error and scale the damper parameters.
+ */
+static void _damp_update(struct motor *m)
+{
+    float q = isense_gain / fmaxf(vbus, 1.0f) * SINLUT_ONE; // Q15 voltage per ohm per count
+    bool enc = m == motors + ENC_MOTOR && enc_en;
+    bool sense = (int)(m - motors) * 2 + 1 < ISENSE_COUNT && !pwm_edge;
+    float gain = fminf(fmaxf(m->damp_gain, 0.0f) * 1e-3f / rc_cycle_time, 30000.0f); // cycles
+
+    m->damp.gain = enc || sense ? (int32_t)lroundf(gain * 65536.0f) : 0;
+    m->damp.max = (traj_pos_t)lroundf(fminf(fmaxf(m->damp_max, 0.0f), 180.0f) / 360.0f * RAMP_POS_SCALE);
+    m->damp.v_min = (int32_t)lroundf(fminf(fmaxf(m->damp_vmin, 0.0f) * RAMP_POS_SCALE * rc_cycle_time,
+                                           (float)INT32_MAX / 2));
+    m->damp.lp_shift = enc ? 0 : DAMP_EMF_LP_SHIFT;
+    m->damp.r = fmaxf(m->damp_r, 0.0f) * q;
+    m->damp.l = fmaxf(m->damp_l, 0.0f) * 1e-3f / rc_cycle_time * q;
+    m->damp_emf = !enc && m->damp.gain;
+}
+
+static void _motor_enable(struct motor *m, bool enable)
+{
+    if (enable) {
+        _lock();
+        ramp_start(&m->ramp);
+        pi_reset(&m->pi[0]);
+        pi_reset(&m->pi[1]);
+        damp_reset(&m->damp);
+        m->wave = WAVE_MICRO;
+        m->enabled = true;
+        _unlock();
+    } else {
+        m->enabled = false;
+        if (!(m == motors + STEP_MOTOR && step_running))
+            _motor_off(m->port);
+    }
+}
+
+/**
+ * Return the update events per control cycle for the given PWM range and
+ * mode.
+ */
+static int _rate_div(int range, bool edge)
+{
+    return pwm_get_cycle_div(range, edge, RC_CYCLE_FREQ, RC_CYCLE_DIV_MAX);
+}
+
+/**
+ * Derive the control cycle from a PWM configuration.
+ */
+static void _rate_config(int freq, bool edge)
+{
+    int range = pwm_get_range(freq, edge);
+    int div = _rate_div(range, edge);
+
+    rc_cycle_div = div;
+    rc_cycle_time = pwm_get_cycle_time(range, div);
+    rc_cycle_freq = 1.0f / rc_cycle_time;
+}
+
+/**
+ * Reprogram the PWM and rescale everything depending on the cycle time.
+ */
+static void _pwm_config(int freq, bool edge)
+{
+    if (step_en) {
+        printf("disable step mode first\n");
+        return;
+    }
+    int range = pwm_get_range(freq, edge);
+    if (!range) {
+        printf("bad frequency\n");
+        return;
+    }
+    if (!stepgen_fits(pwm_get_ticks(range, _rate_div(range, edge), pwm_tim_clock()), _step_pulse_ticks())) {
+        printf("frequency too low for step mode\n");
+        return;
+    }
+    if (!pwm_check_stagger(pwm_stagger, edge)) {
+        printf("reduce the stagger first\n");
+        return;
+    }
+    for (int i = 0; i < MOTOR_COUNT && edge; i++) {
+        if (motors[i].cur_en) {
+            printf("disable current mode first\n");
+            return;
+        }
+    }
+
+    _lock();
+    _rate_config(freq, edge);
+    pwm_configure(freq, edge, rc_cycle_div);
+    for (int i = 0; i < MOTOR_COUNT; i++) {
+        ramp_set_cycle_time(&motors[i].ramp, rc_cycle_time);
+        _adv_update(&motors[i]);
+        _amp_update(&motors[i]);
+        _wave_update(&motors[i]);
+        _cur_update(&motors[i]);
+        _damp_update(&motors[i]);
+    }
+    _unlock();
+}
+
 static void _init(void)
 {
-    ramp_init(&ramp);
+    _rate_config(PWM_FREQ, false);
+
+    for (int i = 0; i < MOTOR_COUNT; i++) {
+        ramp_init(&motors[i].ramp, rc_cycle_time);
+        ramp_set_plan(&motors[i].ramp, plan_shift, plan_interp);
+        motors[i].adv_max = ADV_MAX_DEFAULT;
+        _adv_update(&motors[i]);
+        cal_init_sine(&cal_tables[i]);
+        motors[i].amp_hold = 1.0f;
+        motors[i].amp_run = 1.0f;
+        _amp_update(&motors[i]);
+        _wave_update(&motors[i]);
+        motors[i].cur_set = 1.0f;
+        motors[i].cur_kp = 0.1f;
+        motors[i].cur_ki = 0.1f;
+        pi_init(&motors[i].pi[0], -SINLUT_ONE, SINLUT_ONE);
+        pi_init(&motors[i].pi[1], -SINLUT_ONE, SINLUT_ONE);
+        _cur_update(&motors[i]);
+        damp_init(&motors[i].damp);
+        motors[i].damp_max = DAMP_MAX_DEFAULT;
+        motors[i].damp_vmin = DAMP_VMIN_DEFAULT;
+        _damp_update(&motors[i]);
+    }
+    cloop_init(&cloop);
+    _enc_update();
+
+    if (cal_load(cal_tables, MOTOR_COUNT) == 0)
+        printf("calibration tables loaded\n");
 
     cli_add_esc_handler(_esc_handler);
 
-    _gpio_init();
+    pwm_init(PWM_FREQ, false, rc_cycle_div);
+    isense_init();
+    pwm_set_dma(dma_en);
 
-    // setup timers
-    _tim_init(TIM1);
-    _tim_init(TIM2);
-    _tim_init(TIM3);
-    _tim_init(TIM4);
-    _tim_init(TIM5);
-    _tim_init(TIM8);
+    for (int i = 0; i < MOTOR_COUNT; i++)
+        _motor_enable(&motors[i], motors[i].enabled);
 
-    // setup interrupt
-    _irq_init(TIM1);
+    // fill the ring before the first control cycle
+    NVIC_SetPriority(PendSV_IRQn, RC_PENDSV_PRIORITY);
+    SCB->ICSR = SCB_ICSR_PENDSVSET_Msk;
 
-    // start all
-    _tim_start(TIM1);
-    _tim_start(TIM2);
-    _tim_start(TIM3);
-    _tim_start(TIM4);
-    _tim_start(TIM5);
-    _tim_start(TIM8);
+    pwm_start();
 }
 
 static void _loop(void)
 {
+    static int t;
+
+    int now = tick;
+    int d = gmu_sub_s32(now, t);
+    if (d < 1000)
+        return;
+    t = now;
+
+    _lock();
+    uint32_t cycles = load_cycles;
+    uint32_t pcycles = pend_cycles;
+    uint32_t calls = load_calls;
+    uint32_t cycle_calls = load_cycle_calls;
+    uint32_t motor_cycles[MOTOR_COUNT];
+    for (int i = 0; i < MOTOR_COUNT; i++) {
+        motor_cycles[i] = motors[i].cyc_acc;
+        motors[i].cyc_acc = 0;
+    }
+    load_cycles = 0;
+    load_calls = 0;
+    load_cycle_calls = 0;
+    pend_cycles = 0;
+    _unlock();
+
+    load = 100.0f * (float)cycles / ((float)SystemCoreClock * (float)d / 1000.0f);
+    pend_load = 100.0f * (float)pcycles / ((float)SystemCoreClock * (float)d / 1000.0f);
+    load_avg = load + pend_load;
+    cyc_avg = calls ? cycles / calls : 0;
+    irq_rate = (uint32_t)((uint64_t)calls * 1000 / (uint32_t)d);
+    for (int i = 0; i < MOTOR_COUNT; i++)
+        motors[i].cyc = cycle_calls ? motor_cycles[i] / cycle_calls : 0;
 }
 
-// run at 10kHz
-static void _cycle(void)
+/**
+ * Compute the voltages of a motor for the commutation angle alpha, the
+ * following error err of the damper, the velocity v and the amplitude amp,
+ * n cycles after the previous call.
+ */
+static void _motor_commutate(struct motor *m, uint32_t alpha, traj_pos_t err, int v, int amp, int n, int16_t *out)
 {
-    static bool started = false;
-    if (!started) {
-        started = true;
-        ramp_start(&ramp);
+    if (m->damp.gain)
+        alpha += (uint32_t)damp_cycle(&m->damp, err, v, n) << (32 - RAMP_POS_SHIFT);
+    if (m->adv_step)
+        alpha += _adv(m, v);
+    _wave_select(m, v, alpha);
+    if (dsp_en) {
+        uint32_t ab;
+        if (m->wave != WAVE_MICRO) {
+            int k = m->wave == WAVE_FULL ? (int)(alpha >> 30) * 2 + 1 : (int)((alpha + 0x10000000) >> 29);
+            ab = dsp_pack(wave_tab[wave_boost][k][0], wave_tab[wave_boost][k][1]);
+        } else if (m->cal_en) {
+            ab = dsp_cal_lookup(&cal_tables[m - motors], alpha);
+        } else {
+            ab = dsp_sincos(alpha);
+        }
+        ab = dsp_scale(ab, amp);
+        memcpy(out, &ab, sizeof(ab));
+        return;
+    }
+    int a, b;
+    if (m->wave != WAVE_MICRO) {
+        int k = m->wave == WAVE_FULL ? (int)(alpha >> 30) * 2 + 1 : (int)((alpha + 0x10000000) >> 29);
+        a = wave_tab[wave_boost][k][0];
+        b = wave_tab[wave_boost][k][1];
+    } else if (m->cal_en) {
+        cal_lookup(&cal_tables[m - motors], alpha, &a, &b);
+    } else {
+        a = sinlut_sin(alpha);
+        b = sinlut_cos(alpha);
     }
+    out[0] = (int16_t)((a * amp) >> 15);
+    out[1] = (int16_t)((b * amp) >> 15);
+}
 
-    float alpha = ramp_cycle(&ramp);
-    float a = sinf(alpha);
-    float b = cosf(alpha);
-    stepper_pwm(0, a);
-    stepper_pwm(1, -a);
-    stepper_pwm(2, b);
-    stepper_pwm(3, -b);
+/**
+ * Advance a motor by n cycles and compute its voltages into the frame f.
+ */
+static void _motor_cycle(struct motor *m, int n, struct rc_frame *f)
+{
+    uint32_t alpha = ramp_cycle(&m->ramp, n);
+    int v = m->ramp.v;
+    int amp = _amp(m, v);
+    if (m == motors + ENC_MOTOR && enc_en) {
+        // the encoder is read by the ISR, when the frame is output
+        f->enc = true;
+        f->enc_x = m->ramp.x;
+        f->enc_v = v;
+        f->enc_amp = amp;
+        return;
+    }
+    traj_pos_t err = m->damp_emf ? damp_emf_err(&m->damp, m->ramp.x) : 0;
+    _motor_commutate(m, alpha, err, v, amp, n, f->v[m - motors]);
+}
+
+/**
+ * Compute the voltages of ENC_MOTOR in closed loop, from its commanded
+ * position in the frame f and the encoder count read now, in the ISR.
+ */
+static void _enc_commutate(struct rc_frame *f)
+{
+    struct motor *m = motors + ENC_MOTOR;
+    traj_pos_t x = f->enc_x;
+    int amp = f->enc_amp;
+    if (enc_en)
+        x = cloop_cycle(&cloop, pwm_enc_count(), x, &amp);
+    _motor_commutate(m, (uint32_t)x << (32 - RAMP_POS_SHIFT), enc_en ? cloop.err : 0,
+                     f->enc_v, amp, 1 << f->rate_shift, f->v[ENC_MOTOR]);
+}
+
+/**
+ * Compute one control cycle, in PendSV or in-line on underrun.
+ */
+static void _cycle_compute(struct rc_frame *f)
+{
+    uint32_t repeats = ahead_repeats;
+    int n = (1 << rate_shift) + (int)(repeats - ahead_repeats_done);
+    ahead_repeats_done = repeats;
+    int64_t s_max = 0; // samples per cycle of the fastest motor, in 1/RAMP_POS_SCALE
+    bool cur = false;  // a motor is in current mode
+
+    f->mask = 0;
+    f->enc = false;
+    for (int i = 0; i < MOTOR_COUNT; i++) {
+        struct motor *m = motors + i;
+        uint32_t t0 = core_get_cycles();
+        if (i == STEP_MOTOR && step_running) {
+            // the step generator must be fed even if the motor is disabled
+            if (m->enabled)
+                ramp_cycle(&m->ramp, n);
+            _step_cycle(n);
+        } else if (m->enabled) {
+            _motor_cycle(m, n, f);
+            f->mask |= 1u << i;
+        }
+        if (m->enabled) {
+            int v = m->ramp.v < 0 ? -m->ramp.v : m->ramp.v;
+            int samples = m->wave == WAVE_MICRO ? rate_samples :
+                          WAVE_STEP_SAMPLES * (m->wave == WAVE_FULL ? 4 : 8);
+            int64_t s = (int64_t)v * samples;
+            if (s > s_max)
+                s_max = s;
+            cur |= m->cur_en;
+        }
+        m->cyc_acc += core_get_cycles() - t0;
+    }
+    load_cycle_calls += (uint32_t)n; // a frame covers n cycles
+
+    /*
+     * Pick the next interval. The step generator ring is sized for the max
+     * rate, so step mode does not adapt. Neither do the current regulators
+     * and the closed loop, which run in the ISR.
+     */
+    int r = 0;
+    if (rate_adapt && !step_running && !cur && !f->enc) {
+        r = RC_RATE_SHIFT_MAX;
+        while (r > 0 && (s_max << r) > RAMP_POS_SCALE)
+            r--;
+    }
+    f->rate_shift = r;
+    rate_shift = r;
+}
+
+/**
+ * Feed the back-EMF observer of a motor with the voltages written now, for
+ * n cycles, and the last current sample.
+ */
+static inline void _damp_observe(struct motor *m, const volatile struct isense_scan *scan, int a, int b, int n)
+{
+    int i = (int)(m - motors);
+    damp_observe(&m->damp, scan->raw[i * 2] - isense_zero, scan->raw[i * 2 + 1] - isense_zero, a, b, n);
+}
+
+/**
+ * Write the duties of a frame, converted with the current PWM range. Motors
+ * disabled since the frame was computed are skipped. Motors in current mode
+ * get the output of their regulators instead of the frame voltages. The
+ * voltages written feed the back-EMF observers of the damped motors.
+ * ENC_MOTOR in closed loop is commutated first, from the encoder count.
+ * Dithering works at the frame rate: each frame holds its duties for
+ * 2^rate_shift cycles, so the residual is spread over fewer PWM periods at
+ * high speed, where the quantization does not matter anyway.
+ */
+static void _cycle_output(struct rc_frame *f)
+{
+    if (f->enc)
+        _enc_commutate(f);
+    const volatile struct isense_scan *scan = &isense_ring[isense_last(isense_remaining())];
+
+    for (int i = 0; i < MOTOR_COUNT; i++) {
+        struct motor *m = motors + i;
+        if (!(f->mask & (1u << i)) || !m->enabled || (i == STEP_MOTOR && step_running))
+            continue;
+        if (dsp_en && !m->cur_en && !dither_en) {
+            uint32_t ab;
+            memcpy(&ab, f->v[i], sizeof(ab));
+            _motor_pwm_packed(m->port, ab);
+            if (m->damp_emf)
+                _damp_observe(m, scan, dsp_lo(ab), dsp_hi(ab), 1 << f->rate_shift);
+            continue;
+        }
+        int a = f->v[i][0];
+        int b = f->v[i][1];
+        if (m->cur_en) {
+            int ia = scan->raw[i * 2] - isense_zero;
+            int ib = scan->raw[i * 2 + 1] - isense_zero;
+            a = pi_cycle(&m->pi[0], ((a * m->cur_scale) >> 15) - ia);
+            b = pi_cycle(&m->pi[1], ((b * m->cur_scale) >> 15) - ib);
+        }
+        if (m->damp_emf)
+            _damp_observe(m, scan, a, b, 1 << f->rate_shift);
+        if (dither_en)
+            _motor_duty(m->port, duty_dither(a, pwm_range - 1, &m->dither[0]),
+                        duty_dither(b, pwm_range - 1, &m->dither[1]));
+        else
+            _motor_pwm(m->port, a, b);
+    }
+}
+
+/**
+ * Write the duties of a frame and set the period until the next one.
+ */
+static void _cycle_apply(struct rc_frame *f)
+{
+    _cycle_output(f);
+    pwm_set_repeat(rc_cycle_div << f->rate_shift);
+}
+
+// run at RC_CYCLE_FREQ or less, see rate_shift
+static void _cycle(void)
+{
+    static struct rc_frame inline_frame;
+
+    pwm_flush();
+    int rd = ahead_rd;
+    if (rd != ahead_wr) {
+        // the slot stays untouched by PendSV until the next one is popped
+        ahead_last = &ahead_ring[rd];
+        _cycle_apply(ahead_last);
+        ahead_rd = (rd + 1) & (RC_AHEAD_COUNT - 1);
+    } else {
+        ahead_underruns++;
+        if (!ahead_busy) {
+            _cycle_compute(&inline_frame);
+            ahead_last = &inline_frame;
+            _cycle_apply(ahead_last);
+        } else if (ahead_last) {
+            _cycle_output(ahead_last);
+            pwm_set_repeat(rc_cycle_div);
+            ahead_repeats++;
+        }
+    }
+    SCB->ICSR = SCB_ICSR_PENDSVSET_Msk;
 }
 
 #if 0
@@ -321,44 +1003,859 @@ void _stat_cmd(const struct cmd_def *def, struct cmd_ctx ctx, struct mod_arg_ite
     printf("c=%d\n", c);
 }
 
+void _cal_cmd(const struct cmd_def *def, struct cmd_ctx ctx, struct mod_arg_iterator *arg_it)
+{
+    const char *motor = mod_arg_iterator_next(arg_it);
+    const char *index = motor ? mod_arg_iterator_next(arg_it) : NULL;
+    const char *hex = index ? mod_arg_iterator_next(arg_it) : NULL;
+
+    if (!index) {
+        printf("missing argument\n");
+        return;
+    }
+    int n = atoi(motor);
+    int i = atoi(index);
+    if (n < 0 || n >= MOTOR_COUNT || i < 0 || i >= CAL_SIZE) {
+        printf("bad argument\n");
+        return;
+    }
+
+    if (!hex) {
+        cli_prefix_response();
+        cal_print_hex(&cal_tables[n], i, 16);
+        return;
+    }
+
+    _lock();
+    int count = cal_from_hex(&cal_tables[n], i, hex);
+    _unlock();
+    if (count < 0)
+        printf("bad data\n");
+}
+
+void _calsine_cmd(const struct cmd_def *def, struct cmd_ctx ctx, struct mod_arg_iterator *arg_it)
+{
+    const char *motor = mod_arg_iterator_next(arg_it);
+    int n = motor ? atoi(motor) : -1;
+
+    if (n < 0 || n >= MOTOR_COUNT) {
+        printf("bad argument\n");
+        return;
+    }
+    _lock();
+    cal_init_sine(&cal_tables[n]);
+    _unlock();
+}
+
+void _calsave_cmd(const struct cmd_def *def, struct cmd_ctx ctx, struct mod_arg_iterator *arg_it)
+{
+    // erasing flash stalls the CPU, control cycles would be missed
+    for (int i = 0; i < MOTOR_COUNT; i++) {
+        if (motors[i].enabled) {
+            printf("disable motors first\n");
+            return;
+        }
+    }
+    if (cal_save(cal_tables, MOTOR_COUNT) != 0)
+        printf("flash write failed\n");
+}
+
+/*
+ * Motor registers: the value of the definition points to the field of the
+ * first motor, the context tag is the motor index.
+ */
+static void *_motor_reg_ptr(const struct reg_def *def, struct reg_ctx ctx)
+{
+    return gmu_ptr_add(def->value, (int)ctx.tag * (int)sizeof(struct motor));
+}
+
+void _motor_reg_get(const struct reg_def *def, struct reg_ctx ctx, void *val)
+{
+    memcpy(val, _motor_reg_ptr(def, ctx), reg_size(def));
+}
+
+void _motor_reg_set(const struct reg_def *def, struct reg_ctx ctx, const void *val)
+{
+    memcpy(_motor_reg_ptr(def, ctx), val, reg_size(def));
+}
+
 void _spd_reg_set(const struct reg_def *def, struct reg_ctx ctx, const void *val)
 {
-    memcpy(def->value, val, sizeof(float));
-    float spd = gmu_get_as_f32(val);
-    ramp_set_spd(&ramp, spd);
+    struct motor *m = motors + ctx.tag;
+    _lock();
+    ramp_set_spd(&m->ramp, gmu_get_as_f32(val));
+    _unlock();
+}
+
+void _en_reg_set(const struct reg_def *def, struct reg_ctx ctx, const void *val)
+{
+    struct motor *m = motors + ctx.tag;
+    _motor_enable(m, gmu_get_as_bool(val));
+}
+
+void _port_reg_set(const struct reg_def *def, struct reg_ctx ctx, const void *val)
+{
+    struct motor *m = motors + ctx.tag;
+    int port = gmu_get_as_i32(val);
+    if (m->enabled) {
+        printf("disable motor first\n");
+        return;
+    }
+    if (port < 0 || port > PWM_PORT_COUNT - 4) {
+        printf("bad port\n");
+        return;
+    }
+    m->port = port;
+}
+
+void _lim_reg_set(const struct reg_def *def, struct reg_ctx ctx, const void *val)
+{
+    struct motor *m = motors + ctx.tag;
+    _lock();
+    _motor_reg_set(def, ctx, val);
+    ramp_set_limits(&m->ramp, m->lim_en, m->lim_min, m->lim_max);
+    _unlock();
+}
+
+void _adv_reg_set(const struct reg_def *def, struct reg_ctx ctx, const void *val)
+{
+    struct motor *m = motors + ctx.tag;
+    _lock();
+    _motor_reg_set(def, ctx, val);
+    _adv_update(m);
+    _unlock();
+}
+
+void _amp_reg_set(const struct reg_def *def, struct reg_ctx ctx, const void *val)
+{
+    struct motor *m = motors + ctx.tag;
+    _lock();
+    _motor_reg_set(def, ctx, val);
+    _amp_update(m);
+    _unlock();
+}
+
+/**
+ * Read a phase current, averaged over the last control cycle.
+ */
+void _i_reg_get(const struct reg_def *def, struct reg_ctx ctx, void *val)
+{
+    struct motor *m = motors + ctx.tag;
+    int phase = (int)((float *)_motor_reg_ptr(def, ctx) - m->i);
+    int channel = ctx.tag * 2 + phase;
+    float i = 0.0f;
+
+    if (pwm_edge) {
+        i = NAN; // sampled at the switching edges, see isense.c
+    } else if (channel < ISENSE_COUNT) {
+        int n = rc_cycle_div << rate_shift; // one scan per update event
+        if (n > ISENSE_RING - 1)
+            n = ISENSE_RING - 1;
+        i = (float)(isense_mean(channel, n) - isense_zero) * isense_gain;
+    }
+    m->i[phase] = i;
+    memcpy(val, &i, sizeof(i));
+}
+
+void _cur_en_reg_set(const struct reg_def *def, struct reg_ctx ctx, const void *val)
+{
+    struct motor *m = motors + ctx.tag;
+    bool en = gmu_get_as_bool(val);
+    if (en && ctx.tag * 2 + 1 >= ISENSE_COUNT) {
+        printf("no current sensor on this motor\n");
+        return;
+    }
+    if (en && pwm_edge) {
+        printf("current sensing needs center-aligned PWM\n");
+        return;
+    }
+    _lock();
+    pi_reset(&m->pi[0]);
+    pi_reset(&m->pi[1]);
+    m->cur_en = en;
+    _unlock();
+}
+
+void _cur_reg_set(const struct reg_def *def, struct reg_ctx ctx, const void *val)
+{
+    struct motor *m = motors + ctx.tag;
+    _lock();
+    _motor_reg_set(def, ctx, val);
+    _cur_update(m);
+    _unlock();
+}
+
+void _damp_reg_set(const struct reg_def *def, struct reg_ctx ctx, const void *val)
+{
+    struct motor *m = motors + ctx.tag;
+    _lock();
+    _motor_reg_set(def, ctx, val);
+    _damp_update(m);
+    _unlock();
+}
+
+void _vbus_reg_set(const struct reg_def *def, struct reg_ctx ctx, const void *val)
+{
+    _lock();
+    memcpy(def->value, val, reg_size(def));
+    for (int i = 0; i < MOTOR_COUNT; i++)
+        _damp_update(&motors[i]);
+    _unlock();
+}
+
+void _isense_reg_set(const struct reg_def *def, struct reg_ctx ctx, const void *val)
+{
+    _lock();
+    memcpy(def->value, val, reg_size(def));
+    for (int i = 0; i < MOTOR_COUNT; i++) {
+        _cur_update(&motors[i]);
+        _damp_update(&motors[i]);
+    }
+    _unlock();
+}
+
+void _wave_reg_set(const struct reg_def *def, struct reg_ctx ctx, const void *val)
+{
+    struct motor *m = motors + ctx.tag;
+    _lock();
+    _motor_reg_set(def, ctx, val);
+    _wave_update(m);
+    _unlock();
+}
+
+void _wave_hyst_reg_set(const struct reg_def *def, struct reg_ctx ctx, const void *val)
+{
+    _lock();
+    memcpy(def->value, val, reg_size(def));
+    for (int i = 0; i < MOTOR_COUNT; i++)
+        _wave_update(&motors[i]);
+    _unlock();
+}
+
+void _plan_reg_set(const struct reg_def *def, struct reg_ctx ctx, const void *val)
+{
+    memcpy(def->value, val, reg_size(def));
+    _lock();
+    for (int i = 0; i < MOTOR_COUNT; i++)
+        ramp_set_plan(&motors[i].ramp, plan_shift, plan_interp);
+    _unlock();
+}
+
+void _step_reg_set(const struct reg_def *def, struct reg_ctx ctx, const void *val)
+{
+    memcpy(def->value, val, reg_size(def));
+    if (step_res <= 0)
+        step_res = 1;
+
+    _lock();
+    step_running = false;
+    _unlock();
+
+    if (step_en) {
+        // control cycles masked, so the generator starts from the current ramp position
+        _lock();
+        _step_start();
+        step_running = true;
+        _unlock();
+    } else {
+        // a motor disabled meanwhile was left driven, see _motor_enable()
+        _lock();
+        if (!motors[STEP_MOTOR].enabled)
+            _motor_off(motors[STEP_MOTOR].port);
+        _unlock();
+        pwm_step_stop();
+    }
+}
+
+void _enc_reg_set(const struct reg_def *def, struct reg_ctx ctx, const void *val)
+{
+    bool en = gmu_get_as_bool(val);
+    if (en == enc_en)
+        return;
+
+    _lock();
+    if (en) {
+        pwm_enc_start();
+        cloop_start(&cloop, pwm_enc_count(), motors[ENC_MOTOR].ramp.x);
+    } else {
+        pwm_enc_stop();
+    }
+    enc_en = en;
+    _damp_update(&motors[ENC_MOTOR]);
+    damp_reset(&motors[ENC_MOTOR].damp);
+    _unlock();
+}
+
+void _enc_param_reg_set(const struct reg_def *def, struct reg_ctx ctx, const void *val)
+{
+    _lock();
+    memcpy(def->value, val, reg_size(def));
+    _enc_update();
+    _unlock();
+}
+
+void _enc_err_reg_get(const struct reg_def *def, struct reg_ctx ctx, void *val)
+{
+    traj_pos_t err = *(const traj_pos_t *)def->value;
+    *(float *)val = (float)err / (float)RAMP_POS_SCALE;
+}
+
+void _enc_stat_reg_set(const struct reg_def *def, struct reg_ctx ctx, const void *val)
+{
+    _lock();
+    cloop.err_max = 0;
+    cloop.losses = 0;
+    _unlock();
+}
+
+void _pwm_freq_reg_set(const struct reg_def *def, struct reg_ctx ctx, const void *val)
+{
+    _pwm_config(gmu_get_as_i32(val), pwm_edge);
+}
+
+void _pwm_edge_reg_set(const struct reg_def *def, struct reg_ctx ctx, const void *val)
+{
+    _pwm_config(pwm_freq, gmu_get_as_bool(val));
+}
+
+void _pwm_stagger_reg_set(const struct reg_def *def, struct reg_ctx ctx, const void *val)
+{
+    if (step_en) {
+        printf("disable step mode first\n");
+        return;
+    }
+    _lock();
+    int rc = pwm_set_stagger(gmu_get_as_f32(val));
+    _unlock();
+    if (rc)
+        printf("bad stagger\n");
+}
+
+void _dma_reg_set(const struct reg_def *def, struct reg_ctx ctx, const void *val)
+{
+    memcpy(def->value, val, reg_size(def));
+    NVIC_DisableIRQ(TIM1_UP_TIM10_IRQn);
+    pwm_set_dma(dma_en);
+    NVIC_EnableIRQ(TIM1_UP_TIM10_IRQn);
 }
 
 void stepper_pwm(int port, float value)
 {
-    volatile uint32_t *reg = _tim_reg(port);
+    pwm_set(port, duty_get((int)lroundf(value * SINLUT_ONE), pwm_range - 1));
+}
+
+/**
+ * Fill the commutation ring. Runs at the lowest priority, so it is
+ * preempted by the control ISR.
+ */
+void PendSV_Handler(void)
+{
+    uint32_t t0 = core_get_cycles();
+    pend_running = true;
+
+    for (;;) {
+        int wr = ahead_wr;
+        int next = (wr + 1) & (RC_AHEAD_COUNT - 1);
+        if (next == ahead_rd)
+            break;
+        ahead_busy = true;
+        _cycle_compute(&ahead_ring[wr]);
+        ahead_wr = next; // publish before clearing busy, so that frames stay in order
+        ahead_busy = false;
+    }
 
-    int pwm = (int)roundf((0.5f + 0.5f * value) * (RC_RANGE - 1));
-    *reg = pwm;
+    pend_running = false;
+    pend_cycles += core_get_cycles() - t0;
 }
 
 void TIM1_UP_TIM10_IRQHandler(void)
 {
+    uint32_t t0 = core_get_cycles();
+
     TIM_ClearITPendingBit(TIM1, TIM_IT_Update);
     c++;
-    if ((c % 8) == 0)
-        _cycle();
+    _cycle();
+
+    uint32_t dt = core_get_cycles() - t0;
+    load_cycles += dt;
+    if (pend_running)
+        pend_cycles -= dt; // counted by PendSV too
+    load_calls++;
+    if (dt > cyc_max)
+        cyc_max = dt;
 }
 
-static struct reg_def _regs[] = {
+static struct reg_def _motor_regs[] = {
     {
+        .type = REG_TYPE_BOOL,
+        .value = &motors[0].enabled,
+        .name = "en",
+        .help = "enable the motor",
+        .get = _motor_reg_get,
+        .set = _en_reg_set,
+    }, {
+        .type = REG_TYPE_I32,
+        .value = &motors[0].port,
+        .name = "port",
+        .help = "first of the 4 ports driven by the motor",
+        .get = _motor_reg_get,
+        .set = _port_reg_set,
+    }, {
         .type = REG_TYPE_F32,
-        .value = &spd,
-        .name = "stspd",
+        .value = &motors[0].ramp.spd,
+        .name = "spd",
         .help = "stapper speed in electric tours per seconds",
+        .get = _motor_reg_get,
         .set = _spd_reg_set,
+    }, {
+        .type = REG_TYPE_BOOL,
+        .value = &motors[0].lim_en,
+        .name = "lim",
+        .help = "enable soft position limits",
+        .get = _motor_reg_get,
+        .set = _lim_reg_set,
+    }, {
+        .type = REG_TYPE_F32,
+        .value = &motors[0].lim_min,
+        .name = "min",
+        .help = "soft min position in electric tours",
+        .get = _motor_reg_get,
+        .set = _lim_reg_set,
+    }, {
+        .type = REG_TYPE_F32,
+        .value = &motors[0].lim_max,
+        .name = "max",
+        .help = "soft max position in electric tours",
+        .get = _motor_reg_get,
+        .set = _lim_reg_set,
+    }, {
+        .type = REG_TYPE_BOOL,
+        .value = &motors[0].ramp.traj.limited,
+        .name = "limited",
+        .help = "current movement bounded by a soft limit",
+        .get = _motor_reg_get,
+        .set = reg_fake_setter,
+    }, {
+        .type = REG_TYPE_I32,
+        .value = &motors[0].ramp.traj.limit_count,
+        .name = "limcnt",
+        .help = "number of movements bounded by a soft limit",
+        .get = _motor_reg_get,
+        .set = reg_fake_setter,
+    }, {
+        .type = REG_TYPE_U32,
+        .value = &motors[0].cyc,
+        .name = "cyc",
+        .help = "average CPU cycles per control cycle for this motor",
+        .get = _motor_reg_get,
+        .set = reg_fake_setter,
+    }, {
+        .type = REG_TYPE_F32,
+        .value = &motors[0].adv_lead,
+        .name = "lead",
+        .help = "winding L/R time constant in us for phase advance, 0 to disable",
+        .get = _motor_reg_get,
+        .set = _adv_reg_set,
+    }, {
+        .type = REG_TYPE_F32,
+        .value = &motors[0].adv_max,
+        .name = "advmax",
+        .help = "max phase advance in degrees",
+        .get = _motor_reg_get,
+        .set = _adv_reg_set,
+    }, {
+        .type = REG_TYPE_BOOL,
+        .value = &motors[0].cal_en,
+        .name = "cal",
+        .help = "use the calibration table instead of sin/cos, see stcal",
+        .get = _motor_reg_get,
+        .set = _motor_reg_set,
+    }, {
+        .type = REG_TYPE_F32,
+        .value = &motors[0].amp_hold,
+        .name = "hold",
+        .help = "voltage amplitude at standstill, from 0 to 1",
+        .get = _motor_reg_get,
+        .set = _amp_reg_set,
+    }, {
+        .type = REG_TYPE_F32,
+        .value = &motors[0].amp_run,
+        .name = "run",
+        .help = "voltage amplitude while moving, from 0 to 1",
+        .get = _motor_reg_get,
+        .set = _amp_reg_set,
+    }, {
+        .type = REG_TYPE_F32,
+        .value = &motors[0].amp_emf,
+        .name = "emf",
+        .help = "back-EMF feedforward amplitude per electric tour per second",
+        .get = _motor_reg_get,
+        .set = _amp_reg_set,
+    }, {
+        .type = REG_TYPE_F32,
+        .value = &motors[0].wave_half,
+        .name = "half",
+        .help = "speed in electric tours per second above which half-step is used, 0 to disable",
+        .get = _motor_reg_get,
+        .set = _wave_reg_set,
+    }, {
+        .type = REG_TYPE_F32,
+        .value = &motors[0].wave_full,
+        .name = "full",
+        .help = "speed in electric tours per second above which full-step is used, 0 to disable",
+        .get = _motor_reg_get,
+        .set = _wave_reg_set,
+    }, {
+        .type = REG_TYPE_I32,
+        .value = &motors[0].wave,
+        .name = "wave",
+        .help = "current waveform (0=microstep, 1=half-step, 2=full-step)",
+        .get = _motor_reg_get,
+        .set = reg_fake_setter,
+    }, {
+        .type = REG_TYPE_F32,
+        .value = &motors[0].i[0],
+        .name = "ia",
+        .help = "phase a current in A over the last cycle, motors 0 and 1 only, nan in edge mode",
+        .get = _i_reg_get,
+        .set = reg_fake_setter,
+    }, {
+        .type = REG_TYPE_F32,
+        .value = &motors[0].i[1],
+        .name = "ib",
+        .help = "phase b current in A over the last cycle, motors 0 and 1 only, nan in edge mode",
+        .get = _i_reg_get,
+        .set = reg_fake_setter,
+    }, {
+        .type = REG_TYPE_BOOL,
+        .value = &motors[0].cur_en,
+        .name = "cur",
+        .help = "current mode, motors 0 and 1 only",
+        .get = _motor_reg_get,
+        .set = _cur_en_reg_set,
+    }, {
+        .type = REG_TYPE_F32,
+        .value = &motors[0].cur_set,
+        .name = "iset",
+        .help = "current in A at full amplitude in current mode",
+        .get = _motor_reg_get,
+        .set = _cur_reg_set,
+    }, {
+        .type = REG_TYPE_F32,
+        .value = &motors[0].cur_kp,
+        .name = "kp",
+        .help = "current loop proportional gain, full scale voltage per A",
+        .get = _motor_reg_get,
+        .set = _cur_reg_set,
+    }, {
+        .type = REG_TYPE_F32,
+        .value = &motors[0].cur_ki,
+        .name = "ki",
+        .help = "current loop integral gain, full scale voltage per A per ms",
+        .get = _motor_reg_get,
+        .set = _cur_reg_set,
+    }, {
+        .type = REG_TYPE_F32,
+        .value = &motors[0].damp_gain,
+        .name = "damp",
+        .help = "anti-resonance correction per velocity error in ms, 0 to disable, motors 0 and 1 only",
+        .get = _motor_reg_get,
+        .set = _damp_reg_set,
+    }, {
+        .type = REG_TYPE_F32,
+        .value = &motors[0].damp_max,
+        .name = "dampmax",
+        .help = "max anti-resonance correction in degrees",
+        .get = _motor_reg_get,
+        .set = _damp_reg_set,
+    }, {
+        .type = REG_TYPE_F32,
+        .value = &motors[0].damp_vmin,
+        .name = "dampv",
+        .help = "speed in electric tours per second below which damping is off",
+        .get = _motor_reg_get,
+        .set = _damp_reg_set,
+    }, {
+        .type = REG_TYPE_F32,
+        .value = &motors[0].damp_r,
+        .name = "dampr",
+        .help = "winding resistance in ohms for damping without encoder, rather low than high",
+        .get = _motor_reg_get,
+        .set = _damp_reg_set,
+    }, {
+        .type = REG_TYPE_F32,
+        .value = &motors[0].damp_l,
+        .name = "dampl",
+        .help = "winding inductance in mH for damping without encoder, rather low than high",
+        .get = _motor_reg_get,
+        .set = _damp_reg_set,
+    }
+};
+
+static struct reg_def _regs[] = {
+    {
+        .type = REG_TYPE_I32,
+        .value = &plan_shift,
+        .name = "stplan",
+        .help = "planner runs once every 2^stplan max rate cycles",
+        .set = _plan_reg_set,
+    }, {
+        .type = REG_TYPE_I32,
+        .value = &plan_interp,
+        .name = "stinterp",
+        .help = "interpolation between planner steps (0=linear, 1=quadratic)",
+        .set = _plan_reg_set,
+    }, {
+        .type = REG_TYPE_I32,
+        .value = &pwm_freq,
+        .name = "stpwm",
+        .help = "PWM frequency in Hz",
+        .set = _pwm_freq_reg_set,
+    }, {
+        .type = REG_TYPE_BOOL,
+        .value = &pwm_edge,
+        .name = "stpwmedge",
+        .help = "edge-aligned PWM instead of center-aligned, doubling the range",
+        .set = _pwm_edge_reg_set,
+    }, {
+        .type = REG_TYPE_I32,
+        .value = &pwm_range,
+        .name = "stpwmrange",
+        .help = "PWM resolution in counts per period",
+        .set = reg_fake_setter,
+    }, {
+        .type = REG_TYPE_F32,
+        .value = &pwm_stagger,
+        .name = "stpwmstagger",
+        .help = "counter offset between successive timers in periods, up to 0.1 if center-aligned",
+        .set = _pwm_stagger_reg_set,
+    }, {
+        .type = REG_TYPE_BOOL,
+        .value = &dither_en,
+        .name = "stdither",
+        .help = "dither duties to get sub-count resolution on average",
+    }, {
+        .type = REG_TYPE_BOOL,
+        .value = &dsp_en,
+        .name = "stdsp",
+        .help = "compute sines and duties of both phases at once with the M4 SIMD instructions",
+    }, {
+        .type = REG_TYPE_F32,
+        .value = &rc_cycle_freq,
+        .name = "stcycfreq",
+        .help = "max control rate in Hz, derived from the PWM frequency",
+        .set = reg_fake_setter,
+    }, {
+        .type = REG_TYPE_BOOL,
+        .value = &dma_en,
+        .name = "stdma",
+        .help = "update PWM duties by timer DMA bursts instead of CCR writes",
+        .set = _dma_reg_set,
+    }, {
+        .type = REG_TYPE_F32,
+        .value = &load,
+        .name = "stload",
+        .help = "CPU load of the stepper ISR in percent",
+        .set = reg_fake_setter,
+    }, {
+        .type = REG_TYPE_U32,
+        .value = &cyc_avg,
+        .name = "stcyc",
+        .help = "average CPU cycles per stepper ISR",
+        .set = reg_fake_setter,
+    }, {
+        .type = REG_TYPE_U32,
+        .value = &cyc_max,
+        .name = "stcycmax",
+        .help = "max CPU cycles per stepper ISR (write to reset)",
+    }, {
+        .type = REG_TYPE_U32,
+        .value = &irq_rate,
+        .name = "stirq",
+        .help = "stepper ISR calls per second",
+        .set = reg_fake_setter,
+    }, {
+        .type = REG_TYPE_F32,
+        .value = &pend_load,
+        .name = "stloadpend",
+        .help = "CPU load of the commutation producer (PendSV) in percent",
+        .set = reg_fake_setter,
+    }, {
+        .type = REG_TYPE_F32,
+        .value = &load_avg,
+        .name = "stloadavg",
+        .help = "average CPU load of the stepper (ISR + PendSV) in percent",
+        .set = reg_fake_setter,
+    }, {
+        .type = REG_TYPE_BOOL,
+        .value = &rate_adapt,
+        .name = "stadapt",
+        .help = "adapt the control rate to the speed",
+    }, {
+        .type = REG_TYPE_BOOL,
+        .value = &enc_en,
+        .name = "stenc",
+        .help = "closed loop on motor 0 with an encoder on PA0/PA1, ports 16-19 are lost",
+        .set = _enc_reg_set,
+    }, {
+        .type = REG_TYPE_F32,
+        .value = &enc_cpt,
+        .name = "stenccpt",
+        .help = "encoder counts per electric tour, negative to invert the direction",
+        .set = _enc_param_reg_set,
+    }, {
+        .type = REG_TYPE_F32,
+        .value = &enc_lead,
+        .name = "stenclead",
+        .help = "max load angle in degrees",
+        .set = _enc_param_reg_set,
+    }, {
+        .type = REG_TYPE_F32,
+        .value = &enc_gain,
+        .name = "stencgain",
+        .help = "amplitude added at the max load angle, from 0 to 1",
+        .set = _enc_param_reg_set,
+    }, {
+        .type = REG_TYPE_F32,
+        .value = &enc_thr,
+        .name = "stencthr",
+        .help = "following error in degrees counted as a step loss",
+        .set = _enc_param_reg_set,
+    }, {
+        .type = REG_TYPE_F32,
+        .value = &cloop.err,
+        .name = "stencerr",
+        .help = "following error in electric tours",
+        .get = _enc_err_reg_get,
+        .set = reg_fake_setter,
+    }, {
+        .type = REG_TYPE_F32,
+        .value = &cloop.err_max,
+        .name = "stencmax",
+        .help = "max absolute following error in electric tours, write to reset",
+        .get = _enc_err_reg_get,
+        .set = _enc_stat_reg_set,
+    }, {
+        .type = REG_TYPE_I32,
+        .value = &cloop.losses,
+        .name = "stencloss",
+        .help = "number of step-loss events, write to reset",
+        .set = _enc_stat_reg_set,
+    }, {
+        .type = REG_TYPE_F32,
+        .value = &wave_hyst,
+        .name = "stwavehyst",
+        .help = "hysteresis of the waveform switching speeds, as a fraction",
+        .set = _wave_hyst_reg_set,
+    }, {
+        .type = REG_TYPE_BOOL,
+        .value = &wave_boost,
+        .name = "stwaveboost",
+        .help = "diagonal steps with both phases fully on, +41% torque and current",
+    }, {
+        .type = REG_TYPE_F32,
+        .value = &isense_gain,
+        .name = "stigain",
+        .help = "current sensor gain in A per ADC count",
+        .set = _isense_reg_set,
+    }, {
+        .type = REG_TYPE_I32,
+        .value = &isense_zero,
+        .name = "stizero",
+        .help = "ADC count at 0 A",
+    }, {
+        .type = REG_TYPE_F32,
+        .value = &vbus,
+        .name = "stvbus",
+        .help = "H-bridge supply voltage in V, for damping without encoder",
+        .set = _vbus_reg_set,
+    }, {
+        .type = REG_TYPE_I32,
+        .value = &rate_samples,
+        .name = "stsamples",
+        .help = "min control cycles per electric tour when adapting the rate",
+    }, {
+        .type = REG_TYPE_I32,
+        .value = &ahead_underruns,
+        .name = "stunder",
+        .help = "number of control cycles with an empty commutation ring",
+        .set = reg_fake_setter,
+    }, {
+        .type = REG_TYPE_BOOL,
+        .value = &step_en,
+        .name = "ststep",
+        .help = "motor 5 drives step/dir on TIM8 (PC6=step, PC7=dir) instead of PWM",
+        .set = _step_reg_set,
+    }, {
+        .type = REG_TYPE_I32,
+        .value = &step_res,
+        .name = "ststepres",
+        .help = "steps per electric tour for the step/dir output",
+        .set = _step_reg_set,
+    }, {
+        .type = REG_TYPE_I32,
+        .value = &stepgen.steps,
+        .name = "ststeps",
+        .help = "number of generated steps",
+        .set = reg_fake_setter,
+    }, {
+        .type = REG_TYPE_I32,
+        .value = &stepgen.late,
+        .name = "ststeplate",
+        .help = "number of steps delayed because too close to the previous one",
+        .set = reg_fake_setter,
+    }, {
+        .type = REG_TYPE_I32,
+        .value = &step_underruns,
+        .name = "ststepunder",
+        .help = "number of cycles where the step DMA caught up with the generator",
+        .set = reg_fake_setter,
     }
 };
 
+static const struct reg_def *_reg_lookup(const char *reg_name, struct reg_ctx *ctx_out)
+{
+    // motor registers are named st<n><name>
+    if (reg_name[0] == 's' && reg_name[1] == 't' && gmu_is_digit(reg_name[2])) {
+        int index = reg_name[2] - '0';
+        if (index >= MOTOR_COUNT)
+            return NULL;
+        const struct reg_def *def = reg_lookup(_motor_regs, GMU_ARRAY_LEN(_motor_regs), reg_name + 3, ctx_out);
+        if (def)
+            ctx_out->tag = index;
+        return def;
+    }
+
+    return reg_lookup(_regs, GMU_ARRAY_LEN(_regs), reg_name, ctx_out);
+}
+
+static void _reg_help(void)
+{
+    printf("module st - registers\n");
+    reg_help(_regs, GMU_ARRAY_LEN(_regs), 1);
+    printf(" st<n><name> for motor n from 0 to %d\n", MOTOR_COUNT - 1);
+    reg_help(_motor_regs, GMU_ARRAY_LEN(_motor_regs), 2);
+}
+
 static const struct cmd_def _cmds[] = {
     {
         .name = "ststat",
         .help = "stapper state",
         .exec = _stat_cmd,
+    }, {
+        .name = "stcal",
+        .usage = "<motor> <index> [<hex>]",
+        .help = "write calibration points from index as little-endian int16 a,b pairs, or print 16 points",
+        .exec = _cal_cmd,
+    }, {
+        .name = "stcalsine",
+        .usage = "<motor>",
+        .help = "reset the calibration table to a pure sine",
+        .exec = _calsine_cmd,
+    }, {
+        .name = "stcalsave",
+        .help = "store all calibration tables in flash",
+        .exec = _calsave_cmd,
     }
 };
 
@@ -370,6 +1867,8 @@ const struct mod stepper_mod = {
     .loop = _loop,
     .reg_list = _regs,
     .reg_count = GMU_ARRAY_LEN(_regs),
+    .reg_lookup = _reg_lookup,
+    .reg_help = _reg_help,
     .cmd_list = _cmds,
     .cmd_count = GMU_ARRAY_LEN(_cmds),
 };
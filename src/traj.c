@@ -55,6 +55,15 @@
  * starts in the direction given by sdir, accelerates up to sv, then continues
  * at constant speed forever. The value of sx is ignored.
  *
+ * Soft limits:
+ * When limits is true, the position is kept within [min_x, max_x]. A target
+ * position sx outside this range is clamped to the nearest limit. An infinite
+ * movement is planned as if the limit in the direction of sdir was its target,
+ * so the speed decreases in time to stop exactly on the limit; at this point
+ * the movement becomes a standard movement with sx set to the limit. Each time
+ * a movement is bounded by a limit, the limited flag is set and limit_count is
+ * incremented. The limited flag is cleared when a new movement starts.
+ *
  * When a movement is in progress, you can call traj_brake() to stop the
  * movement. The speed will decrease with the programmed deceleration until
  * it reaches zero.
@@ -104,10 +113,23 @@ static int _pos_sign(traj_pos_t a)
 }
 
 /**
- * This function computes the next position in the trajectory. It must
- * be called once per cycle.
+ * Called when the movement is bounded by a soft limit. The limit becomes
+ * the target of a standard movement.
  */
-void traj_step(struct traj *traj)
+static void _hit_limit(struct traj *traj, traj_pos_t limit)
+{
+    traj->sx = limit;
+    traj->sdir = 0;
+    traj->limited = true;
+    traj->limit_count++;
+}
+
+/**
+ * Compute the next position in the trajectory, without the jerk limiter.
+ * This is the first half of traj_step(), exposed for batch kernels
+ * running the jerk limiter of many trajectories at once.
+ */
+void traj_plan(struct traj *traj)
 {
     int         sa = traj->sa;
     int         sv = traj->sv;
@@ -124,6 +146,13 @@ void traj_step(struct traj *traj)
     traj_pos_t  nx_r;
     traj_pos_t  brake_dist;
     traj_pos_t  vv = (traj_pos_t)v * v;
+    bool        bounded = !traj->sdir; // true if sx bounds the movement
+
+    if (traj->sdir && traj->limits) {
+        // plan an infinite movement as if the limit was the target
+        sx = (traj->sdir > 0) ? traj->max_x : traj->min_x;
+        bounded = true;
+    }
 
 step:
     switch (traj->state) {
@@ -132,11 +161,28 @@ step:
                 break;
             traj->moving = true;
             traj->jl_moving = TRAJ_JL_SIZE;
+            traj->limited = false;
             traj->state = TRAJ_STATE_START;
             goto step;
 
         case TRAJ_STATE_START:
 
+            // apply soft limits
+            if (traj->limits) {
+                if (traj->sdir) {
+                    if ((sx - x) * traj->sdir <= 0) {
+                        // already on or beyond the limit, go back to it
+                        _hit_limit(traj, sx);
+                    }
+                } else if (sx > traj->max_x) {
+                    sx = traj->max_x;
+                    _hit_limit(traj, sx);
+                } else if (sx < traj->min_x) {
+                    sx = traj->min_x;
+                    _hit_limit(traj, sx);
+                }
+            }
+
             // define in which direction we reach the target
             if (traj->sdir) {
                 dir = traj->sdir;
@@ -180,13 +226,17 @@ step:
             nv = v + sa * dir;
             nx = x + (v + nv) / 2;
             nx_r = (sx - nx) * dir;
-            if (_sign(nv) == dir && !traj->sdir) {
+            if (_sign(nv) == dir && bounded) {
                 if (nx_r <= 0) {
+                    if (traj->sdir)
+                        _hit_limit(traj, sx);
                     traj->state = TRAJ_STATE_STANDSTILL;
                     goto step;
                 }
                 na_b = (int)(vv / (nx_r * 2) + 1);
                 if (na_b > sa) {
+                    if (traj->sdir)
+                        _hit_limit(traj, sx);
                     traj->state = TRAJ_STATE_DEC_TO_ZERO;
                     goto step;
                 }
@@ -211,17 +261,21 @@ step:
             nv = sv * dir;
             nx = x + (v + nv) / 2;
 
-            if (traj->sdir)
+            if (!bounded)
                 break;
 
             nx_r = (sx - nx) * dir;
             if (nx_r <= 0) {
+                if (traj->sdir)
+                    _hit_limit(traj, sx);
                 traj->state = TRAJ_STATE_STANDSTILL;
                 goto step;
             }
 
             na_b = (int)(vv / (nx_r * 2) + 1);
             if (na_b > sa) {
+                if (traj->sdir)
+                    _hit_limit(traj, sx);
                 traj->state = TRAJ_STATE_DEC_TO_ZERO;
                 goto step;
             }
@@ -270,8 +324,18 @@ step:
     traj->x = nx;
     traj->v = nv;
     traj->dir = dir;
+}
+
+/**
+ * This function computes the next position in the trajectory. It must
+ * be called once per cycle.
+ */
+void traj_step(struct traj *traj)
+{
+    traj_plan(traj);
 
     // filter to limit the jerk
+    traj_pos_t nx = traj->x;
     traj_pos_t out = traj->jl_array[traj->jl_index];
     traj->jl_array[traj->jl_index] = nx;
     traj->jl_acc += nx - out;
@@ -324,6 +388,7 @@ void traj_jump(struct traj *traj, traj_pos_t x)
     traj->v = 0;
     traj->state = TRAJ_STATE_WAIT;
     traj->moving = false;
+    traj->limited = false;
 
     for (int i=0; i<TRAJ_JL_SIZE; i++)
         traj->jl_array[i] = x;
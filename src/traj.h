@@ -67,6 +67,11 @@ struct traj {
     traj_pos_t sx;
     int        sdir; // infinite mode direction
 
+    // soft limits (public), enforced only when limits is true
+    bool       limits;
+    traj_pos_t min_x;
+    traj_pos_t max_x;
+
     // used internally by traj_step() (private)
     int dir; // direction in which we plan to reach the target (this is not always the start dir)
     int state;
@@ -77,6 +82,8 @@ struct traj {
 
     // output status (public)
     bool moving;
+    bool limited;     // the current movement has been bounded by a soft limit
+    int  limit_count; // number of movements bounded by a soft limit
 
     // jerk limiter (private)
     traj_pos_t jl_array[TRAJ_JL_SIZE];
@@ -93,6 +100,7 @@ struct traj {
 
 /*** prototypes ***/
 
+void traj_plan(struct traj *traj);
 void traj_step(struct traj *traj);
 void traj_update(struct traj *traj);
 void traj_brake(struct traj *traj);
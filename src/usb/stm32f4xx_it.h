@@ -42,7 +42,7 @@ void BusFault_Handler(void);
 void UsageFault_Handler(void);
 void SVC_Handler(void);
 void DebugMon_Handler(void);
-void PendSV_Handler(void);
+// void PendSV_Handler(void);
 // void SysTick_Handler(void);
 
 #ifdef __cplusplus